@@ -0,0 +1,110 @@
+/* A write-back cache of file blocks used in the server. */
+
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define BCACHE_BLOCK_SIZE 4096
+
+/* Most blocks handed to the write op at once. */
+#define BCACHE_WRITE_BATCH 32
+
+/* Embedded in each file whose blocks may be cached. size is the file's
+   length including data not yet written back, or -1 until it is needed.
+   blocks lists the file's cached blocks. dirty_blocks lists the dirty
+   ones among them, those holding data not yet written back, so that a
+   flush visits only those, and dirty counts them. version changes
+   whenever the file's data on disk may change behind the cache, so that
+   blocks read from it earlier are not filled in. While the file has
+   dirty blocks, or, in a durable cache, data written back but not yet
+   synced, it is on the cache's list of files to flush. */
+typedef struct bcache_file {
+	int64_t size;
+	struct bcache_block *blocks;
+	struct bcache_block *dirty_blocks;
+	size_t dirty;
+	uint64_t version;
+	char listed;
+	char unsynced;
+	struct bcache_file *flush_prev;
+	struct bcache_file *flush_next;
+} bcache_file_t;
+
+/* A frame of the cache. file is a null pointer while the frame is free.
+   The bytes in [dirty_start, dirty_end) have not been written back; the
+   range is empty when the two are equal. Bytes past the end of the file
+   are zero. referenced is the CLOCK bit, set on every use and cleared as
+   the hand passes. A dirty block is also on its file's dirty list. */
+typedef struct bcache_block {
+	bcache_file_t *file;
+	uint64_t index;
+	uint32_t dirty_start;
+	uint32_t dirty_end;
+	char referenced;
+	char *data;
+	struct bcache_block *hash_next;
+	struct bcache_block *file_prev;
+	struct bcache_block *file_next;
+	struct bcache_block *dirty_prev;
+	struct bcache_block *dirty_next;
+} bcache_block_t;
+
+/* A write back of len bytes at offset. result is set to the number of
+   bytes written, or a negated errno value. */
+typedef struct {
+	const char *buf;
+	size_t len;
+	off_t offset;
+	ssize_t result;
+} bcache_io_t;
+
+/* How the cache reaches the disk. read, size and sync return what
+   pread(), the file's size, or fdatasync() would, with -1 and errno set
+   on failure. write performs up to BCACHE_WRITE_BATCH write backs to the
+   file, in any order or together, and sets each one's result; it
+   returns 0, or -1 and sets errno if the file cannot be written at
+   all. */
+typedef struct {
+	ssize_t (*read)(bcache_file_t *file, char *buf, size_t len, off_t offset);
+	int (*write)(bcache_file_t *file, bcache_io_t *writes, size_t count);
+	int64_t (*size)(bcache_file_t *file);
+	int (*sync)(bcache_file_t *file);
+} bcache_ops_t;
+
+/* A fixed number of frames, replaced in CLOCK order: the hand sweeps the
+   frames, skipping and clearing those referenced since it last passed,
+   and writing back a dirty victim before reusing it. Blocks are found
+   through a chained table keyed by file and block number. A durable
+   cache keeps files it wrote back listed until bcache_flush() syncs
+   them. */
+typedef struct {
+	bcache_block_t *frames;
+	char *data;
+	size_t capacity;
+	size_t used;
+	size_t hand;
+	size_t dirty;
+	bcache_block_t **buckets;
+	size_t bucket_mask;
+	bcache_file_t *flush_head;
+	const bcache_ops_t *ops;
+	char durable;
+} bcache_t;
+
+int bcache_init(bcache_t *cache, size_t capacity, const bcache_ops_t *ops, char durable);
+void bcache_destroy(bcache_t *cache);
+void bcache_file_init(bcache_file_t *file);
+ssize_t bcache_read(bcache_t *cache, bcache_file_t *file, char *buf, size_t len, off_t offset);
+ssize_t bcache_write(bcache_t *cache, bcache_file_t *file, const char *data, size_t len, off_t offset);
+int bcache_flush_file(bcache_t *cache, bcache_file_t *file, char sync);
+int bcache_flush(bcache_t *cache, char sync);
+int bcache_drop_file(bcache_t *cache, bcache_file_t *file);
+int bcache_missing(bcache_t *cache, bcache_file_t *file, size_t len, off_t offset, char write,
+	uint64_t *first, uint64_t *last);
+void bcache_fill(bcache_t *cache, bcache_file_t *file, const char *data, size_t len, off_t offset,
+	uint64_t version);
+
+#endif /* BCACHE_H */
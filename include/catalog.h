@@ -0,0 +1,64 @@
+/* A persistent, memory-mapped catalog of the files on disk used in the
+   server. */
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* The catalog file is a header followed by a power-of-two number of
+   fixed-size slots, an open-addressed hash table probed linearly and
+   mapped straight into memory, so opening it costs a check of the header
+   but no parse and no directory scan. At most half the slots are in use,
+   so a probe reaches an empty one; in a damaged file a probe gives up
+   after one pass over the slots. A slot is in use when its hash
+   is not 0; its name holds the machine name followed by the filename,
+   not NUL-terminated. The hash is htable_hash() of the machine name
+   chained into the filename, with 0 replaced by 1. All integers are in
+   host byte order.
+
+   A slot is filled before its hash is stored, so other processes may map
+   the file read-only and look names up while the server adds to it. When
+   the table grows, a larger copy replaces the file by rename, and readers
+   keep seeing the old copy until they map the file again. */
+typedef struct {
+	uint32_t magic; /* CATALOG_MAGIC */
+	uint32_t version; /* CATALOG_VERSION */
+	uint64_t slots;
+	uint64_t count;
+	uint64_t reserved;
+} catalog_header_t;
+
+typedef struct {
+	uint64_t hash;
+	uint8_t machine_len;
+	uint8_t filename_len;
+	uint8_t reserved[6];
+	char name[240];
+} catalog_slot_t;
+
+#define CATALOG_MAGIC 0x31435346u /* "FSC1" */
+#define CATALOG_VERSION 1
+#define CATALOG_INITIAL_SLOTS 1024
+
+/* A mapped catalog. Workers share it, so lookups and additions hold the
+   lock; it is only consulted when a name is not already in a worker's
+   own file table. */
+typedef struct {
+	char *path;
+	int fd;
+	char *map;
+	size_t size;
+	pthread_mutex_t lock;
+} catalog_t;
+
+int catalog_open(catalog_t *catalog, const char *path);
+int catalog_contains(catalog_t *catalog, const char *machine, size_t machine_len,
+	const char *filename, size_t filename_len);
+int catalog_add(catalog_t *catalog, const char *machine, size_t machine_len,
+	const char *filename, size_t filename_len);
+void catalog_close(catalog_t *catalog);
+
+#endif /* CATALOG_H */
@@ -0,0 +1,38 @@
+/* A bounded LRU cache of open file descriptors used in the server. */
+
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include <stddef.h>
+
+/* Embedded in each object that owns a cacheable descriptor. fd is -1
+   while nothing is cached for the object. */
+typedef struct fdcache_entry {
+	int fd;
+	struct fdcache_entry *prev;
+	struct fdcache_entry *next;
+} fdcache_entry_t;
+
+/* Entries are kept on a circular list headed by a sentinel, most
+   recently used first. Descriptors past capacity are closed from the
+   tail. */
+typedef struct {
+	fdcache_entry_t head;
+	size_t size;
+	size_t capacity;
+} fdcache_t;
+
+void fdcache_init(fdcache_t *cache, size_t capacity);
+void fdcache_entry_init(fdcache_entry_t *entry);
+int fdcache_get(fdcache_t *cache, fdcache_entry_t *entry);
+void fdcache_put(fdcache_t *cache, fdcache_entry_t *entry, int fd);
+void fdcache_drop(fdcache_t *cache, fdcache_entry_t *entry);
+int fdcache_evict(fdcache_t *cache);
+
+/* Default capacity when none is requested. */
+#define FDCACHE_DEFAULT_CAPACITY 1024
+
+/* Descriptors left free for sockets, logs and other server files. */
+#define FDCACHE_RESERVED_FDS 64
+
+#endif /* FDCACHE_H */
@@ -0,0 +1,106 @@
+/* A client library for the file server, speaking the binary protocol. */
+
+#ifndef FSCLIENT_H
+#define FSCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "request.h"
+
+/* The server's duplicate window: how many request numbers back it
+   remembers the replies. */
+#define FSCLIENT_MAX_WINDOW 16
+
+/* Controls how requests are sent and retransmitted.
+
+   window is how many requests may be outstanding at once; 1 is
+   stop-and-wait. The server runs each request once however the network
+   reorders them as long as they are within its duplicate window of
+   FSCLIENT_MAX_WINDOW request numbers, so a larger window is cut down
+   to that. A request is retransmitted when no reply arrives within the
+   retransmission timeout, which starts at initial_rto_ms, then follows
+   the measured round trip time within [min_rto_ms, max_rto_ms], and
+   doubles for each retransmission of the same request. A request that
+   has been sent max_attempts times without a reply fails; 0 means keep
+   trying.
+
+   If incarnation_file is set, it holds the incarnation number across
+   runs of the program, and every connection starts the next
+   incarnation, so the server releases whatever the previous run left
+   locked. Otherwise the connection uses incarnation. */
+typedef struct {
+	int window;
+	long initial_rto_ms;
+	long min_rto_ms;
+	long max_rto_ms;
+	int max_attempts;
+	const char *incarnation_file;
+	int32_t incarnation;
+} fsclient_options_t;
+
+/* A connection to the server as one (machine, client) pair. */
+typedef struct fsclient fsclient_t;
+
+/* Called when a request completes. status is the server's status, or -1
+   if the request ran out of attempts. data holds size bytes read, and is
+   only valid during the call. */
+typedef void (*fsclient_callback_t)(void *arg, int status, int32_t size, const char *data);
+
+/* Fills in the default options. */
+void fsclient_default_options(fsclient_options_t *options);
+
+/* Connects to the server at server_ip:port as the given machine and
+   client. options may be a null pointer for the defaults. Returns a null
+   pointer and sets errno on failure. */
+fsclient_t *fsclient_connect(const char *server_ip, unsigned short port, const char *machine,
+	int32_t client, const fsclient_options_t *options);
+
+/* Closes the connection. Outstanding requests are abandoned. */
+void fsclient_disconnect(fsclient_t *client);
+
+/* Starts a new incarnation: requests are numbered from 1 again, and the
+   server releases everything the client held. Outstanding requests are
+   abandoned. Returns 0 if successful, -1 if the incarnation file could
+   not be updated. */
+int fsclient_restart(fsclient_t *client);
+
+/* Sends a request without waiting for its reply, waiting first for room
+   in the window if it is full. flags holds BIN_FLAG_* bits, such as
+   BIN_FLAG_WAIT for an open that waits for the lock instead of failing.
+   callback is called when the reply arrives, from within a later
+   fsclient call. Returns the request number, or -1 and sets errno if the
+   request cannot be sent. */
+int32_t fsclient_submit(fsclient_t *client, opcode_t opcode, const char *filename, int mode,
+	int flags, int64_t offset, const void *data, size_t length, fsclient_callback_t callback,
+	void *arg);
+
+/* Waits until no more than outstanding requests are in flight. Returns
+   0 if successful, -1 and sets errno on failure. */
+int fsclient_drain(fsclient_t *client, int outstanding);
+
+/* Synchronous operations. Each sends one request and waits for its
+   reply, completing other outstanding requests meanwhile. They return 0,
+   or for reads and writes the number of bytes, if successful, and
+   otherwise -1 with errno set to the server's status, or to ETIMEDOUT if
+   no reply came. */
+int fsclient_open(fsclient_t *client, const char *filename, int mode);
+int fsclient_close(fsclient_t *client, const char *filename);
+ssize_t fsclient_read(fsclient_t *client, const char *filename, void *buffer, size_t length);
+ssize_t fsclient_write(fsclient_t *client, const char *filename, const void *data, size_t length);
+int fsclient_lseek(fsclient_t *client, const char *filename, int64_t offset);
+int fsclient_renew(fsclient_t *client);
+
+/* Locks, or unlocks, length bytes from offset of a file opened with
+   BIN_MODE_RANGES in its mode; a length of 0 covers every byte from
+   offset on. mode is 1 for a shared lock and 2 for an exclusive one. A
+   lock that conflicts with another client's fails with EAGAIN. */
+int fsclient_lock(fsclient_t *client, const char *filename, int mode, int64_t offset,
+	uint32_t length);
+int fsclient_unlock(fsclient_t *client, const char *filename, int64_t offset, uint32_t length);
+
+/* Returns the current retransmission timeout in milliseconds. */
+long fsclient_rto_ms(const fsclient_t *client);
+
+#endif /* FSCLIENT_H */
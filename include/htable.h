@@ -0,0 +1,43 @@
+/* A chained hash table with incremental resizing used in the server. */
+
+#ifndef HTABLE_H
+#define HTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A single entry in a bucket chain. The full hash is kept so chains
+   can be walked and migrated without recomputing it. */
+typedef struct htable_node {
+	uint64_t hash;
+	void *element;
+	struct htable_node *next;
+} htable_node_t;
+
+/* Compares an element stored in the table against a lookup key.
+   Returns nonzero if they match. */
+typedef int (*htable_match_t)(const void *element, const void *key);
+
+/* While the table is growing, elements live in both buckets[0] (the
+   old table) and buckets[1] (the new table). Every operation migrates
+   a few old buckets so that no single call pays for the whole rehash. */
+typedef struct {
+	htable_node_t **buckets[2];
+	size_t nbuckets[2];
+	size_t size;
+	size_t rehash_index;
+	char rehashing;
+} htable_t;
+
+void htable_init(htable_t *table);
+void * htable_find(htable_t *table, uint64_t hash, htable_match_t match, const void *key);
+int htable_insert(htable_t *table, uint64_t hash, void *element);
+void * htable_remove(htable_t *table, uint64_t hash, htable_match_t match, const void *key);
+
+/* Hashes a run of bytes, continuing from the given seed. Use
+   HTABLE_SEED for the first call. */
+uint64_t htable_hash(const void *data, size_t len, uint64_t seed);
+
+#define HTABLE_SEED 14695981039346656037ULL
+
+#endif /* HTABLE_H */
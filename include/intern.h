@@ -0,0 +1,22 @@
+/* A string interning table used in the server. */
+
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+
+#include "htable.h"
+
+/* Holds one copy of every distinct string added to it. Strings returned
+   by the same table are equal if and only if their pointers are equal,
+   so interned keys can be compared and hashed by address. Interned
+   strings live as long as the table. */
+typedef struct {
+	htable_t strings;
+} intern_t;
+
+void intern_init(intern_t *table);
+const char * intern(intern_t *table, const char *str, size_t len);
+const char * intern_lookup(intern_t *table, const char *str, size_t len);
+
+#endif /* INTERN_H */
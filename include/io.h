@@ -0,0 +1,62 @@
+/* Pluggable disk I/O backends used in the server. */
+
+#ifndef IO_H
+#define IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* A positioned read or write of one buffer. result is the number of bytes
+   transferred, or a negated errno value. The buffer must stay valid until
+   the request completes. next is the backend's. */
+typedef struct io_request {
+	int fd;
+	char write;
+	char *buf;
+	size_t len;
+	off_t offset;
+	ssize_t result;
+	struct io_request *next;
+} io_request_t;
+
+/* Called on the submitting thread for every request that completes after
+   submit() returned. */
+typedef void (*io_done_t)(io_request_t *request);
+
+/* A disk I/O backend. Each thread using one calls init() first; state is
+   per thread.
+
+   init() prepares for up to depth requests in flight and sets *event_fd
+   to a descriptor that becomes readable when requests complete, or to -1
+   if requests always complete inside submit(). It returns 0 if
+   successful, -1 if the backend cannot be used here.
+
+   submit() starts a request. It returns 1 if the request already
+   completed, with result set and without calling done, or 0 if done
+   will be called from a later reap().
+
+   reap() calls done for every request that has completed since the last
+   call.
+
+   wait() blocks until a request that submit() left in flight completes,
+   and sets its result without calling done. Other requests that
+   complete meanwhile are held for the next reap(). */
+typedef struct {
+	const char *name;
+	int (*init)(unsigned depth, io_done_t done, int *event_fd);
+	int (*submit)(io_request_t *request);
+	void (*reap)(void);
+	void (*wait)(io_request_t *request);
+} io_backend_t;
+
+/* Performs every request with pread() or pwrite() inside submit(). */
+extern const io_backend_t io_sync_backend;
+
+/* Submits requests to an io_uring and completes them asynchronously.
+   Requests beyond the ring's depth are performed synchronously. */
+extern const io_backend_t io_uring_backend;
+
+/* Returns the backend with the given name, or a null pointer. */
+const io_backend_t *io_backend_named(const char *name);
+
+#endif /* IO_H */
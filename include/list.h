@@ -13,5 +13,6 @@ void list_init(list_t *list);
 void * list_at(list_t *list, size_t index);
 int list_append(list_t *list, void *element);
 void * list_remove(list_t *list, size_t index);
+int list_insert(list_t *list, size_t index, void *element);
 
 #endif /* LIST_H */
\ No newline at end of file
@@ -0,0 +1,68 @@
+/* Header file for loadgen.c */
+
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <stdint.h>
+
+#include "request.h"
+#include "stats.h"
+
+/* Operations the load generator issues and reports on. */
+typedef enum {
+	LG_OPEN = 0,
+	LG_CLOSE,
+	LG_READ,
+	LG_WRITE,
+	LG_LSEEK,
+	LG_OTHER,
+	LG_OPS
+} lg_op_t;
+
+/* One recorded request to replay. */
+typedef struct {
+	int identity; /* Index into the identity table */
+	int32_t request; /* Request number, or 0 to number automatically */
+	int32_t incarnation;
+	int64_t at_us; /* When to send it relative to the start, or -1 for as soon as possible */
+	int next; /* The identity's next record, or -1 */
+	char operation[80];
+} lg_record_t;
+
+/* Longest binary request the load generator sends: an operation string
+   holds the file name and any data to write. */
+#define LG_MAX_REQUEST (sizeof(bin_request_t) + 80)
+
+/* A simulated (machine, client) pair. Every identity has its own socket
+   and at most one request in flight, which it sends in the binary format
+   so that a reply says which request it answers: a late reply to an
+   earlier, retransmitted request is dropped rather than taken for the
+   current one. */
+typedef struct {
+	char machine[24];
+	int32_t client;
+	int32_t incarnation;
+	int32_t request;
+	int sock;
+	char busy;
+	char file_open;
+	lg_op_t op;
+	int next_record; /* The next record to replay, or -1 */
+	uint64_t intended; /* When the request in flight should have been sent */
+	uint64_t sent; /* When it was last (re)sent */
+	size_t pending_size;
+	char pending[LG_MAX_REQUEST];
+} lg_identity_t;
+
+/* Results gathered by one worker thread. */
+typedef struct {
+	uint64_t completed[LG_OPS];
+	uint64_t errors[LG_OPS];
+	uint64_t retransmits[LG_OPS];
+	histogram_t latency[LG_OPS];
+} lg_results_t;
+
+int main(int argc, char **argv);
+void fail_with_error(const char *msg);
+
+#endif /* LOADGEN_H */
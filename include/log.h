@@ -0,0 +1,46 @@
+/* Leveled, asynchronous logging used in the server. */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+typedef enum {
+	LOG_LEVEL_ERROR = 0,
+	LOG_LEVEL_WARNING = 1,
+	LOG_LEVEL_INFO = 2,
+	LOG_LEVEL_DEBUG = 3
+} log_level_t;
+
+/* Messages above this level are discarded before they are formatted. */
+extern log_level_t log_level;
+
+/* Starts the background thread that writes queued messages to standard
+   output. Messages logged before this are dropped. */
+void log_init(log_level_t level);
+
+/* Formats a message into the log ring. Never blocks: if the ring is
+   full the message is dropped and counted. */
+void log_write(log_level_t level, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/* Writes every queued message from the calling thread. Used before the
+   process exits. */
+void log_drain(void);
+
+/* Returns the number of messages dropped because the ring was full. */
+uint64_t log_dropped(void);
+
+/* Parses a level name (error, warning, info or debug). Returns 0 if
+   successful, -1 if the name is unknown. */
+int log_parse_level(const char *name, log_level_t *level);
+
+#define log_message(level, ...) \
+	do { if ((level) <= log_level) log_write((level), __VA_ARGS__); } while (0)
+
+#define log_error(...) log_message(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...) log_message(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_info(...) log_message(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_message(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif /* LOG_H */
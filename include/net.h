@@ -0,0 +1,87 @@
+/* The datagram receive and send loop used in the server. */
+
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+/* Handles one received datagram. Replies are queued with
+   net_reply_start() and net_reply_finish(). */
+typedef void (*net_handler_t)(char *message, size_t message_size,
+	struct sockaddr_in *from);
+
+/* Controls how the loop moves datagrams.
+
+   A batch_size of 1 uses one recvfrom() and one sendto() per request.
+   Larger batches receive up to batch_size requests per recvmmsg() and
+   send all of their replies with one sendmmsg(). After the first
+   request of a batch arrives, the loop waits at most batch_wait_us
+   microseconds for the rest. Each reply datagram holds at most
+   reply_capacity bytes.
+
+   threads workers each own a socket bound to the same port with
+   SO_REUSEPORT. Every datagram belongs to the worker selected by
+   hashing its shard key, the NUL-terminated string of at most
+   shard_key_len bytes found at shard_key_offset. The kernel is asked to
+   deliver each datagram straight to its worker; any datagram that still
+   lands on another worker is handed off to its owner.
+
+   If timer is set, every worker calls it on its own thread before each
+   wait for datagrams. It returns the longest the worker may wait before
+   calling it again, in milliseconds, or -1 for no limit. It may queue
+   replies.
+
+   If commit is set, every worker calls it before sending the replies
+   queued while handling a batch, so that whatever the requests changed
+   can be made durable once per batch rather than once per request. */
+typedef struct {
+	size_t batch_size;
+	long batch_wait_us;
+	size_t message_capacity;
+	size_t reply_capacity;
+	int threads;
+	size_t shard_key_offset;
+	size_t shard_key_len;
+	long (*timer)(void);
+	void (*commit)(void);
+} net_options_t;
+
+#define NET_MAX_BATCH 1024
+#define NET_MAX_THREADS 256
+#define NET_MAX_SHARD_KEY 32
+
+/* Replies a worker can queue before it has to flush them. */
+#define NET_MIN_REPLY_SLOTS 16
+
+/* Opens one socket per worker on the given port, then receives and
+   answers datagrams forever. init is called on each worker's thread
+   before it starts serving, so it can set up that worker's state. */
+void net_serve(unsigned short port, const net_options_t *options,
+	net_handler_t handler, void (*init)(void));
+
+/* Starts a reply datagram to the given address on the calling worker.
+   Returns a buffer of *capacity bytes to write the reply into. */
+char *net_reply_start(const struct sockaddr_in *to, size_t *capacity);
+
+/* Queues the reply started by net_reply_start(), which holds size bytes.
+   A size of 0 discards it. Queued replies are sent together once the
+   current batch has been handled. */
+void net_reply_finish(size_t size);
+
+/* Makes the calling worker poll fd along with its socket, and call ready
+   on its own thread whenever fd is readable. ready may queue replies.
+   Called from init, once per worker. */
+void net_watch(int fd, void (*ready)(void));
+
+/* Returns the index of the calling worker. */
+int net_worker_index(void);
+
+/* Returns the index of the worker that owns a shard key. */
+int net_shard_of(const char *key, size_t key_len, int threads);
+
+/* Displays an error message and exits the process. Provided by the
+   program using this module. */
+void fail_with_error(const char *msg);
+
+#endif /* NET_H */
@@ -0,0 +1,24 @@
+/* A fixed-size object allocator used in the server. */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/* Hands out objects of one size carved from larger slabs. Freed objects
+   go on a free list and are reused before any new slab is allocated, so
+   once a pool has grown to its working set, allocating and freeing never
+   touch the heap. Slabs are never returned to the system. */
+typedef struct {
+	size_t object_size;
+	size_t per_slab;
+	void *free_list;
+	size_t slabs;
+	size_t in_use;
+} pool_t;
+
+void pool_init(pool_t *pool, size_t object_size, size_t per_slab);
+void * pool_alloc(pool_t *pool);
+void pool_free(pool_t *pool, void *object);
+
+#endif /* POOL_H */
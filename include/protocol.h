@@ -0,0 +1,41 @@
+/* Decoding of requests and encoding of responses for both wire formats. */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include "server.h"
+
+/* Longest file name accepted in a request. */
+#define MAX_FILENAME_LEN 200
+
+/* Largest datagram the server accepts in either format. */
+#define MAX_REQUEST_SIZE BIN_MAX_DATAGRAM
+
+/* Returns nonzero if the datagram starts with the binary magic number
+   and a supported version. */
+char is_binary_request(const char *message, size_t message_size);
+
+/* Decodes a text request_t in place. Returns 0 if successful, or -1 if
+   the request is malformed and should be ignored. */
+int decode_text_request(request_t *request, request_header_t *header, op_t *op);
+
+/* Decodes a binary request in place, without copying the name or data.
+   Returns 0 if successful, or -1 if the request is malformed and should
+   be ignored. */
+int decode_binary_request(char *message, size_t message_size,
+	request_header_t *header, op_t *op);
+
+/* Decodes the next operation of an OP_COMPOUND request that
+   decode_binary_request() accepted, and advances *cursor past it. */
+void decode_compound_op(const char **cursor, op_t *op);
+
+/* Queues the response to a request in the format the request came in.
+   Streamed reads are sent as a sequence of chunks; for OP_RESEND only
+   the chunks it lists are sent. */
+void send_response(request_header_t *header, op_t *op, response_t *response,
+	char binary, struct sockaddr_in *to);
+
+/* Returns a printable name of an opcode. */
+const char *opcode_name(opcode_t opcode);
+
+#endif /* PROTOCOL_H */
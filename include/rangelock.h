@@ -0,0 +1,59 @@
+/* Byte-range locks on a file, kept in an interval tree, used in the server. */
+
+#ifndef RANGELOCK_H
+#define RANGELOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A lock on the bytes in [start, end), shared if write is not set. An
+   owner holds at most one lock on each range. max_end is the largest
+   end in the subtree rooted at the lock. */
+typedef struct rangelock {
+	uint64_t start;
+	uint64_t end;
+	const void *owner;
+	char write;
+	uint64_t max_end;
+	int height;
+	struct rangelock *left;
+	struct rangelock *right;
+} rangelock_t;
+
+/* The locks on a file in an AVL tree ordered by start, then end, then
+   owner, and augmented with max_end, so that the locks overlapping a
+   range are found without visiting those that end before it. */
+typedef struct {
+	rangelock_t *root;
+	size_t count;
+} rangelock_tree_t;
+
+/* Called for each lock by rangelock_each(), in order. */
+typedef void (*rangelock_visit_t)(const rangelock_t *lock, void *arg);
+
+void rangelock_tree_init(rangelock_tree_t *tree);
+void rangelock_tree_destroy(rangelock_tree_t *tree);
+
+/* Returns a lock of an owner other than the given one that overlaps
+   [start, end) and conflicts with reading it, or with writing it if write
+   is set, or a null pointer if there is none. */
+const rangelock_t *rangelock_conflict(const rangelock_tree_t *tree, uint64_t start, uint64_t end,
+	const void *owner, char write);
+
+/* Locks [start, end) for the owner, or changes whether the owner's lock
+   on exactly that range is shared. Conflicts are not checked. Returns 0
+   if successful, -1 if the memory could not be allocated. */
+int rangelock_set(rangelock_tree_t *tree, uint64_t start, uint64_t end, const void *owner,
+	char write);
+
+/* Releases the owner's locks on the bytes in [start, end), as POSIX
+   record locks are released: a lock that extends past the range keeps
+   the part outside it, so one that covers the range on both sides is
+   split in two. Returns how many of the owner's locks overlapped the
+   range, or -1 if the memory to split one could not be allocated, in
+   which case nothing is released. */
+long rangelock_release(rangelock_tree_t *tree, uint64_t start, uint64_t end, const void *owner);
+
+void rangelock_each(const rangelock_tree_t *tree, rangelock_visit_t visit, void *arg);
+
+#endif /* RANGELOCK_H */
@@ -14,10 +14,144 @@ typedef struct {
     char operation[80]; /* File operation client sends to server */
 } request_t;
 
+/* A response. size is the number of bytes read or written, and for reads
+   result holds the data. On the wire a text response always carries
+   exactly TEXT_RESULT_SIZE result bytes, so the server allocates at least
+   that many for every response. */
 typedef struct {
 	int32_t status;
 	int32_t size;
-	char result[80];
+	char result[];
 } response_t;
 
+#define TEXT_RESULT_SIZE 80
+#define TEXT_RESPONSE_SIZE (sizeof(response_t) + TEXT_RESULT_SIZE)
+
+/* Binary requests start with this magic number and a version byte, which
+   is how the server tells them apart from text request_t datagrams on
+   the same port. All integers are in host byte order, as in request_t. */
+#define BIN_REQUEST_MAGIC 0x31425346u /* "FSB1" */
+#define BIN_REQUEST_VERSION 1
+
+/* Operation codes carried by binary requests. */
+typedef enum {
+    OP_INVALID = 0,
+    OP_OPEN = 1,
+    OP_CLOSE = 2,
+    OP_READ = 3,
+    OP_WRITE = 4,
+    OP_LSEEK = 5,
+    OP_READ_STREAM = 6,
+    OP_RESEND = 7,
+    OP_RENEW = 8,
+    OP_COMPOUND = 9,
+    OP_LOCK = 10,
+    OP_UNLOCK = 11
+} opcode_t;
+
+/* Fixed header of a binary request. It is followed by name_len bytes of
+   file name (not NUL-terminated) and then, for writes, length bytes of
+   data, or for OP_RESEND, length 32-bit chunk numbers. machine sits at
+   the same offset as in request_t, so both formats are sharded by the
+   same bytes. */
+typedef struct {
+    uint32_t magic; /* BIN_REQUEST_MAGIC */
+    uint8_t version; /* BIN_REQUEST_VERSION */
+    uint8_t opcode; /* An opcode_t */
+    uint8_t mode; /* open: 1 for read, 2 for write, 3 for readwrite,
+                     plus BIN_MODE_RANGES; lock: 1 for a shared lock,
+                     2 for an exclusive one */
+    uint8_t flags; /* BIN_FLAG_* bits; other bits must be 0 */
+    uint16_t name_len; /* Length of the file name following the header */
+    uint16_t reserved; /* Must be 0 */
+    uint32_t length; /* read: bytes wanted, write: bytes of data,
+                        resend: chunk count, lock and unlock: bytes in
+                        the range, 0 for all past offset */
+    char machine[24]; /* NUL-terminated name of the client's machine */
+    int32_t client; /* Client number */
+    int32_t request; /* Request number of client */
+    int32_t incarnation; /* Incarnation number of client's machine */
+    int32_t padding; /* Must be 0 */
+    int64_t offset; /* lseek: new position, lock and unlock: start of
+                       the range */
+} bin_request_t;
+
+/* open: wait for conflicting locks to be released instead of failing. */
+#define BIN_FLAG_WAIT 0x01
+
+/* open mode: share the file with other clients opening it this way,
+   which lock the byte ranges they use with OP_LOCK instead of the whole
+   file. Their reads and writes fail with EAGAIN where they overlap a
+   conflicting lock of another client; a lock that would conflict with
+   another client's fails the same way, without waiting. OP_UNLOCK
+   releases its range from the client's locks, which keep any bytes
+   outside it, as POSIX record locks do, and closing the file releases
+   all of them. */
+#define BIN_MODE_RANGES 0x04
+
+/* An OP_COMPOUND request carries length operations, run in order, in
+   place of a file name (name_len is 0). Each is one of these headers
+   followed by name_len bytes of file name and, for writes, length bytes
+   of data. Only open, close, read, write, lseek, renew, lock and unlock
+   may be part of a compound, and open never waits. The whole compound
+   is one request for retransmission. */
+typedef struct {
+    uint8_t opcode; /* An opcode_t */
+    uint8_t mode; /* As in bin_request_t */
+    uint16_t name_len; /* Length of the file name following the header */
+    uint32_t length; /* As in bin_request_t */
+    int64_t offset; /* As in bin_request_t */
+} bin_op_t;
+
+/* The reply to an OP_COMPOUND holds one result per operation that ran,
+   in order; operations after the first failure do not run. The reply's
+   status is that of the failed operation, or 0, and its size is the
+   number of bytes of results. A read's result is followed by size bytes
+   of data. */
+typedef struct {
+    int32_t status;
+    int32_t size;
+} bin_result_t;
+
+/* Reply to a binary request. request echoes the request number being
+   answered and size is the number of bytes read or written. A read reply
+   is followed by size bytes of data; other replies carry no data. */
+typedef struct {
+    uint32_t magic; /* BIN_REQUEST_MAGIC */
+    int32_t status;
+    int32_t request;
+    int32_t size;
+} bin_response_t;
+
+/* Largest UDP payload over IPv4. */
+#define BIN_MAX_DATAGRAM 65507
+
+/* Most data a single OP_READ or OP_WRITE datagram can carry. */
+#define BIN_MAX_RESULT (BIN_MAX_DATAGRAM - sizeof(bin_response_t))
+
+/* Streamed reads (OP_READ_STREAM) return up to BIN_MAX_STREAM bytes as a
+   sequence of chunk datagrams, each holding BIN_CHUNK_SIZE bytes of data
+   except the last. So that a stream does not overrun the client's
+   receive buffer, no request is answered with more than
+   BIN_STREAM_WINDOW chunks: OP_READ_STREAM gets the first ones, and the
+   client asks for the rest, and for any it missed, by sending OP_RESEND
+   with the stream's request number and the chunk numbers it wants. Only
+   the first BIN_STREAM_WINDOW of those are sent. Resending the
+   OP_READ_STREAM request itself sends the first chunks again. The server
+   remembers only so much stream data per client; once a newer stream
+   pushes an older one out, the older one's chunks come back as a single
+   chunk with status EIO and the client has to read again. */
+typedef struct {
+    uint32_t magic; /* BIN_REQUEST_MAGIC */
+    int32_t status;
+    int32_t request;
+    int32_t size; /* Total bytes in the stream */
+    uint32_t seq; /* Number of this chunk, from 0 */
+    uint32_t chunks; /* Total number of chunks */
+} bin_chunk_t;
+
+#define BIN_CHUNK_SIZE (BIN_MAX_DATAGRAM - sizeof(bin_chunk_t))
+#define BIN_MAX_STREAM (8 * 1024 * 1024)
+#define BIN_STREAM_WINDOW 4
+
 #endif /* REQUEST_H */
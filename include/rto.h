@@ -0,0 +1,30 @@
+/* A retransmission timeout estimator used in the client library. */
+
+#ifndef RTO_H
+#define RTO_H
+
+#include <stdint.h>
+
+/* Follows RFC 6298: srtt and rttvar are the smoothed round trip time
+   and its mean deviation in microseconds, and rto_ms is srtt plus four
+   times rttvar, kept within [min_rto_ms, max_rto_ms]. Until the first
+   sample, rto_ms is the initial timeout. */
+typedef struct {
+	char have_rtt;
+	double srtt;
+	double rttvar;
+	long rto_ms;
+	long min_rto_ms;
+	long max_rto_ms;
+} rto_t;
+
+void rto_init(rto_t *rto, long initial_ms, long min_ms, long max_ms);
+
+/* Feeds a round trip time into the estimate. */
+void rto_sample(rto_t *rto, uint64_t rtt_us);
+
+/* Returns the timeout for the next retransmission of a request whose
+   last timeout was rto_ms: twice that, but no more than max_rto_ms. */
+long rto_backoff(const rto_t *rto, long rto_ms);
+
+#endif /* RTO_H */
@@ -8,76 +8,343 @@
 
 #include "request.h"
 #include "list.h"
+#include "smallvec.h"
+#include "fdcache.h"
+#include "wheel.h"
+#include "wal.h"
+#include "catalog.h"
+#include "io.h"
+#include "bcache.h"
+#include "rangelock.h"
 
+/* Lock modes. An open with LOCK_RANGES takes no lock on the whole file
+and is instead checked against the byte-range locks of the clients
+sharing the file the same way; a file so opened is locked LOCK_RANGES. */
 typedef enum {
 	LOCK_UNLOCKED = 0,
 	LOCK_READ = 1,
-	LOCK_WRITE = 2
+	LOCK_WRITE = 2,
+	LOCK_RANGES = 4
 } lock_t;
 
-/* Contains information about a client, such as it's machine, client
-number, last request number, last incarnation number, the last response
-sent to it, and a list of the statuses of all the files it has open
-(mode and position in the file). */
+/* How many of a client's most recent request numbers are remembered
+with their responses. A power of two. */
+#define DEDUP_WINDOW 16
+
+/* Most bytes of streamed read data a client's remembered responses may
+hold. Past it, the oldest streams are remembered as failed with EIO. */
+#define RECENT_STREAM_BYTES BIN_MAX_STREAM
+
+/* A request a client sent recently and its response, which is a null
+pointer while the request has no answer yet. result_len is how many
+bytes of the response's result are read data. */
+typedef struct {
+	int request;
+	uint32_t result_len;
+	response_t *response;
+} recent_request_t;
+
+/* Part of a file read ahead, holding len bytes from offset. */
+typedef struct {
+	char *data;
+	size_t capacity;
+	size_t offset;
+	size_t len;
+} readahead_buffer_t;
+
+/* Data read ahead of a client that reads a file sequentially. Reads are
+served from current, and then from next, which is read ahead while
+current is consumed. window is how much the next read-ahead reads; it
+doubles every time a whole buffer is consumed. eof is where a read-ahead
+found the end of the file, or SIZE_MAX. A read-ahead still in flight
+when it is cancelled is discarded when it completes, and one whose open
+file went away frees everything when it completes. */
+typedef struct readahead {
+	readahead_buffer_t current;
+	readahead_buffer_t next;
+	size_t window;
+	size_t eof;
+	char inflight;
+	char discard;
+	char orphaned;
+} readahead_t;
+
+/* Contains the information about a file that a client currently has open,
+such as the mode in which the file was opened and the current position
+of the client's "cursor" within the file. next_read is where the next
+read starts if the client reads sequentially, and sequential counts its
+reads in a row that did; readahead is allocated once there are enough
+of them. */
 typedef struct {
+	struct file_entry *file;
+	lock_t mode;
+	size_t position;
+	size_t next_read;
+	int sequential;
+	readahead_t *readahead;
+} file_state_t;
+
+/* The files a client has open, held inline up to the number most
+clients have. */
+SMALLVEC_DEFINE(fstate_vec, file_state_t, 4)
+
+/* A request that arrived while an earlier request of its client was
+still waiting for locks or for the disk. It holds a copy of the
+datagram, which is handled again once the requests before it have been
+answered, so the client sees its requests complete in order. */
+typedef struct deferred_request {
+	struct deferred_request *next;
+	int request;
+	struct sockaddr_in from;
+	size_t size;
+	char message[];
+} deferred_request_t;
+
+/* Most requests a client may have deferred at once. */
+#define DEFERRED_MAX DEDUP_WINDOW
+
+/* Contains information about a client, such as it's machine, client
+number, highest request number, last incarnation number, and the
+statuses of all the files it has open (mode and position in the file),
+which are stored in the vector itself, so a pointer to one is only valid
+until the client opens or closes a file. recent is a ring of the
+requests within DEDUP_WINDOW of last_request that have been performed,
+indexed by request number modulo DEDUP_WINDOW, so requests may arrive
+out of order within the window and still run once. address and binary
+record where and in which format its last request came, so that replies
+can be sent outside of a request. waiting is its queued open, if it has
+one. lease is pending while the client holds locks and leases are on;
+when it fires, the client is presumed dead and its locks are released.
+pending_io is the client's disk read or write in flight, if it has one;
+its request is answered when that completes. Requests that arrive while
+it waits or has I/O in flight wait in the deferred queue, oldest first.
+ready is set while the client is on its worker's list of clients whose
+deferred requests can run. */
+typedef struct client {
 	char machine[24];
 	int id;
 	int last_request;
 	int last_incarn;
-	response_t *last_response;
-	list_t fstates;
+	recent_request_t recent[DEDUP_WINDOW];
+	fstate_vec_t fstates;
+	struct sockaddr_in address;
+	char binary;
+	struct lock_waiter *waiting;
+	wheel_timer_t lease;
+	struct pending_io *pending_io;
+	deferred_request_t *deferred_head;
+	deferred_request_t *deferred_tail;
+	int deferred_count;
+	char ready;
+	struct client *ready_next;
 } client_t;
 
+/* The clients holding a read lock on a file, held inline up to the
+number most files have. */
+SMALLVEC_DEFINE(client_vec, client_t*, 4)
+
 /* Contains information about a file, such as the machine name, file
-name, whether it is locked, and who holds the locks. If the lock is
+name, whether it is locked, and who holds the locks. The machine and
+file names are interned in the server's string table, so two entries
+name the same file exactly when both pointers are equal. If the lock is
 a write lock, writeholder will point to the client structure that
 holds the lock and readholders will be empty, and if a read lock is
 held, writeholder will be null and readholders will contains a list of
 all clients holding a read lock (multiple read locks can be held at the
-same time). */
-typedef struct {
-	char machine[24];
-	char filename[24];
+same time). If the lock is LOCK_RANGES, readholders lists the clients
+that have the file open for byte-range locking, and range_locks holds
+their locks. cached_fd holds the file's descriptor while it is in the
+server's descriptor cache, and cached_blocks tracks its blocks in the
+block cache. waiters_head and waiters_tail are the queue
+of opens waiting for the locks to allow them, oldest first. */
+typedef struct file_entry {
+	const char *machine;
+	const char *filename;
 	lock_t lock;
 	client_t *writeholder;
-	list_t readholders;
+	client_vec_t readholders;
+	rangelock_tree_t range_locks;
+	fdcache_entry_t cached_fd;
+	bcache_file_t cached_blocks;
+	struct lock_waiter *waiters_head;
+	struct lock_waiter *waiters_tail;
 } file_entry_t;
 
-/* Contains the information about a file that a client currently has open,
-such as the mode in which the file was opened and the current position
-of the client's "cursor" within the file. */
-typedef struct {
+/* An open that asked to wait for conflicting locks rather than fail. It
+sits in its file's queue, and in the worker's expiry list, which is in
+deadline order because every waiter gets the same timeout. request is
+the number of the open, which is answered when the waiter leaves the
+queue. */
+typedef struct lock_waiter {
+	client_t *client;
+	int request;
 	file_entry_t *file;
 	lock_t mode;
-	size_t position;
-} file_state_t;
+	uint64_t deadline; /* Monotonic time in milliseconds */
+	struct lock_waiter *prev;
+	struct lock_waiter *next;
+	struct lock_waiter *expiry_prev;
+	struct lock_waiter *expiry_next;
+} lock_waiter_t;
+
+/* A read or write submitted to the disk I/O backend on behalf of a
+client. The file is looked up again on completion, since the client may
+have lost it meanwhile. For writes, data is a copy of the request's data
+made when the backend completes requests asynchronously, since the
+received datagram does not outlive the request. A read-ahead has
+readahead set and no client. A read of the blocks a cached read or
+write of len bytes is missing has cached set; data holds the blocks,
+then a copy of the data to write, and version is the file's version in
+the block cache when the read started. */
+typedef struct pending_io {
+	io_request_t io;
+	client_t *client;
+	file_entry_t *file;
+	opcode_t opcode;
+	int request;
+	int incarnation;
+	response_t *response;
+	char *data;
+	uint64_t start;
+	struct readahead *readahead;
+	char cached;
+	size_t len;
+	uint64_t version;
+} pending_io_t;
+
+/* Orders in which queued opens are granted. LOCK_QUEUE_FIFO grants
+strictly in arrival order. LOCK_QUEUE_FAIR grants every queued reader
+together whenever the oldest waiter is a reader, so readers and writers
+take turns and neither waits behind more than one phase of the other. */
+typedef enum {
+	LOCK_QUEUE_FIFO = 0,
+	LOCK_QUEUE_FAIR
+} lock_queue_policy_t;
+
+/* When data written through the block cache is synced to disk.
+DURABILITY_NONE leaves it to the kernel, DURABILITY_CLOSE syncs a file
+when a client closes it, and DURABILITY_FSYNC syncs every file a batch
+of requests wrote before any of their replies are sent, so that one
+sync per file commits the whole batch. */
+typedef enum {
+	DURABILITY_NONE = 0,
+	DURABILITY_CLOSE,
+	DURABILITY_FSYNC
+} durability_t;
+
+/* Identifies the client and request number a datagram carries. machine
+points into the received datagram and is NUL-terminated. from is the
+sender's address, or a null pointer if there is none, and binary is set
+for requests in the binary format. message is the datagram itself, or a
+null pointer if there is none, and deferred is set when it is a
+deferred request being handled again. */
+typedef struct {
+	const char *machine;
+	int client;
+	int request;
+	int incarnation;
+	const struct sockaddr_in *from;
+	char binary;
+	const char *message;
+	size_t message_size;
+	char deferred;
+} request_header_t;
+
+/* An operation decoded from either wire format. filename and data point
+into the received datagram; filename is not NUL-terminated. max_result
+is the most data a read can return in the request's format. Fields an
+operation does not use are zero. */
+typedef struct {
+	opcode_t opcode;
+	const char *filename;
+	size_t filename_len;
+	lock_t mode;
+	int64_t offset;
+	int64_t length;
+	const char *data;
+	int64_t max_result;
+	int flags;
+} op_t;
+
+/* An open with OP_FLAG_WAIT waits in the file's queue for conflicting
+locks to be released instead of failing with EPERM. A read or write with
+OP_FLAG_SYNC completes before it returns, whatever the I/O backend. */
+#define OP_FLAG_WAIT 1
+#define OP_FLAG_SYNC 2
 
 /* The entrypoint to the program. Performs network-related functions. */
 int main(int argc, char **argv);
 
+/* Displays the command line usage and exits the process. */
+void print_usage(const char *program);
+
 /* Displays an error message and exits the process. */
 void fail_with_error(const char *msg);
 
-/* Performs application-logic specific initialization. */
+/* Reports an inconsistency in the server's data structures and exits
+the process. */
+void fail_with_inconsistency(const char *file, int line);
+
+/* Performs application-logic specific initialization of the calling
+worker's state. */
 void init();
 
+/* Validates a received datagram and handles the request it carries, and
+queues the response if one should be sent. */
+void handle_datagram(char *message, size_t message_size, struct sockaddr_in *from);
+
+/* Decodes a datagram and handles the request it carries like
+handle_datagram(), which times and counts it. deferred is set for a
+deferred request being handled again. Returns 0 if the datagram held a
+request, -1 if it was invalid. */
+int serve_datagram(char *message, size_t message_size, struct sockaddr_in *from, char deferred);
+
 /* Builds the response to a request, or possibly returns a null pointer
-if no reponse should be sent. */
-response_t *handle_request(request_t *request);
+if no reponse should be sent now. */
+response_t *handle_request(request_header_t *header, op_t *op);
+
+/* Queues a copy of a request until the client's earlier requests have
+been answered. A retransmission of a request already queued, or one
+beyond DEFERRED_MAX, is dropped. */
+void defer_request(client_t *client, request_header_t *header);
+
+/* Frees the client's deferred requests without handling them. */
+void drop_deferred(client_t *client);
+
+/* Puts a client whose earlier request has just been answered on the
+worker's list of clients whose deferred requests can run. */
+void make_ready(client_t *client);
+
+/* Handles the deferred requests of the clients on the worker's list, in
+order, until each client has none left or is waiting again. */
+void run_ready_clients(void);
 
 /* Retrieves the client structure associated with a client or constructs
 a new one. */
-client_t *retrieve_client(request_t *request);
+client_t *retrieve_client(request_header_t *header);
+
+/* Returns the client's remembered request with the given number, or a
+null pointer if it has not been performed or has left the window. */
+recent_request_t *find_recent(client_t *client, int request);
+
+/* Remembers the response to one of the client's requests, replacing the
+request that shared its slot, and logs it. */
+void remember_response(client_t *client, int request, response_t *response, size_t result_len);
+
+/* Forgets every remembered request of the client. */
+void forget_responses(client_t *client);
 
-/* Removes all locks held by the specified client. */
+/* Removes all locks held by the specified client and closes its files. */
 void clear_locks(client_t *client);
 
-/* Reads the command contained in a request, then calls the appropriate
-function to perform the command. */
-response_t *dispatch_request(request_t *request, client_t *client);
+/* Calls the appropriate function to perform a decoded operation. */
+response_t *dispatch_request(op_t *op, client_t *client);
 
 /* Performs the open operation. */
-response_t *perform_open(request_t *request, client_t *client);
+response_t *perform_open(op_t *op, client_t *client);
+
+/* Returns nonzero if the file's locks allow an open in the given mode. */
+char lock_allows(file_entry_t *file, lock_t mode);
 
 /* Adds an opened file record with the given information to the client. */
 void add_fstate(client_t *client, file_entry_t *file, lock_t mode, size_t position);
@@ -85,38 +352,159 @@ void add_fstate(client_t *client, file_entry_t *file, lock_t mode, size_t positi
 /* Sets the lock on the given file to the specified client. */
 void set_lock(file_entry_t *file, client_t *client, lock_t mode);
 
+/* Releases the lock the given client holds on the file. */
+int release_lock(file_entry_t *file, client_t *client);
+
+/* Queues an open until the file's locks allow it. */
+void enqueue_waiter(file_entry_t *file, client_t *client, lock_t mode);
+
+/* Grants queued opens on the file that its locks now allow. */
+void grant_waiters(file_entry_t *file);
+
+/* Withdraws the client's queued open, if it has one. */
+void cancel_waiter(client_t *client);
+
+/* Fails queued opens whose deadline has passed. Returns the milliseconds
+until the next deadline, or -1 if nothing is queued. */
+long expire_waiters(void);
+
+/* Extends the client's lease if it holds locks, or drops it if not. */
+void renew_lease(client_t *client);
+
+/* Runs the worker's due timers. Returns the milliseconds until it must
+be called again, or -1 if nothing is scheduled. */
+long run_timers(void);
+
+/* Makes the changes of a batch of requests durable before their replies
+are sent. */
+void commit_batch(void);
+
+/* Fills in a log entry about the client. */
+void init_wal_entry(wal_entry_t *entry, wal_type_t type, client_t *client);
+
+/* Log a new file, a client's request and response, the state of one of
+a client's open files, and a client's byte-range lock being taken or
+released, when the write-ahead log is on. */
+void record_file(file_entry_t *file);
+void record_client(client_t *client, recent_request_t *recent);
+void record_fstate(wal_type_t type, client_t *client, file_state_t *fstate);
+void record_range(wal_type_t type, client_t *client, file_entry_t *file, uint64_t start,
+	uint64_t end, lock_t mode);
+
+/* Applies a logged state change to the calling worker's state. Applying
+an entry twice has the same effect as applying it once. */
+void apply_wal_entry(const wal_entry_t *entry);
+
+/* Logs the calling worker's whole state. */
+void write_snapshot(void);
+
+/* Reads or writes a client's open file at its position through the
+disk I/O backend. Returns the response if the operation completed at
+once, or a null pointer if the client is answered on completion. */
+response_t *submit_io(op_t *op, client_t *client, file_state_t *fstate, int fd,
+	response_t *response, const char *data, size_t len);
+
+/* Reads or writes a client's open file at its position through the
+block cache. */
+response_t *perform_cached_io(op_t *op, client_t *client, file_state_t *fstate,
+	response_t *response, const char *data, size_t len);
+
+/* Serves a small read from data read ahead if it holds it, and reads
+ahead of a client reading sequentially. Returns 1 if the read was
+served. */
+int serve_readahead(client_t *client, file_state_t *fstate, int fd, response_t *response, size_t len);
+
+/* Discards the data read ahead for an open file, when the client moves
+its position or writes. */
+void cancel_readahead(file_state_t *fstate);
+
+/* Frees the read-ahead state of an open file that is going away. */
+void free_readahead(file_state_t *fstate);
+
+/* Completes a disk operation that was in flight, and answers the client
+it belongs to. */
+void complete_io(io_request_t *request);
+
+/* Completes every disk operation the backend has finished. */
+void reap_io(void);
+
 /* Performs the close operation. */
-response_t *perform_close(request_t *request, client_t *client);
+response_t *perform_close(op_t *op, client_t *client);
 
 /* Performs the read operation. */
-response_t *perform_read(request_t *request, client_t *client);
+response_t *perform_read(op_t *op, client_t *client);
 
 /* Performs the write operation. */
-response_t *perform_write(request_t *request, client_t *client);
+response_t *perform_write(op_t *op, client_t *client);
 
 /* Performs the lseek operation. */
-response_t *perform_lseek(request_t *request, client_t *client);
+response_t *perform_lseek(op_t *op, client_t *client);
+
+/* Performs the lock operation on a byte range of a file opened with
+LOCK_RANGES. */
+response_t *perform_lock(op_t *op, client_t *client);
+
+/* Performs the unlock operation, releasing a range from the client's
+byte-range locks. */
+response_t *perform_unlock(op_t *op, client_t *client);
+
+/* Performs the operations of a compound request in order, up to the
+first that fails. */
+response_t *perform_compound(op_t *op, client_t *client);
 
 /* Generates a response with the given status code, and 0 for the
-response and response size. Caller's responsibility to deallocate. */
+response and response size. Caller's responsibility to deallocate with
+resp_free(). */
 response_t *resp_from_status(int status);
 
+/* Generates a response like resp_from_status() with room for at least
+capacity bytes of result. Returns a null pointer if the memory could
+not be allocated. Caller's responsibility to deallocate with
+resp_free(). */
+response_t *resp_with_capacity(int status, size_t capacity);
+
+/* Returns a response to the pool it was allocated from. */
+void resp_free(response_t *response);
+
+/* Number of response size classes with their own pool. */
+#define RESPONSE_CLASSES 3
+
 /* Finds the file entry with the given filename and machine name. */
-file_entry_t *find_file(char *filename, char*machinename);
+file_entry_t *find_file(const char *filename, size_t filename_len, const char *machine);
+
+/* Calls the callback for every file on the given machine whose name
+starts with prefix, in filename order. Returns the number of files
+visited. */
+size_t enumerate_files(char *machine, char *prefix,
+	void (*callback)(file_entry_t *file, void *arg), void *arg);
 
 /* Checks whether the given client has the given file open with the specified mode. */
 char check_open(client_t* client, file_entry_t* file, lock_t mode);
 
+/* Checks whether the byte-range locks of other clients allow the client
+to read, or if write is set to write, len bytes at its position in an
+open file. */
+char check_range(client_t *client, file_state_t *fstate, size_t len, char write);
+
 /* Allocates a new file_entry object and copies the filename and
 machine provided into the object. */
-file_entry_t *new_file(char *filename, char *machine);
+file_entry_t *new_file(const char *filename, size_t filename_len, const char *machine);
 
-/* Computes the filename of the specified file on the local disk,
-and opens that file. */
+/* Returns a descriptor for the specified file from the descriptor
+cache, computing its filename on the local disk and opening it if it
+is not cached. The descriptor belongs to the cache and must not be
+closed by the caller. Returns -1 and sets errno on failure. */
 int open_disk_file(file_entry_t *file, int flags, mode_t mode);
 
 /* Finds the record for the client's file state for the given
 file. */
 file_state_t *find_fstate(client_t *client, file_entry_t *file);
 
+/* Reach the disk file behind a file's cached blocks for the block
+cache. */
+ssize_t read_blocks(bcache_file_t *blocks, char *buf, size_t len, off_t offset);
+int write_blocks(bcache_file_t *blocks, bcache_io_t *writes, size_t count);
+int64_t disk_file_size(bcache_file_t *blocks);
+int sync_disk_file(bcache_file_t *blocks);
+
 #endif /* SERVER_H */
@@ -0,0 +1,78 @@
+/* Typed vectors with inline storage used in the server. */
+
+#ifndef SMALLVEC_H
+#define SMALLVEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Grows a vector's storage to twice its capacity, moving the elements
+   out of the inline storage on the first growth. Returns 0 if
+   successful, -1 if the memory could not be allocated. */
+int smallvec_grow(void **heap, const void *local, uint32_t *capacity, uint32_t size,
+	size_t element_size);
+
+/* Defines name_t, a vector of type elements whose first inline_capacity
+   elements are stored inside the vector itself, so a vector that never
+   holds more needs no allocation and keeps its elements next to the
+   structure that embeds it. Past that, the elements move to the heap,
+   where they stay. The elements are heap while it is set and local
+   otherwise. Removing an element moves the last one into its place, so
+   the order of the elements is not kept, and pointers to elements are
+   only valid until the vector next changes.
+
+   The functions defined with it are:
+   name_init(vec)               makes an empty vector.
+   name_free(vec)               frees the heap storage, leaving an empty vector.
+   name_at(vec, index)          returns a pointer to an element.
+   name_append(vec, element)    appends a copy of the element and returns a
+                                pointer to it, or a null pointer if the memory
+                                could not be allocated.
+   name_remove(vec, index)      removes an element, moving the last element into
+                                its place. */
+#define SMALLVEC_DEFINE(name, type, inline_capacity) \
+	typedef struct { \
+		uint32_t size; \
+		uint32_t capacity; \
+		type *heap; \
+		type local[inline_capacity]; \
+	} name##_t; \
+	\
+	static inline void name##_init(name##_t *vec) \
+	{ \
+		vec->size = 0; \
+		vec->capacity = (inline_capacity); \
+		vec->heap = (type*)0; \
+	} \
+	\
+	static inline void name##_free(name##_t *vec) \
+	{ \
+		free(vec->heap); \
+		name##_init(vec); \
+	} \
+	\
+	static inline type *name##_at(name##_t *vec, size_t index) \
+	{ \
+		return (vec->heap ? vec->heap : vec->local) + index; \
+	} \
+	\
+	static inline type *name##_append(name##_t *vec, type element) \
+	{ \
+		if (vec->size == vec->capacity && smallvec_grow((void**)&vec->heap, vec->local, \
+			&vec->capacity, vec->size, sizeof(type)) < 0) \
+			return (type*)0; \
+		type *slot = name##_at(vec, vec->size); \
+		*slot = element; \
+		vec->size = vec->size + 1; \
+		return slot; \
+	} \
+	\
+	static inline void name##_remove(name##_t *vec, size_t index) \
+	{ \
+		vec->size = vec->size - 1; \
+		if (index != vec->size) \
+			*name##_at(vec, index) = *name##_at(vec, vec->size); \
+	}
+
+#endif /* SMALLVEC_H */
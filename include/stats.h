@@ -0,0 +1,73 @@
+/* Counters and latency histograms used in the server. */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Log-linear histogram in the style of HdrHistogram. Values below 16
+   get a bucket each; above that, each power of two is split into 16
+   equal buckets, so any recorded value is known to within 1/16. */
+#define HIST_SUB_BUCKETS 16
+#define HIST_BUCKETS (HIST_SUB_BUCKETS * 61)
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+} histogram_t;
+
+void hist_init(histogram_t *hist);
+void hist_record(histogram_t *hist, uint64_t value);
+void hist_merge(histogram_t *into, const histogram_t *from);
+uint64_t hist_quantile(const histogram_t *hist, double quantile);
+
+/* Event counters kept by every worker. */
+typedef enum {
+	STAT_REQUESTS = 0,
+	STAT_RETRANSMIT_HITS,
+	STAT_STALE_REQUESTS,
+	STAT_LOCK_CONFLICTS,
+	STAT_LOCK_WAITS,
+	STAT_LOCK_WAIT_TIMEOUTS,
+	STAT_LEASE_EXPIRIES,
+	STAT_BLOCK_CACHE_HITS,
+	STAT_BLOCK_CACHE_MISSES,
+	STAT_BLOCK_WRITEBACKS,
+	STAT_COUNTERS
+} stat_counter_t;
+
+/* Latency histograms kept by every worker: one for whole requests and
+   one per operation. */
+typedef enum {
+	HIST_REQUEST = 0,
+	HIST_OPEN,
+	HIST_CLOSE,
+	HIST_READ,
+	HIST_WRITE,
+	HIST_LSEEK,
+	STAT_HISTOGRAMS
+} stat_histogram_t;
+
+/* Gives the calling thread its own block of counters and histograms.
+   Updates only ever touch the calling thread's block, so they need no
+   locking; scrapes add up the blocks of every thread. */
+void stats_register_thread(void);
+
+void stats_count(stat_counter_t counter);
+void stats_record(stat_histogram_t histogram, uint64_t nanoseconds);
+
+/* Returns a monotonic timestamp in nanoseconds. */
+uint64_t stats_now(void);
+
+/* Writes every counter and histogram summary in a line-oriented text
+   format. Returns the number of bytes written. */
+size_t stats_format(char *buffer, size_t capacity);
+
+/* Starts a thread answering every datagram sent to the given UDP port on
+   the loopback address with the output of stats_format(). */
+void stats_serve(unsigned short port);
+
+#endif /* STATS_H */
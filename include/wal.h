@@ -0,0 +1,74 @@
+/* A write-ahead log of server state with snapshots used in the server. */
+
+#ifndef WAL_H
+#define WAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Kinds of logged state changes. A snapshot is a sequence of the same
+   entries, starting with WAL_SNAPSHOT, that rebuilds the whole state. */
+typedef enum {
+	WAL_SNAPSHOT = 1, /* value: last sequence number the snapshot covers */
+	WAL_FILE, /* A file was created */
+	WAL_CLIENT, /* A client's request number, incarnation and last response */
+	WAL_OPEN, /* A client opened a file: mode, value is the position */
+	WAL_CLOSE, /* A client closed a file */
+	WAL_POSITION, /* A client's position in an open file: value */
+	WAL_CLEAR, /* A client's locks were cleared: incarnation */
+	WAL_LOCK, /* A client locked bytes: mode, value is the start, data the end */
+	WAL_UNLOCK /* A client unlocked bytes: value is the start, data the end */
+} wal_type_t;
+
+/* A decoded log entry. Names are not NUL-terminated. For WAL_CLIENT,
+   status is -1 if the client has no last response; otherwise value is
+   the response size and data holds its result bytes. */
+typedef struct {
+	wal_type_t type;
+	const char *machine;
+	size_t machine_len;
+	const char *filename;
+	size_t filename_len;
+	int32_t client;
+	int32_t request;
+	int32_t incarnation;
+	int32_t mode;
+	int32_t status;
+	int64_t value;
+	const char *data;
+	size_t data_len;
+} wal_entry_t;
+
+/* Returns the worker that owns a machine name when there are threads
+   workers. */
+typedef int (*wal_shard_t)(const char *machine, size_t machine_len, int threads);
+
+/* Reads the snapshots and logs left in dir by any earlier run, whatever
+   its number of workers, and sorts their entries by the worker that now
+   owns each machine. Each worker writes a snapshot once it has written
+   snapshot_every entries to its log. Called once, before the workers
+   start. Returns 0 if successful, -1 if dir cannot be used. */
+int wal_load(const char *dir, int threads, wal_shard_t shard, size_t snapshot_every);
+
+/* Replays the calling worker's entries through apply, then calls
+   snapshot to write the worker's state to a fresh snapshot and starts an
+   empty log, both in a new generation of files. Waits until every worker
+   has done the same before the new generation replaces the old one, so
+   a crash meanwhile loses nothing and no worker serves requests while
+   old files are still needed. */
+void wal_recover(int worker, void (*apply)(const wal_entry_t *entry), void (*snapshot)(void));
+
+/* Adds an entry to the calling worker's log. It becomes durable at the
+   next wal_commit(). Does nothing on a worker without a log, or while
+   replaying. */
+void wal_append(const wal_entry_t *entry);
+
+/* Writes every entry appended since the last commit to disk and waits
+   for it to be durable, so one sync covers a whole batch of requests. */
+void wal_commit(void);
+
+/* Displays an error message and exits the process. Provided by the
+   program using this module. */
+void fail_with_error(const char *msg);
+
+#endif /* WAL_H */
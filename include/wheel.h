@@ -0,0 +1,49 @@
+/* A hierarchical timer wheel used in the server. */
+
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+
+/* Embedded in each object that needs a timer. expires is in ticks. */
+typedef struct wheel_timer {
+	uint64_t expires;
+	struct wheel_timer *prev;
+	struct wheel_timer *next;
+	unsigned char level;
+	unsigned char slot;
+	char pending;
+} wheel_timer_t;
+
+/* Time is counted in ticks of tick_ms milliseconds. Level 0 holds the
+   timers due in the next WHEEL_SLOTS ticks, one slot per tick, and each
+   further level covers WHEEL_SLOTS times the span of the one below.
+   Whenever a level wraps around, the next slot of the level above is
+   cascaded down, so every timer is moved at most WHEEL_LEVELS - 1 times
+   and a tick only touches the timers that expire in it. occupied has a
+   bit set for every nonempty slot. */
+typedef struct {
+	uint64_t now;
+	unsigned tick_ms;
+	size_t count;
+	uint64_t occupied[WHEEL_LEVELS];
+	wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+/* Called for each expired timer. The timer is no longer pending and may
+   be scheduled again. */
+typedef void (*wheel_fire_t)(wheel_timer_t *timer, void *arg);
+
+void wheel_init(wheel_t *wheel, uint64_t now_ms, unsigned tick_ms);
+void wheel_timer_init(wheel_timer_t *timer);
+void wheel_schedule(wheel_t *wheel, wheel_timer_t *timer, uint64_t expires_ms);
+void wheel_cancel(wheel_t *wheel, wheel_timer_t *timer);
+size_t wheel_advance(wheel_t *wheel, uint64_t now_ms, wheel_fire_t fire, void *arg);
+long wheel_next_ms(const wheel_t *wheel, uint64_t now_ms);
+
+#endif /* WHEEL_H */
@@ -0,0 +1,485 @@
+/* A write-back cache of file blocks used in the server. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "bcache.h"
+#include "htable.h"
+#include "stats.h"
+
+/* Returns the bucket of a block. */
+static bcache_block_t **bcache_bucket(bcache_t *cache, bcache_file_t *file, uint64_t index)
+{
+	uint64_t hash = htable_hash(&file, sizeof(file), HTABLE_SEED);
+	hash = htable_hash(&index, sizeof(index), hash);
+	return &cache->buckets[(size_t)hash & cache->bucket_mask];
+}
+
+/* Finds a cached block, or returns a null pointer. */
+static bcache_block_t *bcache_lookup(bcache_t *cache, bcache_file_t *file, uint64_t index)
+{
+	for (bcache_block_t *block = *bcache_bucket(cache, file, index); block; block = block->hash_next)
+		if (block->file == file && block->index == index)
+			return block;
+	return (bcache_block_t*)0;
+}
+
+/* Puts a file on the list of files to flush if it is not there. */
+static void bcache_list_file(bcache_t *cache, bcache_file_t *file)
+{
+	if (file->listed)
+		return;
+	file->flush_prev = (bcache_file_t*)0;
+	file->flush_next = cache->flush_head;
+	if (cache->flush_head)
+		cache->flush_head->flush_prev = file;
+	cache->flush_head = file;
+	file->listed = 1;
+}
+
+/* Takes a file off the list of files to flush once nothing is left to
+   flush for it. */
+static void bcache_unlist_file(bcache_t *cache, bcache_file_t *file)
+{
+	if (!file->listed || file->dirty > 0 || (cache->durable && file->unsynced))
+		return;
+	if (file->flush_prev)
+		file->flush_prev->flush_next = file->flush_next;
+	else
+		cache->flush_head = file->flush_next;
+	if (file->flush_next)
+		file->flush_next->flush_prev = file->flush_prev;
+	file->listed = 0;
+}
+
+/* Puts a block that just became dirty on its file's dirty list. */
+static void bcache_mark_dirty(bcache_t *cache, bcache_block_t *block)
+{
+	bcache_file_t *file = block->file;
+	block->dirty_prev = (bcache_block_t*)0;
+	block->dirty_next = file->dirty_blocks;
+	if (file->dirty_blocks)
+		file->dirty_blocks->dirty_prev = block;
+	file->dirty_blocks = block;
+	file->dirty = file->dirty + 1;
+	cache->dirty = cache->dirty + 1;
+	bcache_list_file(cache, file);
+}
+
+/* Takes a block that was written back off its file's dirty list. */
+static void bcache_mark_clean(bcache_t *cache, bcache_block_t *block)
+{
+	bcache_file_t *file = block->file;
+	block->dirty_start = block->dirty_end = 0;
+	if (block->dirty_prev)
+		block->dirty_prev->dirty_next = block->dirty_next;
+	else
+		file->dirty_blocks = block->dirty_next;
+	if (block->dirty_next)
+		block->dirty_next->dirty_prev = block->dirty_prev;
+	file->dirty = file->dirty - 1;
+	cache->dirty = cache->dirty - 1;
+	file->unsynced = 1;
+	file->version = file->version + 1;
+	bcache_unlist_file(cache, file);
+	stats_count(STAT_BLOCK_WRITEBACKS);
+}
+
+/* Writes back the dirty bytes of count blocks of a file, at most
+   BCACHE_WRITE_BATCH, in one call to the write op, and again for what a
+   short write left. Returns 0 if successful, -1 and sets errno if any
+   block could not be written back, in which case it stays dirty. The
+   blocks array is reused. */
+static int bcache_write_blocks(bcache_t *cache, bcache_file_t *file, bcache_block_t **blocks,
+	size_t count)
+{
+	bcache_io_t writes[BCACHE_WRITE_BATCH];
+	int result = 0;
+	while (count > 0) {
+		for (size_t i = 0; i < count; ++i) {
+			bcache_block_t *block = blocks[i];
+			writes[i].buf = block->data + block->dirty_start;
+			writes[i].len = block->dirty_end - block->dirty_start;
+			writes[i].offset = (off_t)(block->index * BCACHE_BLOCK_SIZE + block->dirty_start);
+			writes[i].result = 0;
+		}
+		if (cache->ops->write(file, writes, count) < 0)
+			return -1;
+
+		size_t left = 0;
+		for (size_t i = 0; i < count; ++i) {
+			bcache_block_t *block = blocks[i];
+			if (writes[i].result <= 0) {
+				errno = writes[i].result == 0 ? EIO : (int)-writes[i].result;
+				result = -1;
+			} else if ((size_t)writes[i].result < writes[i].len) {
+				block->dirty_start = block->dirty_start + (uint32_t)writes[i].result;
+				blocks[left++] = block;
+			} else {
+				bcache_mark_clean(cache, block);
+			}
+		}
+		count = left;
+	}
+	return result;
+}
+
+/* Writes back a block's dirty bytes. Returns 0 if successful, -1 if not,
+   in which case the block stays dirty. */
+static int bcache_write_back(bcache_t *cache, bcache_block_t *block)
+{
+	if (block->dirty_start == block->dirty_end)
+		return 0;
+	return bcache_write_blocks(cache, block->file, &block, 1);
+}
+
+/* Removes a clean block from the table and its file, freeing its frame. */
+static void bcache_unlink(bcache_t *cache, bcache_block_t *block)
+{
+	bcache_block_t **link = bcache_bucket(cache, block->file, block->index);
+	while (*link != block)
+		link = &(*link)->hash_next;
+	*link = block->hash_next;
+
+	if (block->file_prev)
+		block->file_prev->file_next = block->file_next;
+	else
+		block->file->blocks = block->file_next;
+	if (block->file_next)
+		block->file_next->file_prev = block->file_prev;
+
+	block->file = (bcache_file_t*)0;
+	block->referenced = 0;
+}
+
+/* Returns a free frame, evicting the block the CLOCK hand settles on if
+   every frame is in use. Returns a null pointer with errno set if no
+   dirty block could be written back to make room. */
+static bcache_block_t *bcache_victim(bcache_t *cache)
+{
+	if (cache->used < cache->capacity)
+		return &cache->frames[cache->used++];
+
+	/* After one sweep every reference bit is clear, so the hand stops
+	   within two sweeps unless writing back keeps failing. */
+	for (size_t i = 0; i < 2 * cache->capacity + 1; ++i) {
+		bcache_block_t *block = &cache->frames[cache->hand];
+		cache->hand = cache->hand + 1 == cache->capacity ? 0 : cache->hand + 1;
+		if (!block->file)
+			return block;
+		if (block->referenced) {
+			block->referenced = 0;
+			continue;
+		}
+		if (bcache_write_back(cache, block) < 0)
+			continue;
+		bcache_unlink(cache, block);
+		return block;
+	}
+	return (bcache_block_t*)0;
+}
+
+/* Enters a frame, its data already set, as the file's block with the
+   given number. */
+static void bcache_link(bcache_t *cache, bcache_file_t *file, bcache_block_t *block, uint64_t index)
+{
+	block->file = file;
+	block->index = index;
+	block->dirty_start = block->dirty_end = 0;
+	block->referenced = 1;
+
+	bcache_block_t **bucket = bcache_bucket(cache, file, index);
+	block->hash_next = *bucket;
+	*bucket = block;
+
+	block->file_prev = (bcache_block_t*)0;
+	block->file_next = file->blocks;
+	if (file->blocks)
+		file->blocks->file_prev = block;
+	file->blocks = block;
+}
+
+/* Returns the file's block with the given number, loading it if it is
+   not cached. The file's size must be known. Unless fill is set, the
+   caller overwrites the whole block, so it is not read. Returns a null
+   pointer with errno set on failure. */
+static bcache_block_t *bcache_get(bcache_t *cache, bcache_file_t *file, uint64_t index, char fill)
+{
+	bcache_block_t *block = bcache_lookup(cache, file, index);
+	if (block) {
+		block->referenced = 1;
+		stats_count(STAT_BLOCK_CACHE_HITS);
+		return block;
+	}
+
+	stats_count(STAT_BLOCK_CACHE_MISSES);
+	block = bcache_victim(cache);
+	if (!block)
+		return (bcache_block_t*)0;
+
+	/* Bytes past the end of the file read as zero. */
+	off_t offset = (off_t)(index * BCACHE_BLOCK_SIZE);
+	ssize_t have = 0;
+	if (fill && offset < file->size) {
+		do {
+			have = cache->ops->read(file, block->data, BCACHE_BLOCK_SIZE, offset);
+		} while (have < 0 && errno == EINTR);
+		if (have < 0)
+			return (bcache_block_t*)0;
+	}
+	memset(block->data + have, 0, BCACHE_BLOCK_SIZE - (size_t)have);
+	bcache_link(cache, file, block, index);
+	return block;
+}
+
+/* Learns the file's size from the disk if it is not known. */
+static int bcache_load_size(bcache_t *cache, bcache_file_t *file)
+{
+	if (file->size >= 0)
+		return 0;
+	int64_t size = cache->ops->size(file);
+	if (size < 0)
+		return -1;
+	file->size = size;
+	return 0;
+}
+
+/* Initializes a cache of capacity blocks that reaches the disk through
+   ops. Returns 0 if successful, -1 if the memory could not be
+   allocated. */
+int bcache_init(bcache_t *cache, size_t capacity, const bcache_ops_t *ops, char durable)
+{
+	memset(cache, 0, sizeof(bcache_t));
+	if (capacity == 0)
+		capacity = 1;
+
+	size_t buckets = 1;
+	while (buckets < capacity)
+		buckets <<= 1;
+
+	cache->frames = (bcache_block_t*)calloc(capacity, sizeof(bcache_block_t));
+	cache->data = (char*)malloc(capacity * BCACHE_BLOCK_SIZE);
+	cache->buckets = (bcache_block_t**)calloc(buckets, sizeof(bcache_block_t*));
+	if (!cache->frames || !cache->data || !cache->buckets) {
+		bcache_destroy(cache);
+		return -1;
+	}
+
+	for (size_t i = 0; i < capacity; ++i)
+		cache->frames[i].data = cache->data + i * BCACHE_BLOCK_SIZE;
+	cache->capacity = capacity;
+	cache->bucket_mask = buckets - 1;
+	cache->ops = ops;
+	cache->durable = durable;
+	return 0;
+}
+
+/* Frees the cache's memory. Dirty blocks are not written back. */
+void bcache_destroy(bcache_t *cache)
+{
+	free(cache->frames);
+	free(cache->data);
+	free(cache->buckets);
+	memset(cache, 0, sizeof(bcache_t));
+}
+
+/* Initializes a file with nothing cached and an unknown size. */
+void bcache_file_init(bcache_file_t *file)
+{
+	memset(file, 0, sizeof(bcache_file_t));
+	file->size = -1;
+}
+
+/* Reads up to len bytes of the file at offset, stopping at the end of
+   the file. Returns the number of bytes read, or -1 and sets errno if
+   none could be. */
+ssize_t bcache_read(bcache_t *cache, bcache_file_t *file, char *buf, size_t len, off_t offset)
+{
+	if (bcache_load_size(cache, file) < 0)
+		return -1;
+	if (offset >= file->size)
+		return 0;
+	if ((uint64_t)len > (uint64_t)(file->size - offset))
+		len = (size_t)(file->size - offset);
+
+	size_t done = 0;
+	while (done < len) {
+		uint64_t position = (uint64_t)offset + done;
+		size_t start = (size_t)(position % BCACHE_BLOCK_SIZE);
+		size_t n = BCACHE_BLOCK_SIZE - start < len - done ? BCACHE_BLOCK_SIZE - start : len - done;
+		bcache_block_t *block = bcache_get(cache, file, position / BCACHE_BLOCK_SIZE, 1);
+		if (!block)
+			return done > 0 ? (ssize_t)done : -1;
+		memcpy(buf + done, block->data + start, n);
+		done += n;
+	}
+	return (ssize_t)done;
+}
+
+/* Writes len bytes to the file at offset into the cache. Writes to the
+   same block coalesce into one dirty range, written back on eviction or
+   flush. Once half the frames are dirty, everything is written back, so
+   eviction seldom has to write. Returns the number of bytes written, or
+   -1 and sets errno if none could be. */
+ssize_t bcache_write(bcache_t *cache, bcache_file_t *file, const char *data, size_t len, off_t offset)
+{
+	if (bcache_load_size(cache, file) < 0)
+		return -1;
+
+	size_t done = 0;
+	while (done < len) {
+		uint64_t position = (uint64_t)offset + done;
+		size_t start = (size_t)(position % BCACHE_BLOCK_SIZE);
+		size_t n = BCACHE_BLOCK_SIZE - start < len - done ? BCACHE_BLOCK_SIZE - start : len - done;
+		bcache_block_t *block = bcache_get(cache, file, position / BCACHE_BLOCK_SIZE,
+			n < BCACHE_BLOCK_SIZE);
+		if (!block) {
+			if (done > 0)
+				break;
+			return -1;
+		}
+
+		memcpy(block->data + start, data + done, n);
+		if (block->dirty_start == block->dirty_end) {
+			block->dirty_start = (uint32_t)start;
+			block->dirty_end = (uint32_t)(start + n);
+			bcache_mark_dirty(cache, block);
+		} else {
+			if (start < block->dirty_start)
+				block->dirty_start = (uint32_t)start;
+			if (start + n > block->dirty_end)
+				block->dirty_end = (uint32_t)(start + n);
+		}
+
+		done += n;
+		if ((int64_t)(position + n) > file->size)
+			file->size = (int64_t)(position + n);
+	}
+
+	if (cache->dirty * 2 > cache->capacity)
+		bcache_flush(cache, 0);
+	return (ssize_t)done;
+}
+
+/* Writes back the file's dirty blocks, handing the write op up to
+   BCACHE_WRITE_BATCH of them at a time, then syncs the file if sync is
+   set and anything was written back since it was last synced. Returns 0
+   if successful, -1 and sets errno if not. */
+int bcache_flush_file(bcache_t *cache, bcache_file_t *file, char sync)
+{
+	int result = 0;
+	bcache_block_t *batch[BCACHE_WRITE_BATCH];
+	bcache_block_t *block = file->dirty_blocks;
+	while (block) {
+		/* Only the blocks of the batch leave the list as they are
+		   written back, so the next one stays on it. */
+		size_t count = 0;
+		for (; block && count < BCACHE_WRITE_BATCH; block = block->dirty_next)
+			batch[count++] = block;
+		if (bcache_write_blocks(cache, file, batch, count) < 0)
+			result = -1;
+	}
+
+	if (result == 0 && sync && file->unsynced) {
+		if (cache->ops->sync(file) < 0)
+			return -1;
+		file->unsynced = 0;
+	}
+	bcache_unlist_file(cache, file);
+	return result;
+}
+/* Flushes every file on the list, as bcache_flush_file() does. Syncing
+   all of them together commits every write since the last flush as one
+   group. Returns 0 if successful, -1 if any file failed. */
+int bcache_flush(bcache_t *cache, char sync)
+{
+	int result = 0;
+	bcache_file_t *file = cache->flush_head;
+	while (file) {
+		bcache_file_t *next = file->flush_next;
+		if (bcache_flush_file(cache, file, sync) < 0)
+			result = -1;
+		file = next;
+	}
+	return result;
+}
+
+/* Writes back and drops every cached block of the file and forgets its
+   size, so that the next access sees the file as it is on disk. Returns
+   0 if successful, -1 if a block could not be written back, in which
+   case it stays cached. */
+int bcache_drop_file(bcache_t *cache, bcache_file_t *file)
+{
+	int result = bcache_flush_file(cache, file, 0);
+	bcache_block_t *block = file->blocks;
+	while (block) {
+		bcache_block_t *next = block->file_next;
+		if (block->dirty_start == block->dirty_end)
+			bcache_unlink(cache, block);
+		block = next;
+	}
+	file->version = file->version + 1;
+	if (result == 0)
+		file->size = -1;
+	return result;
+}
+
+/* Finds the blocks a bcache_read(), or a bcache_write() if write is set,
+   of len bytes at offset would read from the disk, those before the end
+   of the file that are not cached and, when writing, not overwritten
+   whole. Returns 1 and sets [*first, *last] to the numbers of the first
+   and last of them, 0 if there are none, or -1 and sets errno if the
+   file's size could not be learnt. Reading the blocks ahead of time with
+   bcache_fill() spares the disk access. */
+int bcache_missing(bcache_t *cache, bcache_file_t *file, size_t len, off_t offset, char write,
+	uint64_t *first, uint64_t *last)
+{
+	if (bcache_load_size(cache, file) < 0)
+		return -1;
+
+	int missing = 0;
+	size_t done = 0;
+	while (done < len) {
+		uint64_t position = (uint64_t)offset + done;
+		size_t start = (size_t)(position % BCACHE_BLOCK_SIZE);
+		size_t n = BCACHE_BLOCK_SIZE - start < len - done ? BCACHE_BLOCK_SIZE - start : len - done;
+		uint64_t index = position / BCACHE_BLOCK_SIZE;
+		if ((int64_t)(index * BCACHE_BLOCK_SIZE) >= file->size)
+			break;
+		if ((!write || n < BCACHE_BLOCK_SIZE) && !bcache_lookup(cache, file, index)) {
+			if (!missing)
+				*first = index;
+			*last = index;
+			missing = 1;
+		}
+		done += n;
+	}
+	return missing;
+}
+
+/* Enters the blocks read from the disk into data, len bytes at the
+   block aligned offset, that are not cached yet. Nothing is entered if
+   the file's version is no longer the one it had when the read was
+   started, since the disk may have changed under it. Blocks there is no
+   room for are left out, to be read again when they are needed. */
+void bcache_fill(bcache_t *cache, bcache_file_t *file, const char *data, size_t len, off_t offset,
+	uint64_t version)
+{
+	if (file->version != version || file->size < 0)
+		return;
+
+	for (size_t done = 0; done < len; done += BCACHE_BLOCK_SIZE) {
+		uint64_t index = ((uint64_t)offset + done) / BCACHE_BLOCK_SIZE;
+		if (bcache_lookup(cache, file, index))
+			continue;
+		bcache_block_t *block = bcache_victim(cache);
+		if (!block)
+			return;
+		stats_count(STAT_BLOCK_CACHE_MISSES);
+		size_t have = len - done < BCACHE_BLOCK_SIZE ? len - done : BCACHE_BLOCK_SIZE;
+		memcpy(block->data, data + done, have);
+		memset(block->data + have, 0, BCACHE_BLOCK_SIZE - have);
+		bcache_link(cache, file, block, index);
+	}
+}
@@ -0,0 +1,470 @@
+/* Microbenchmarks of the list and the server core. Each result is
+   printed as one JSON object per line, so runs can be compared. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "server.h"
+#include "request.h"
+#include "list.h"
+#include "protocol.h"
+#include "log.h"
+#include "stats.h"
+#include "net.h"
+#include "wal.h"
+
+/* Table sizes the lookup benchmarks are run at. */
+static const size_t sizes[] = { 10, 1000, 100000 };
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+/* Lookups timed per table size. */
+#define LOOKUPS 1000000
+
+/* Round trips timed through handle_request(). */
+#define ROUND_TRIPS 200000
+
+/* Log entries replayed by bench_wal_replay(), written two per lseek. */
+#define REPLAY_ENTRIES 1000000
+
+/* Clients whose lseeks bench_wal_replay() logs. */
+#define REPLAY_CLIENTS 16
+
+/* bench_readahead() reads a file of READAHEAD_FILE bytes in reads of
+READAHEAD_READ bytes. */
+#define READAHEAD_FILE 300000
+#define READAHEAD_READ 1000
+
+/* Keeps the compiler from optimizing away a benchmarked result. */
+static volatile uintptr_t sink;
+
+void report(const char *bench, size_t size, uint64_t iterations, uint64_t elapsed)
+{
+	printf("{\"bench\":\"%s\",\"size\":%zu,\"iterations\":%llu,\"ns_per_op\":%.1f}\n",
+		bench, size, (unsigned long long)iterations, (double)elapsed / (double)iterations);
+	fflush(stdout);
+}
+
+/* Fills in a text request. */
+void make_request(request_t *request, const char *machine, int client, int number, const char *operation)
+{
+	memset(request, 0, sizeof(request_t));
+	strcpy(request->client_ip, "127.0.0.1");
+	strcpy(request->machine, machine);
+	request->client = client;
+	request->request = number;
+	request->incarnation = 0;
+	strcpy(request->operation, operation);
+}
+
+void bench_list()
+{
+	for (size_t s = 0; s < NSIZES; ++s) {
+		size_t size = sizes[s];
+		list_t list;
+		list_init(&list);
+
+		uint64_t start = stats_now();
+		for (size_t i = 0; i < size; ++i)
+			list_append(&list, &list);
+		report("list_append", size, size, stats_now() - start);
+
+		/* Removing the last element is what swap-free callers pay at
+		best, and the first what they pay at worst. */
+		start = stats_now();
+		for (size_t i = 0; i < size / 2; ++i)
+			sink = (uintptr_t)list_remove(&list, list.size - 1);
+		report("list_remove_last", size, size / 2, stats_now() - start);
+
+		start = stats_now();
+		while (list.size > 0)
+			sink = (uintptr_t)list_remove(&list, 0);
+		report("list_remove_first", size, size - size / 2, stats_now() - start);
+
+		free(list.elements);
+	}
+}
+
+void bench_find_file()
+{
+	char name[32];
+
+	for (size_t s = 0; s < NSIZES; ++s) {
+		size_t size = sizes[s];
+		init();
+		for (size_t i = 0; i < size; ++i) {
+			int len = snprintf(name, sizeof(name), "file%zu", i);
+			new_file(name, (size_t)len, "bench");
+		}
+
+		uint64_t start = stats_now();
+		for (size_t i = 0; i < LOOKUPS; ++i) {
+			int len = snprintf(name, sizeof(name), "file%zu", (i * 7919) % size);
+			sink = (uintptr_t)find_file(name, (size_t)len, "bench");
+		}
+		report("find_file_hit", size, LOOKUPS, stats_now() - start);
+
+		start = stats_now();
+		for (size_t i = 0; i < LOOKUPS; ++i) {
+			int len = snprintf(name, sizeof(name), "miss%zu", (i * 7919) % size);
+			sink = (uintptr_t)find_file(name, (size_t)len, "bench");
+		}
+		report("find_file_miss", size, LOOKUPS, stats_now() - start);
+	}
+}
+
+void bench_retrieve_client()
+{
+	char machine[24];
+	request_header_t header;
+	memset(&header, 0, sizeof(header));
+	header.machine = machine;
+	header.request = 1;
+
+	for (size_t s = 0; s < NSIZES; ++s) {
+		size_t size = sizes[s];
+		init();
+
+		uint64_t start = stats_now();
+		for (size_t i = 0; i < size; ++i) {
+			snprintf(machine, sizeof(machine), "machine%zu", i % 64);
+			header.client = (int)i;
+			retrieve_client(&header);
+		}
+		report("retrieve_client_insert", size, size, stats_now() - start);
+
+		start = stats_now();
+		for (size_t i = 0; i < LOOKUPS; ++i) {
+			size_t n = (i * 7919) % size;
+			snprintf(machine, sizeof(machine), "machine%zu", n % 64);
+			header.client = (int)n;
+			sink = (uintptr_t)retrieve_client(&header);
+		}
+		report("retrieve_client_hit", size, LOOKUPS, stats_now() - start);
+	}
+}
+
+void bench_decode()
+{
+	request_header_t header;
+	op_t op;
+	request_t text;
+	make_request(&text, "bench", 1, 1, "write data.txt some bytes to write");
+
+	uint64_t start = stats_now();
+	for (size_t i = 0; i < LOOKUPS; ++i) {
+		decode_text_request(&text, &header, &op);
+		sink = (uintptr_t)op.data;
+	}
+	report("decode_text_request", 0, LOOKUPS, stats_now() - start);
+
+	char message[sizeof(bin_request_t) + 64];
+	bin_request_t *binary = (bin_request_t*)message;
+	memset(message, 0, sizeof(message));
+	binary->magic = BIN_REQUEST_MAGIC;
+	binary->version = BIN_REQUEST_VERSION;
+	binary->opcode = OP_WRITE;
+	binary->name_len = 8;
+	binary->length = 19;
+	strcpy(binary->machine, "bench");
+	binary->client = 1;
+	binary->request = 1;
+	memcpy(message + sizeof(bin_request_t), "data.txtsome bytes to write", 27);
+	size_t size = sizeof(bin_request_t) + 27;
+
+	start = stats_now();
+	for (size_t i = 0; i < LOOKUPS; ++i) {
+		decode_binary_request(message, size, &header, &op);
+		sink = (uintptr_t)op.data;
+	}
+	report("decode_binary_request", 0, LOOKUPS, stats_now() - start);
+}
+
+/* Times decoding and handling one text request per iteration, as the
+   receive loop would, with a fresh request number each time. */
+void bench_round_trip(const char *bench, const char *operation, int *number)
+{
+	request_t request;
+	request_header_t header;
+	op_t op;
+
+	uint64_t start = stats_now();
+	for (size_t i = 0; i < ROUND_TRIPS; ++i) {
+		make_request(&request, "bench", 1, (*number)++, operation);
+		decode_text_request(&request, &header, &op);
+		sink = (uintptr_t)handle_request(&header, &op);
+	}
+	report(bench, 0, ROUND_TRIPS, stats_now() - start);
+}
+
+void bench_handle_request()
+{
+	request_t request;
+	request_header_t header;
+	op_t op;
+	int number = 1;
+
+	init();
+	make_request(&request, "bench", 1, number++, "open data.txt readwrite");
+	decode_text_request(&request, &header, &op);
+	response_t *response = handle_request(&header, &op);
+	if (!response || response->status != 0) {
+		printf("FAILED: open\n");
+		return;
+	}
+
+	bench_round_trip("handle_request_lseek", "lseek data.txt 0", &number);
+	bench_round_trip("handle_request_write", "write data.txt 0123456789abcdef", &number);
+	bench_round_trip("handle_request_read", "read data.txt 16", &number);
+}
+
+/* Block cache size set by the server's --block-cache option. */
+extern size_t block_cache_blocks;
+
+/* Times the same writes and reads as bench_handle_request() through the
+block cache. */
+void bench_block_cache()
+{
+	request_t request;
+	request_header_t header;
+	op_t op;
+	int number = 1;
+
+	block_cache_blocks = 1024;
+	init();
+	make_request(&request, "bench", 1, number++, "open data.txt readwrite");
+	decode_text_request(&request, &header, &op);
+	response_t *response = handle_request(&header, &op);
+	if (!response || response->status != 0) {
+		printf("FAILED: open\n");
+		return;
+	}
+
+	bench_round_trip("handle_request_write_cached", "write data.txt 0123456789abcdef", &number);
+	bench_round_trip("handle_request_read_cached", "read data.txt 16", &number);
+	block_cache_blocks = 0;
+}
+
+/* Decodes and handles one text request with the next request number. */
+static response_t *perform(const char *operation, int *number)
+{
+	request_t request;
+	request_header_t header;
+	op_t op;
+
+	make_request(&request, "bench", 1, (*number)++, operation);
+	decode_text_request(&request, &header, &op);
+	return handle_request(&header, &op);
+}
+
+/* Times small reads of a file in order, which are read ahead, against
+the same reads each after an lseek, which go to the disk one by one.
+Both start over from the beginning with an lseek after each pass. */
+void bench_readahead()
+{
+	static char data[READAHEAD_FILE];
+	char operation[64];
+	int number = 1;
+
+	memset(data, 'r', sizeof(data));
+	FILE *file = fopen("bench:ra.txt", "w");
+	if (!file || fwrite(data, 1, sizeof(data), file) != sizeof(data) || fclose(file) != 0) {
+		printf("FAILED: create ra.txt\n");
+		return;
+	}
+
+	init();
+	response_t *response = perform("open ra.txt readwrite", &number);
+	if (!response || response->status != 0) {
+		printf("FAILED: open\n");
+		return;
+	}
+
+	size_t reads = READAHEAD_FILE / READAHEAD_READ;
+	snprintf(operation, sizeof(operation), "read ra.txt %d", READAHEAD_READ);
+	uint64_t start = stats_now();
+	for (size_t i = 0; i < ROUND_TRIPS; ++i) {
+		if (i % reads == 0)
+			sink = (uintptr_t)perform("lseek ra.txt 0", &number);
+		sink = (uintptr_t)perform(operation, &number);
+	}
+	report("handle_request_read_sequential", READAHEAD_READ, ROUND_TRIPS, stats_now() - start);
+
+	start = stats_now();
+	for (size_t i = 0; i < ROUND_TRIPS; ++i) {
+		char lseek[64];
+		snprintf(lseek, sizeof(lseek), "lseek ra.txt %zu", i % reads * READAHEAD_READ);
+		sink = (uintptr_t)perform(lseek, &number);
+		sink = (uintptr_t)perform(operation, &number);
+	}
+	report("handle_request_read_seek", READAHEAD_READ, ROUND_TRIPS, stats_now() - start);
+}
+
+/* Appends one operation of a compound request at *p. */
+static char *add_op(char *p, opcode_t opcode, lock_t mode, const char *name, const char *data)
+{
+	bin_op_t op;
+	memset(&op, 0, sizeof(op));
+	op.opcode = (uint8_t)opcode;
+	op.mode = (uint8_t)mode;
+	op.name_len = (uint16_t)strlen(name);
+	op.length = data ? (uint32_t)strlen(data) : 0;
+	memcpy(p, &op, sizeof(op));
+	p += sizeof(op);
+	memcpy(p, name, op.name_len);
+	p += op.name_len;
+	if (data) {
+		memcpy(p, data, op.length);
+		p += op.length;
+	}
+	return p;
+}
+
+/* Times open, lseek, write and close sent as separate binary requests
+and as one compound request. */
+void bench_compound()
+{
+	static const opcode_t opcodes[] = { OP_OPEN, OP_LSEEK, OP_WRITE, OP_CLOSE };
+	char message[sizeof(bin_request_t) + 256];
+	bin_request_t *binary = (bin_request_t*)message;
+	request_header_t header;
+	op_t op;
+	int number = 1;
+
+	init();
+	memset(message, 0, sizeof(message));
+	binary->magic = BIN_REQUEST_MAGIC;
+	binary->version = BIN_REQUEST_VERSION;
+	strcpy(binary->machine, "bench");
+	binary->client = 2;
+
+	uint64_t start = stats_now();
+	for (size_t i = 0; i < ROUND_TRIPS; ++i) {
+		for (int j = 0; j < 4; ++j) {
+			binary->opcode = (uint8_t)opcodes[j];
+			binary->mode = LOCK_READ | LOCK_WRITE;
+			binary->name_len = 8;
+			binary->length = opcodes[j] == OP_WRITE ? 16 : 0;
+			binary->request = number++;
+			memcpy(message + sizeof(bin_request_t), "seq.txt00123456789abcdef", 24);
+			size_t size = sizeof(bin_request_t) + 8 + binary->length;
+			decode_binary_request(message, size, &header, &op);
+			sink = (uintptr_t)handle_request(&header, &op);
+		}
+	}
+	report("handle_request_separate_4", 0, ROUND_TRIPS, stats_now() - start);
+
+	char *end = message + sizeof(bin_request_t);
+	end = add_op(end, OP_OPEN, LOCK_READ | LOCK_WRITE, "cmp.txt0", (const char*)0);
+	end = add_op(end, OP_LSEEK, LOCK_UNLOCKED, "cmp.txt0", (const char*)0);
+	end = add_op(end, OP_WRITE, LOCK_UNLOCKED, "cmp.txt0", "0123456789abcdef");
+	end = add_op(end, OP_CLOSE, LOCK_UNLOCKED, "cmp.txt0", (const char*)0);
+	binary->opcode = OP_COMPOUND;
+	binary->mode = 0;
+	binary->name_len = 0;
+	binary->length = 4;
+
+	start = stats_now();
+	for (size_t i = 0; i < ROUND_TRIPS; ++i) {
+		binary->request = number++;
+		decode_binary_request(message, (size_t)(end - message), &header, &op);
+		sink = (uintptr_t)handle_request(&header, &op);
+	}
+	report("handle_request_compound_4", 0, ROUND_TRIPS, stats_now() - start);
+}
+
+/* Log settings of the server's --wal and --snapshot-every options. */
+extern const char *wal_directory;
+extern size_t snapshot_every;
+
+/* Times recovering from a log of a million entries, as a restarted
+server does before it serves requests: loading the log, replaying it
+and writing the snapshot that replaces it. */
+void bench_wal_replay()
+{
+	request_t request;
+	request_header_t header;
+	op_t op;
+	char operation[64];
+
+	if (mkdir("wal", 0755) < 0)
+		fail_with_error("mkdir() failed");
+	wal_directory = "wal";
+	snapshot_every = 0;
+	if (wal_load(wal_directory, 1, net_shard_of, snapshot_every) < 0) {
+		printf("FAILED: wal_load\n");
+		return;
+	}
+	init();
+
+	for (int c = 0; c < REPLAY_CLIENTS; ++c) {
+		snprintf(operation, sizeof(operation), "open wal%d readwrite", c);
+		make_request(&request, "replay", c + 1, 1, operation);
+		decode_text_request(&request, &header, &op);
+		sink = (uintptr_t)handle_request(&header, &op);
+	}
+	for (int i = 0; i < REPLAY_ENTRIES / 2; ++i) {
+		int c = i % REPLAY_CLIENTS;
+		snprintf(operation, sizeof(operation), "lseek wal%d %d", c, i);
+		make_request(&request, "replay", c + 1, i / REPLAY_CLIENTS + 2, operation);
+		decode_text_request(&request, &header, &op);
+		sink = (uintptr_t)handle_request(&header, &op);
+		if (i % 10000 == 0)
+			wal_commit();
+	}
+	wal_commit();
+
+	uint64_t start = stats_now();
+	if (wal_load(wal_directory, 1, net_shard_of, snapshot_every) < 0) {
+		printf("FAILED: wal_load\n");
+		return;
+	}
+	init();
+	report("wal_replay", REPLAY_ENTRIES, REPLAY_ENTRIES, stats_now() - start);
+	wal_directory = (const char*)0;
+
+	char path[sizeof("wal/") + sizeof(((struct dirent*)0)->d_name)];
+	DIR *d = opendir("wal");
+	struct dirent *e;
+	while (d && (e = readdir(d))) {
+		snprintf(path, sizeof(path), "wal/%s", e->d_name);
+		unlink(path);
+	}
+	if (d)
+		closedir(d);
+	rmdir("wal");
+	for (int c = 0; c < REPLAY_CLIENTS; ++c) {
+		snprintf(path, sizeof(path), "replay:wal%d", c);
+		unlink(path);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	/* Files created by the benchmarks go into a scratch directory. */
+	char dir[] = "/tmp/fsbenchXXXXXX";
+	if (!mkdtemp(dir) || chdir(dir) < 0)
+		fail_with_error("mkdtemp() failed");
+	log_level = LOG_LEVEL_ERROR;
+
+	bench_list();
+	bench_find_file();
+	bench_retrieve_client();
+	bench_decode();
+	bench_handle_request();
+	bench_block_cache();
+	bench_readahead();
+	bench_compound();
+	bench_wal_replay();
+
+	unlink("bench:data.txt");
+	unlink("bench:ra.txt");
+	unlink("bench:seq.txt0");
+	unlink("bench:cmp.txt0");
+	rmdir(dir);
+	return 0;
+}
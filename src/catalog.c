@@ -0,0 +1,263 @@
+/* A persistent, memory-mapped catalog of the files on disk used in the
+   server. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+#include "htable.h"
+
+/* The table grows once it is half full. */
+#define CATALOG_MAX_LOAD 2
+
+/* Returns the slots following the header of a mapped catalog. */
+static catalog_slot_t *catalog_slots(char *map)
+{
+	return (catalog_slot_t*)(map + sizeof(catalog_header_t));
+}
+
+/* Computes the hash of a name, which is never 0. */
+static uint64_t catalog_hash(const char *machine, size_t machine_len,
+	const char *filename, size_t filename_len)
+{
+	uint64_t hash = htable_hash(machine, machine_len, HTABLE_SEED);
+	hash = htable_hash(filename, filename_len, hash);
+	return hash ? hash : 1;
+}
+
+/* Finds the slot holding a name, or the empty slot where it belongs.
+   Returns a null pointer if neither turns up within one pass over the
+   slots, which only a damaged file can cause. */
+static catalog_slot_t *catalog_probe(char *map, uint64_t hash, const char *machine,
+	size_t machine_len, const char *filename, size_t filename_len)
+{
+	catalog_header_t *header = (catalog_header_t*)map;
+	catalog_slot_t *slots = catalog_slots(map);
+	size_t mask = (size_t)header->slots - 1;
+
+	size_t i = (size_t)hash & mask;
+	for (uint64_t step = 0; step < header->slots; ++step, i = (i + 1) & mask) {
+		catalog_slot_t *slot = &slots[i];
+		uint64_t slot_hash = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+		if (slot_hash == 0)
+			return slot;
+		if (slot_hash == hash && slot->machine_len == machine_len &&
+			slot->filename_len == filename_len &&
+			memcmp(slot->name, machine, machine_len) == 0 &&
+			memcmp(slot->name + machine_len, filename, filename_len) == 0)
+			return slot;
+	}
+	return (catalog_slot_t*)0;
+}
+
+/* Fills an empty slot, publishing it by storing its hash last. */
+static void catalog_fill(catalog_slot_t *slot, uint64_t hash, const char *machine,
+	size_t machine_len, const char *filename, size_t filename_len)
+{
+	slot->machine_len = (uint8_t)machine_len;
+	slot->filename_len = (uint8_t)filename_len;
+	memcpy(slot->name, machine, machine_len);
+	memcpy(slot->name + machine_len, filename, filename_len);
+	__atomic_store_n(&slot->hash, hash, __ATOMIC_RELEASE);
+}
+
+/* Creates an empty catalog file with the given number of slots and maps
+   it. Returns the descriptor, or -1 and sets errno on failure. */
+static int catalog_create(const char *path, uint64_t slots, char **map, size_t *size)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	*size = sizeof(catalog_header_t) + (size_t)slots * sizeof(catalog_slot_t);
+	if (ftruncate(fd, (off_t)*size) < 0) {
+		close(fd);
+		return -1;
+	}
+	*map = (char*)mmap((void*)0, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (*map == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	catalog_header_t *header = (catalog_header_t*)*map;
+	header->magic = CATALOG_MAGIC;
+	header->version = CATALOG_VERSION;
+	header->slots = slots;
+	header->count = 0;
+	return fd;
+}
+
+/* Writes a new catalog file at path + ".tmp" holding the given slots and
+   renames it over path, so the catalog on disk is always whole. Returns
+   0 if successful, -1 if not. */
+static int catalog_replace(catalog_t *catalog, uint64_t slots)
+{
+	char temp[4096];
+	snprintf(temp, sizeof(temp), "%s.tmp", catalog->path);
+
+	char *map;
+	size_t size;
+	int fd = catalog_create(temp, slots, &map, &size);
+	if (fd < 0)
+		return -1;
+
+	if (catalog->map) {
+		catalog_header_t *old = (catalog_header_t*)catalog->map;
+		catalog_slot_t *old_slots = catalog_slots(catalog->map);
+		uint64_t count = 0;
+		for (uint64_t i = 0; i < old->slots; ++i) {
+			/* Drop slots whose name does not fit, which a damaged file
+			   may have. */
+			catalog_slot_t *slot = &old_slots[i];
+			if (slot->hash == 0 ||
+				(size_t)slot->machine_len + slot->filename_len > sizeof(slot->name))
+				continue;
+			const char *filename = slot->name + slot->machine_len;
+			catalog_fill(catalog_probe(map, slot->hash, slot->name, slot->machine_len,
+				filename, slot->filename_len), slot->hash, slot->name, slot->machine_len,
+				filename, slot->filename_len);
+			count = count + 1;
+		}
+		((catalog_header_t*)map)->count = count;
+	}
+
+	if (msync(map, size, MS_SYNC) < 0 || rename(temp, catalog->path) < 0) {
+		munmap(map, size);
+		close(fd);
+		unlink(temp);
+		return -1;
+	}
+
+	if (catalog->map) {
+		munmap(catalog->map, catalog->size);
+		close(catalog->fd);
+	}
+	catalog->fd = fd;
+	catalog->map = map;
+	catalog->size = size;
+	return 0;
+}
+
+/* Maps the catalog at path, creating an empty one if there is none.
+   Returns 0 if successful, -1 if the file cannot be used. */
+int catalog_open(catalog_t *catalog, const char *path)
+{
+	memset(catalog, 0, sizeof(catalog_t));
+	catalog->fd = -1;
+	catalog->path = strdup(path);
+	if (!catalog->path || pthread_mutex_init(&catalog->lock, (const pthread_mutexattr_t*)0) != 0)
+		return -1;
+
+	int fd = open(path, O_RDWR);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			return -1;
+		return catalog_replace(catalog, CATALOG_INITIAL_SLOTS);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(catalog_header_t)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	char *map = (char*)mmap((void*)0, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	/* Refuse anything whose slots do not exactly fill the file, or that
+	   counts more of them in use than the table holds. The slots are not
+	   read until looked up, so opening stays cheap. */
+	catalog_header_t *header = (catalog_header_t*)map;
+	if (header->magic != CATALOG_MAGIC || header->version != CATALOG_VERSION ||
+		header->slots == 0 || (header->slots & (header->slots - 1)) != 0 ||
+		header->slots > ((uint64_t)st.st_size - sizeof(catalog_header_t)) / sizeof(catalog_slot_t) ||
+		(size_t)st.st_size != sizeof(catalog_header_t) + (size_t)header->slots * sizeof(catalog_slot_t) ||
+		header->count > header->slots / CATALOG_MAX_LOAD) {
+		munmap(map, (size_t)st.st_size);
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	catalog->fd = fd;
+	catalog->map = map;
+	catalog->size = (size_t)st.st_size;
+	return 0;
+}
+
+/* Returns 1 if the catalog lists the file, 0 if not. */
+int catalog_contains(catalog_t *catalog, const char *machine, size_t machine_len,
+	const char *filename, size_t filename_len)
+{
+	if (machine_len + filename_len > sizeof(((catalog_slot_t*)0)->name))
+		return 0;
+	uint64_t hash = catalog_hash(machine, machine_len, filename, filename_len);
+
+	pthread_mutex_lock(&catalog->lock);
+	catalog_slot_t *slot = catalog_probe(catalog->map, hash, machine, machine_len,
+		filename, filename_len);
+	int found = slot && slot->hash != 0;
+	pthread_mutex_unlock(&catalog->lock);
+	return found;
+}
+
+/* Adds a file to the catalog if it is not listed yet. The change reaches
+   the disk with the rest of the page cache. Returns 0 if successful, -1
+   if the name is too long, the catalog could not grow, or its file is
+   damaged so that no slot is free. */
+int catalog_add(catalog_t *catalog, const char *machine, size_t machine_len,
+	const char *filename, size_t filename_len)
+{
+	if (machine_len > UINT8_MAX || filename_len > UINT8_MAX ||
+		machine_len + filename_len > sizeof(((catalog_slot_t*)0)->name))
+		return -1;
+	uint64_t hash = catalog_hash(machine, machine_len, filename, filename_len);
+
+	pthread_mutex_lock(&catalog->lock);
+	catalog_header_t *header = (catalog_header_t*)catalog->map;
+	catalog_slot_t *slot = catalog_probe(catalog->map, hash, machine, machine_len,
+		filename, filename_len);
+	if (!slot) {
+		pthread_mutex_unlock(&catalog->lock);
+		errno = EINVAL;
+		return -1;
+	}
+	if (slot->hash == 0) {
+		if ((header->count + 1) * CATALOG_MAX_LOAD > header->slots) {
+			if (catalog_replace(catalog, header->slots * 2) < 0) {
+				pthread_mutex_unlock(&catalog->lock);
+				return -1;
+			}
+			header = (catalog_header_t*)catalog->map;
+			slot = catalog_probe(catalog->map, hash, machine, machine_len,
+				filename, filename_len);
+		}
+		catalog_fill(slot, hash, machine, machine_len, filename, filename_len);
+		header->count = header->count + 1;
+	}
+	pthread_mutex_unlock(&catalog->lock);
+	return 0;
+}
+
+/* Unmaps the catalog. */
+void catalog_close(catalog_t *catalog)
+{
+	if (catalog->map)
+		munmap(catalog->map, catalog->size);
+	if (catalog->fd >= 0)
+		close(catalog->fd);
+	pthread_mutex_destroy(&catalog->lock);
+	free(catalog->path);
+	memset(catalog, 0, sizeof(catalog_t));
+	catalog->fd = -1;
+}
@@ -0,0 +1,109 @@
+/* A bounded LRU cache of open file descriptors used in the server. */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "fdcache.h"
+
+/* Unlinks an entry from the LRU list. */
+static void fdcache_unlink(fdcache_entry_t *entry)
+{
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	entry->prev = entry;
+	entry->next = entry;
+}
+
+/* Links an entry at the most recently used end of the list. */
+static void fdcache_link_front(fdcache_t *cache, fdcache_entry_t *entry)
+{
+	entry->next = cache->head.next;
+	entry->prev = &cache->head;
+	cache->head.next->prev = entry;
+	cache->head.next = entry;
+}
+
+/* Initializes the cache. A capacity of 0 selects the default. The
+   capacity is clamped so the cache alone can never exhaust
+   RLIMIT_NOFILE. */
+void fdcache_init(fdcache_t *cache, size_t capacity)
+{
+	memset(cache, 0, sizeof(fdcache_t));
+	cache->head.fd = -1;
+	cache->head.prev = &cache->head;
+	cache->head.next = &cache->head;
+
+	if (capacity == 0)
+		capacity = FDCACHE_DEFAULT_CAPACITY;
+
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+		size_t usable = limit.rlim_cur > 2 * FDCACHE_RESERVED_FDS ?
+			(size_t)limit.rlim_cur - FDCACHE_RESERVED_FDS : (size_t)limit.rlim_cur / 2;
+		if (capacity > usable)
+			capacity = usable;
+	}
+	if (capacity == 0)
+		capacity = 1;
+
+	cache->capacity = capacity;
+}
+
+/* Initializes an entry that holds no descriptor. */
+void fdcache_entry_init(fdcache_entry_t *entry)
+{
+	entry->fd = -1;
+	entry->prev = entry;
+	entry->next = entry;
+}
+
+/* Returns the descriptor cached for the entry and marks it most
+   recently used, or -1 if none is cached. */
+int fdcache_get(fdcache_t *cache, fdcache_entry_t *entry)
+{
+	if (entry->fd < 0)
+		return -1;
+
+	fdcache_unlink(entry);
+	fdcache_link_front(cache, entry);
+	return entry->fd;
+}
+
+/* Caches a freshly opened descriptor for the entry, closing the least
+   recently used descriptors if the cache is over capacity. */
+void fdcache_put(fdcache_t *cache, fdcache_entry_t *entry, int fd)
+{
+	if (entry->fd >= 0)
+		fdcache_drop(cache, entry);
+
+	entry->fd = fd;
+	fdcache_link_front(cache, entry);
+	cache->size = cache->size + 1;
+
+	while (cache->size > cache->capacity)
+		fdcache_evict(cache);
+}
+
+/* Closes and forgets the descriptor cached for the entry, if any. */
+void fdcache_drop(fdcache_t *cache, fdcache_entry_t *entry)
+{
+	if (entry->fd < 0)
+		return;
+
+	fdcache_unlink(entry);
+	close(entry->fd);
+	entry->fd = -1;
+	cache->size = cache->size - 1;
+}
+
+/* Closes the least recently used descriptor. Returns 0 if one was
+   closed, -1 if the cache was empty. */
+int fdcache_evict(fdcache_t *cache)
+{
+	if (cache->head.prev == &cache->head)
+		return -1;
+
+	fdcache_drop(cache, cache->head.prev);
+	return 0;
+}
@@ -0,0 +1,474 @@
+/* A client library for the file server, speaking the binary protocol. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "fsclient.h"
+#include "rto.h"
+
+/* A request in the window. request is 0 while the slot is free. */
+typedef struct {
+	int32_t request;
+	opcode_t opcode;
+	char *datagram;
+	size_t size;
+	uint64_t sent_us;
+	uint64_t deadline_us;
+	long rto_ms;
+	int attempts;
+	fsclient_callback_t callback;
+	void *arg;
+} fsclient_slot_t;
+
+struct fsclient {
+	int sock;
+	struct sockaddr_in server;
+	char machine[24];
+	int32_t client;
+	int32_t incarnation;
+	int32_t next_request;
+	fsclient_options_t options;
+
+	fsclient_slot_t *slots;
+	int outstanding;
+	char *reply;
+
+	rto_t rto;
+};
+
+/* Returns the monotonic time in microseconds. */
+static uint64_t fsclient_now_us(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/* Fills in the default options. */
+void fsclient_default_options(fsclient_options_t *options)
+{
+	memset(options, 0, sizeof(fsclient_options_t));
+	options->window = 1;
+	options->initial_rto_ms = 200;
+	options->min_rto_ms = 10;
+	options->max_rto_ms = 5000;
+	options->max_attempts = 10;
+}
+
+/* Reads the incarnation number from the incarnation file, moves it to
+   the next one and writes that back durably. A missing file starts at
+   incarnation 1. Returns 0 if successful, -1 if not. */
+static int fsclient_next_incarnation(fsclient_t *client)
+{
+	const char *path = client->options.incarnation_file;
+	long incarnation = 0;
+
+	FILE *file = fopen(path, "r");
+	if (file) {
+		if (fscanf(file, "%ld", &incarnation) != 1)
+			incarnation = 0;
+		fclose(file);
+	}
+	++incarnation;
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	char text[24];
+	int len = snprintf(text, sizeof(text), "%ld\n", incarnation);
+	if (write(fd, text, (size_t)len) != len || fsync(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	client->incarnation = (int32_t)incarnation;
+	return 0;
+}
+
+/* Forgets every outstanding request. */
+static void fsclient_abandon(fsclient_t *client)
+{
+	for (int i = 0; i < client->options.window; ++i)
+		client->slots[i].request = 0;
+	client->outstanding = 0;
+}
+
+/* Connects to the server as the given machine and client. */
+fsclient_t *fsclient_connect(const char *server_ip, unsigned short port, const char *machine,
+	int32_t id, const fsclient_options_t *options)
+{
+	if (strlen(machine) == 0 || strlen(machine) >= sizeof(((fsclient_t*)0)->machine)) {
+		errno = EINVAL;
+		return (fsclient_t*)0;
+	}
+
+	fsclient_t *client = (fsclient_t*)calloc(1, sizeof(fsclient_t));
+	if (!client)
+		return (fsclient_t*)0;
+	if (options)
+		client->options = *options;
+	else
+		fsclient_default_options(&client->options);
+	if (client->options.window < 1)
+		client->options.window = 1;
+	if (client->options.window > FSCLIENT_MAX_WINDOW)
+		client->options.window = FSCLIENT_MAX_WINDOW;
+
+	strcpy(client->machine, machine);
+	client->client = id;
+	client->incarnation = client->options.incarnation;
+	client->next_request = 1;
+	rto_init(&client->rto, client->options.initial_rto_ms, client->options.min_rto_ms,
+		client->options.max_rto_ms);
+	client->sock = -1;
+
+	memset(&client->server, 0, sizeof(client->server));
+	client->server.sin_family = AF_INET;
+	client->server.sin_port = htons(port);
+	if (inet_pton(AF_INET, server_ip, &client->server.sin_addr) != 1) {
+		free(client);
+		errno = EINVAL;
+		return (fsclient_t*)0;
+	}
+
+	client->slots = (fsclient_slot_t*)calloc(client->options.window, sizeof(fsclient_slot_t));
+	client->reply = (char*)malloc(BIN_MAX_DATAGRAM);
+	if (!client->slots || !client->reply)
+		goto fail;
+	for (int i = 0; i < client->options.window; ++i)
+		if (!(client->slots[i].datagram = (char*)malloc(BIN_MAX_DATAGRAM)))
+			goto fail;
+
+	if (client->options.incarnation_file && fsclient_next_incarnation(client) < 0)
+		goto fail;
+
+	/* Connecting the socket filters out datagrams from anyone else. */
+	client->sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (client->sock < 0 ||
+		connect(client->sock, (struct sockaddr*)&client->server, sizeof(client->server)) < 0)
+		goto fail;
+
+	return client;
+
+fail:
+	fsclient_disconnect(client);
+	return (fsclient_t*)0;
+}
+
+/* Closes the connection. */
+void fsclient_disconnect(fsclient_t *client)
+{
+	int error = errno;
+	if (client->sock >= 0)
+		close(client->sock);
+	if (client->slots)
+		for (int i = 0; i < client->options.window; ++i)
+			free(client->slots[i].datagram);
+	free(client->slots);
+	free(client->reply);
+	free(client);
+	errno = error;
+}
+
+/* Starts a new incarnation. */
+int fsclient_restart(fsclient_t *client)
+{
+	fsclient_abandon(client);
+	client->next_request = 1;
+	if (client->options.incarnation_file)
+		return fsclient_next_incarnation(client);
+	client->incarnation = client->incarnation + 1;
+	return 0;
+}
+
+/* Returns the current retransmission timeout in milliseconds. */
+long fsclient_rto_ms(const fsclient_t *client)
+{
+	return client->rto.rto_ms;
+}
+
+/* Sends or resends the request in a slot, and sets when to resend it. */
+static int fsclient_send(fsclient_t *client, fsclient_slot_t *slot)
+{
+	ssize_t sent;
+	do {
+		sent = send(client->sock, slot->datagram, slot->size, 0);
+	} while (sent < 0 && errno == EINTR);
+	/* A refused or dropped send is recovered by retransmission. */
+	if (sent < 0 && errno != ECONNREFUSED && errno != ENOBUFS && errno != EAGAIN)
+		return -1;
+
+	slot->attempts = slot->attempts + 1;
+	slot->sent_us = fsclient_now_us();
+	slot->deadline_us = slot->sent_us + (uint64_t)slot->rto_ms * 1000;
+	return 0;
+}
+
+/* Frees a slot and calls its callback. */
+static void fsclient_complete(fsclient_t *client, fsclient_slot_t *slot, int status,
+	int32_t size, const char *data)
+{
+	fsclient_callback_t callback = slot->callback;
+	void *arg = slot->arg;
+	slot->request = 0;
+	client->outstanding = client->outstanding - 1;
+	if (callback)
+		callback(arg, status, size, data);
+}
+
+/* Handles a reply datagram. Replies to requests no longer outstanding
+   are duplicates and are ignored. */
+static void fsclient_handle_reply(fsclient_t *client, const char *reply, size_t size)
+{
+	bin_response_t header;
+	if (size < sizeof(bin_response_t))
+		return;
+	memcpy(&header, reply, sizeof(header));
+	if (header.magic != BIN_REQUEST_MAGIC || header.request <= 0)
+		return;
+
+	for (int i = 0; i < client->options.window; ++i) {
+		fsclient_slot_t *slot = &client->slots[i];
+		if (slot->request != header.request)
+			continue;
+
+		/* Only replies to requests sent once tell the round trip time,
+		   since a reply to a resent one may answer either send. */
+		if (slot->attempts == 1)
+			rto_sample(&client->rto, fsclient_now_us() - slot->sent_us);
+
+		/* A read reply carries its data; never trust size beyond it. */
+		size_t data = size - sizeof(bin_response_t);
+		if (slot->opcode == OP_READ && header.size > 0 && (size_t)header.size > data)
+			header.size = (int32_t)data;
+		fsclient_complete(client, slot, header.status, header.size, reply + sizeof(bin_response_t));
+		return;
+	}
+}
+
+/* Waits for replies until the earliest retransmission is due and
+   handles them, then resends requests whose timeout passed and fails
+   those out of attempts.
+   Returns 0 if successful, -1 and sets errno on failure. */
+static int fsclient_poll(fsclient_t *client)
+{
+	uint64_t now = fsclient_now_us();
+	uint64_t first = UINT64_MAX;
+	for (int i = 0; i < client->options.window; ++i)
+		if (client->slots[i].request && client->slots[i].deadline_us < first)
+			first = client->slots[i].deadline_us;
+
+	int timeout = first == UINT64_MAX ? -1 : first <= now ? 0 : (int)((first - now + 999) / 1000);
+	struct pollfd pfd = { client->sock, POLLIN, 0 };
+	int ready = poll(&pfd, 1, timeout);
+	if (ready < 0 && errno != EINTR)
+		return -1;
+
+	if (ready > 0) {
+		for (;;) {
+			ssize_t size = recv(client->sock, client->reply, BIN_MAX_DATAGRAM, MSG_DONTWAIT);
+			if (size < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED || errno == EINTR)
+					break;
+				return -1;
+			}
+			fsclient_handle_reply(client, client->reply, (size_t)size);
+		}
+	}
+
+	now = fsclient_now_us();
+	for (int i = 0; i < client->options.window; ++i) {
+		fsclient_slot_t *slot = &client->slots[i];
+		if (!slot->request || slot->deadline_us > now)
+			continue;
+		if (client->options.max_attempts > 0 && slot->attempts >= client->options.max_attempts) {
+			fsclient_complete(client, slot, -1, 0, (const char*)0);
+			continue;
+		}
+		slot->rto_ms = rto_backoff(&client->rto, slot->rto_ms);
+		if (fsclient_send(client, slot) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Waits until no more than outstanding requests are in flight. */
+int fsclient_drain(fsclient_t *client, int outstanding)
+{
+	while (client->outstanding > outstanding)
+		if (fsclient_poll(client) < 0)
+			return -1;
+	return 0;
+}
+
+/* Sends a request without waiting for its reply. */
+int32_t fsclient_submit(fsclient_t *client, opcode_t opcode, const char *filename, int mode,
+	int flags, int64_t offset, const void *data, size_t length, fsclient_callback_t callback,
+	void *arg)
+{
+	size_t name_len = filename ? strlen(filename) : 0;
+	size_t payload = opcode == OP_WRITE ? length : 0;
+	if (opcode == OP_READ_STREAM || opcode == OP_RESEND || opcode == OP_COMPOUND ||
+		(flags & ~BIN_FLAG_WAIT) || name_len > UINT16_MAX || sizeof(bin_request_t) + name_len + payload > BIN_MAX_DATAGRAM) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (fsclient_drain(client, client->options.window - 1) < 0)
+		return -1;
+
+	fsclient_slot_t *slot = client->slots;
+	while (slot->request)
+		++slot;
+
+	bin_request_t request;
+	memset(&request, 0, sizeof(request));
+	request.magic = BIN_REQUEST_MAGIC;
+	request.version = BIN_REQUEST_VERSION;
+	request.opcode = (uint8_t)opcode;
+	request.mode = (uint8_t)mode;
+	request.flags = (uint8_t)flags;
+	request.name_len = (uint16_t)name_len;
+	request.length = (uint32_t)length;
+	strcpy(request.machine, client->machine);
+	request.client = client->client;
+	request.request = client->next_request;
+	request.incarnation = client->incarnation;
+	request.offset = offset;
+
+	memcpy(slot->datagram, &request, sizeof(request));
+	memcpy(slot->datagram + sizeof(request), filename, name_len);
+	if (payload)
+		memcpy(slot->datagram + sizeof(request) + name_len, data, payload);
+	slot->size = sizeof(request) + name_len + payload;
+	slot->request = client->next_request;
+	slot->opcode = opcode;
+	slot->attempts = 0;
+	slot->rto_ms = client->rto.rto_ms;
+	slot->callback = callback;
+	slot->arg = arg;
+	client->next_request = client->next_request + 1;
+	client->outstanding = client->outstanding + 1;
+
+	if (fsclient_send(client, slot) < 0) {
+		slot->request = 0;
+		client->outstanding = client->outstanding - 1;
+		return -1;
+	}
+	return request.request;
+}
+
+/* Result of a synchronous call. */
+typedef struct {
+	char done;
+	int status;
+	int32_t size;
+	char *buffer;
+	size_t capacity;
+} fsclient_result_t;
+
+static void fsclient_store_result(void *arg, int status, int32_t size, const char *data)
+{
+	fsclient_result_t *result = (fsclient_result_t*)arg;
+	result->done = 1;
+	result->status = status;
+	result->size = size;
+	if (result->buffer && status == 0 && size > 0)
+		memcpy(result->buffer, data, (size_t)size < result->capacity ? (size_t)size : result->capacity);
+}
+
+/* Stops calling back for a request that is still outstanding. It is
+   still retransmitted until it completes or runs out of attempts. */
+static void fsclient_forget(fsclient_t *client, int32_t request)
+{
+	for (int i = 0; i < client->options.window; ++i) {
+		if (client->slots[i].request == request) {
+			client->slots[i].callback = (fsclient_callback_t)0;
+			client->slots[i].arg = (void*)0;
+		}
+	}
+}
+
+/* Sends a request and waits for its reply. Returns the size the server
+   reported, or -1 with errno set. */
+static ssize_t fsclient_call(fsclient_t *client, opcode_t opcode, const char *filename, int mode,
+	int flags, int64_t offset, const void *data, size_t length, void *buffer)
+{
+	fsclient_result_t result;
+	memset(&result, 0, sizeof(result));
+	result.buffer = (char*)buffer;
+	result.capacity = length;
+
+	int32_t request = fsclient_submit(client, opcode, filename, mode, flags, offset, data, length,
+		fsclient_store_result, &result);
+	if (request < 0)
+		return -1;
+	while (!result.done) {
+		if (fsclient_poll(client) < 0) {
+			/* result is gone once this returns. */
+			int error = errno;
+			fsclient_forget(client, request);
+			errno = error;
+			return -1;
+		}
+	}
+
+	if (result.status != 0) {
+		errno = result.status < 0 ? ETIMEDOUT : result.status;
+		return -1;
+	}
+	return result.size;
+}
+
+int fsclient_open(fsclient_t *client, const char *filename, int mode)
+{
+	return fsclient_call(client, OP_OPEN, filename, mode, 0, 0, (const void*)0, 0, (void*)0) < 0 ? -1 : 0;
+}
+
+int fsclient_close(fsclient_t *client, const char *filename)
+{
+	return fsclient_call(client, OP_CLOSE, filename, 0, 0, 0, (const void*)0, 0, (void*)0) < 0 ? -1 : 0;
+}
+
+ssize_t fsclient_read(fsclient_t *client, const char *filename, void *buffer, size_t length)
+{
+	return fsclient_call(client, OP_READ, filename, 0, 0, 0, (const void*)0, length, buffer);
+}
+
+ssize_t fsclient_write(fsclient_t *client, const char *filename, const void *data, size_t length)
+{
+	return fsclient_call(client, OP_WRITE, filename, 0, 0, 0, data, length, (void*)0);
+}
+
+int fsclient_lseek(fsclient_t *client, const char *filename, int64_t offset)
+{
+	return fsclient_call(client, OP_LSEEK, filename, 0, 0, offset, (const void*)0, 0, (void*)0) < 0 ? -1 : 0;
+}
+
+int fsclient_renew(fsclient_t *client)
+{
+	return fsclient_call(client, OP_RENEW, "", 0, 0, 0, (const void*)0, 0, (void*)0) < 0 ? -1 : 0;
+}
+
+int fsclient_lock(fsclient_t *client, const char *filename, int mode, int64_t offset,
+	uint32_t length)
+{
+	return fsclient_call(client, OP_LOCK, filename, mode, 0, offset, (const void*)0, length,
+		(void*)0) < 0 ? -1 : 0;
+}
+
+int fsclient_unlock(fsclient_t *client, const char *filename, int64_t offset, uint32_t length)
+{
+	return fsclient_call(client, OP_UNLOCK, filename, 0, 0, offset, (const void*)0, length,
+		(void*)0) < 0 ? -1 : 0;
+}
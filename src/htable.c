@@ -0,0 +1,148 @@
+/* A chained hash table with incremental resizing used in the server. */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "htable.h"
+
+#define HTABLE_INITIAL_BUCKETS 16
+#define HTABLE_REHASH_STEP 4
+
+/* Initializes the table. Buckets are allocated on the first insert. */
+void htable_init(htable_t *table)
+{
+	memset(table, 0, sizeof(htable_t));
+}
+
+/* Moves up to HTABLE_REHASH_STEP old buckets into the new table, and
+   retires the old table once it is empty. */
+static void htable_rehash_step(htable_t *table)
+{
+	for (int step = 0; step < HTABLE_REHASH_STEP; ++step) {
+		if (table->rehash_index >= table->nbuckets[0]) {
+			free(table->buckets[0]);
+			table->buckets[0] = table->buckets[1];
+			table->nbuckets[0] = table->nbuckets[1];
+			table->buckets[1] = (htable_node_t**)0;
+			table->nbuckets[1] = 0;
+			table->rehashing = 0;
+			return;
+		}
+
+		htable_node_t *node = table->buckets[0][table->rehash_index];
+		while (node) {
+			htable_node_t *next = node->next;
+			size_t slot = node->hash & (table->nbuckets[1] - 1);
+			node->next = table->buckets[1][slot];
+			table->buckets[1][slot] = node;
+			node = next;
+		}
+		table->buckets[0][table->rehash_index] = (htable_node_t*)0;
+		table->rehash_index = table->rehash_index + 1;
+	}
+}
+
+/* Returns the address of the link pointing at the matching node in the
+   given generation of buckets, or a null pointer if there is none. */
+static htable_node_t ** htable_lookup(htable_t *table, int gen, uint64_t hash,
+	htable_match_t match, const void *key)
+{
+	if (table->nbuckets[gen] == 0)
+		return (htable_node_t**)0;
+
+	htable_node_t **link = &table->buckets[gen][hash & (table->nbuckets[gen] - 1)];
+	while (*link) {
+		if ((*link)->hash == hash && match((*link)->element, key))
+			return link;
+		link = &(*link)->next;
+	}
+
+	return (htable_node_t**)0;
+}
+
+/* Returns the element matching the key, or a null pointer if there is none. */
+void * htable_find(htable_t *table, uint64_t hash, htable_match_t match, const void *key)
+{
+	if (table->rehashing)
+		htable_rehash_step(table);
+
+	htable_node_t **link = htable_lookup(table, 0, hash, match, key);
+	if (!link && table->rehashing)
+		link = htable_lookup(table, 1, hash, match, key);
+
+	return link ? (*link)->element : (void*)0;
+}
+
+/* Inserts the given element. The caller is responsible for making sure
+   no matching element is already present. Returns 0 if successful,
+   -1 if unsuccessful. */
+int htable_insert(htable_t *table, uint64_t hash, void *element)
+{
+	if (table->nbuckets[0] == 0) {
+		htable_node_t **p = (htable_node_t**)calloc(HTABLE_INITIAL_BUCKETS, sizeof(htable_node_t*));
+		if (!p)
+			return -1;
+		table->buckets[0] = p;
+		table->nbuckets[0] = HTABLE_INITIAL_BUCKETS;
+	} else if (table->rehashing) {
+		htable_rehash_step(table);
+	} else if (table->size >= table->nbuckets[0]) {
+		/* Load factor reached 1. Start migrating into a table twice
+		   the size; a failed allocation just postpones the resize. */
+		htable_node_t **p = (htable_node_t**)calloc(table->nbuckets[0] * 2, sizeof(htable_node_t*));
+		if (p) {
+			table->buckets[1] = p;
+			table->nbuckets[1] = table->nbuckets[0] * 2;
+			table->rehash_index = 0;
+			table->rehashing = 1;
+		}
+	}
+
+	htable_node_t *node = (htable_node_t*)malloc(sizeof(htable_node_t));
+	if (!node)
+		return -1;
+	node->hash = hash;
+	node->element = element;
+
+	/* New elements always go into the newest generation. */
+	int gen = table->rehashing ? 1 : 0;
+	size_t slot = hash & (table->nbuckets[gen] - 1);
+	node->next = table->buckets[gen][slot];
+	table->buckets[gen][slot] = node;
+	table->size = table->size + 1;
+
+	return 0;
+}
+
+/* Removes and returns the element matching the key, or a null pointer
+   if there is none. */
+void * htable_remove(htable_t *table, uint64_t hash, htable_match_t match, const void *key)
+{
+	if (table->rehashing)
+		htable_rehash_step(table);
+
+	htable_node_t **link = htable_lookup(table, 0, hash, match, key);
+	if (!link && table->rehashing)
+		link = htable_lookup(table, 1, hash, match, key);
+	if (!link)
+		return (void*)0;
+
+	htable_node_t *node = *link;
+	void *element = node->element;
+	*link = node->next;
+	free(node);
+	table->size = table->size - 1;
+	return element;
+}
+
+/* Hashes a run of bytes with 64-bit FNV-1a, continuing from the given seed. */
+uint64_t htable_hash(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = (const unsigned char*)data;
+	uint64_t hash = seed;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= p[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
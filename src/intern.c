@@ -0,0 +1,69 @@
+/* A string interning table used in the server. */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "intern.h"
+
+/* Stored form of an interned string. The returned pointer is str, and
+   the record is recovered from it when matching. */
+typedef struct {
+	size_t len;
+	char str[];
+} istr_t;
+
+/* A (pointer, length) pair used as a lookup key. */
+typedef struct {
+	const char *str;
+	size_t len;
+} istr_key_t;
+
+/* Matches an interned string against an istr_key_t. */
+static int match_istr(const void *element, const void *key)
+{
+	const istr_t *istr = (const istr_t*)element;
+	const istr_key_t *ikey = (const istr_key_t*)key;
+	return istr->len == ikey->len && memcmp(istr->str, ikey->str, ikey->len) == 0;
+}
+
+/* Initializes the table. */
+void intern_init(intern_t *table)
+{
+	htable_init(&table->strings);
+}
+
+/* Returns the interned copy of the first len bytes of str, adding it to
+   the table if it is not present. Returns a null pointer if memory could
+   not be allocated. */
+const char * intern(intern_t *table, const char *str, size_t len)
+{
+	istr_key_t key = { str, len };
+	uint64_t hash = htable_hash(str, len, HTABLE_SEED);
+	istr_t *istr = (istr_t*)htable_find(&table->strings, hash, match_istr, &key);
+	if (istr)
+		return istr->str;
+
+	istr = (istr_t*)malloc(sizeof(istr_t) + len + 1);
+	if (!istr)
+		return (const char*)0;
+	istr->len = len;
+	memcpy(istr->str, str, len);
+	istr->str[len] = '\0';
+
+	if (htable_insert(&table->strings, hash, istr) < 0) {
+		free(istr);
+		return (const char*)0;
+	}
+
+	return istr->str;
+}
+
+/* Returns the interned copy of the first len bytes of str, or a null
+   pointer if the string has never been interned. */
+const char * intern_lookup(intern_t *table, const char *str, size_t len)
+{
+	istr_key_t key = { str, len };
+	uint64_t hash = htable_hash(str, len, HTABLE_SEED);
+	istr_t *istr = (istr_t*)htable_find(&table->strings, hash, match_istr, &key);
+	return istr ? istr->str : (const char*)0;
+}
@@ -0,0 +1,276 @@
+/* Pluggable disk I/O backends used in the server. */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#include "io.h"
+
+/* Performs a request with a blocking syscall. */
+static void io_perform(io_request_t *request)
+{
+	ssize_t n;
+	do {
+		if (request->write)
+			n = pwrite(request->fd, request->buf, request->len, request->offset);
+		else
+			n = pread(request->fd, request->buf, request->len, request->offset);
+	} while (n < 0 && errno == EINTR);
+	request->result = n < 0 ? -errno : n;
+}
+
+static int io_sync_init(unsigned depth, io_done_t done, int *event_fd)
+{
+	*event_fd = -1;
+	return 0;
+}
+
+static int io_sync_submit(io_request_t *request)
+{
+	io_perform(request);
+	return 1;
+}
+
+static void io_sync_reap(void)
+{
+}
+
+static void io_sync_wait(io_request_t *request)
+{
+}
+
+const io_backend_t io_sync_backend = {
+	"sync", io_sync_init, io_sync_submit, io_sync_reap, io_sync_wait
+};
+
+/* The io_uring backend talks to the kernel through the raw syscalls and
+   the rings it maps, so it needs no library. Each thread has its own
+   ring. Every request is submitted as soon as it is queued, because the
+   kernel takes its own reference to the file then, so the descriptor
+   cache may close the descriptor while the request is in flight. A
+   registered eventfd signals completions to the thread's poll loop.
+   held lists the requests wait() saw complete besides its own; the
+   eventfd was signalled for them, so reap() runs soon. */
+typedef struct {
+	int fd;
+	int event_fd;
+	io_done_t done;
+	unsigned inflight;
+	unsigned depth;
+	io_request_t *held;
+
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+} io_ring_t;
+
+static __thread io_ring_t ring = { -1, -1 };
+
+/* Unmaps and closes whatever part of the ring was set up. */
+static void io_uring_teardown(void)
+{
+	if (ring.sqes)
+		munmap(ring.sqes, ring.sqes_size);
+	if (ring.cq_map && ring.cq_map != ring.sq_map)
+		munmap(ring.cq_map, ring.cq_map_size);
+	if (ring.sq_map)
+		munmap(ring.sq_map, ring.sq_map_size);
+	if (ring.event_fd >= 0)
+		close(ring.event_fd);
+	if (ring.fd >= 0)
+		close(ring.fd);
+	memset(&ring, 0, sizeof(ring));
+	ring.fd = ring.event_fd = -1;
+}
+
+static int io_uring_init(unsigned depth, io_done_t done, int *event_fd)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring.fd = (int)syscall(__NR_io_uring_setup, depth, &params);
+	if (ring.fd < 0)
+		return -1;
+
+	ring.sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_map_size > ring.sq_map_size)
+			ring.sq_map_size = ring.cq_map_size;
+		ring.cq_map_size = ring.sq_map_size;
+	}
+
+	ring.sq_map = mmap((void*)0, ring.sq_map_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_map == MAP_FAILED) {
+		ring.sq_map = (void*)0;
+		io_uring_teardown();
+		return -1;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring.cq_map = ring.sq_map;
+	} else {
+		ring.cq_map = mmap((void*)0, ring.cq_map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (ring.cq_map == MAP_FAILED) {
+			ring.cq_map = (void*)0;
+			io_uring_teardown();
+			return -1;
+		}
+	}
+	ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = (struct io_uring_sqe*)mmap((void*)0, ring.sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		ring.sqes = (struct io_uring_sqe*)0;
+		io_uring_teardown();
+		return -1;
+	}
+
+	char *sq = (char*)ring.sq_map;
+	char *cq = (char*)ring.cq_map;
+	ring.sq_head = (unsigned*)(sq + params.sq_off.head);
+	ring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	ring.sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned*)(sq + params.sq_off.array);
+	ring.cq_head = (unsigned*)(cq + params.cq_off.head);
+	ring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	ring.cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	ring.event_fd = eventfd(0, EFD_NONBLOCK);
+	if (ring.event_fd < 0 ||
+		syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_EVENTFD, &ring.event_fd, 1) < 0) {
+		io_uring_teardown();
+		return -1;
+	}
+
+	/* Keeping no more requests in flight than the submission queue holds
+	   also keeps the completion queue, which is at least as large, from
+	   overflowing. */
+	ring.depth = params.sq_entries;
+	ring.done = done;
+	*event_fd = ring.event_fd;
+	return 0;
+}
+
+static int io_uring_submit(io_request_t *request)
+{
+	if (ring.inflight >= ring.depth) {
+		io_perform(request);
+		return 1;
+	}
+
+	unsigned tail = *ring.sq_tail;
+	unsigned index = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = request->fd;
+	sqe->addr = (uint64_t)(uintptr_t)request->buf;
+	sqe->len = (uint32_t)request->len;
+	sqe->off = (uint64_t)request->offset;
+	sqe->user_data = (uint64_t)(uintptr_t)request;
+	ring.sq_array[index] = index;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	int submitted;
+	do {
+		submitted = (int)syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, (void*)0, 0);
+	} while (submitted < 0 && errno == EINTR);
+	if (submitted != 1) {
+		/* The kernel did not take the entry, so take it back. */
+		__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+		io_perform(request);
+		return 1;
+	}
+
+	ring.inflight = ring.inflight + 1;
+	return 0;
+}
+
+/* Takes the next completion off the completion queue, or returns a null
+   pointer if there is none. */
+static io_request_t *io_uring_next(void)
+{
+	unsigned head = *ring.cq_head;
+	if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+		return (io_request_t*)0;
+
+	struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+	io_request_t *request = (io_request_t*)(uintptr_t)cqe->user_data;
+	request->result = cqe->res;
+	__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+	ring.inflight = ring.inflight - 1;
+	return request;
+}
+
+static void io_uring_reap(void)
+{
+	uint64_t count;
+	if (read(ring.event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return;
+
+	while (ring.held) {
+		io_request_t *request = ring.held;
+		ring.held = request->next;
+		ring.done(request);
+	}
+
+	io_request_t *request;
+	while ((request = io_uring_next()))
+		ring.done(request);
+}
+
+static void io_uring_wait(io_request_t *request)
+{
+	for (io_request_t **link = &ring.held; *link; link = &(*link)->next) {
+		if (*link == request) {
+			*link = request->next;
+			return;
+		}
+	}
+
+	for (;;) {
+		io_request_t *done = io_uring_next();
+		if (done == request)
+			return;
+		if (done) {
+			done->next = ring.held;
+			ring.held = done;
+			continue;
+		}
+		/* A wait cut short by a signal just goes around again. */
+		syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, (void*)0, 0);
+	}
+}
+
+const io_backend_t io_uring_backend = {
+	"uring", io_uring_init, io_uring_submit, io_uring_reap, io_uring_wait
+};
+
+/* Returns the backend with the given name, or a null pointer. */
+const io_backend_t *io_backend_named(const char *name)
+{
+	if (strcmp(name, io_sync_backend.name) == 0)
+		return &io_sync_backend;
+	if (strcmp(name, io_uring_backend.name) == 0)
+		return &io_uring_backend;
+	return (const io_backend_t*)0;
+}
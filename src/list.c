@@ -24,29 +24,17 @@ void * list_at(list_t *list, size_t index)
    -1 if unsuccessful. */
 int list_append(list_t *list, void *element)
 {
-	if (list->capacity == 0) {
-		void **p = (void**)malloc(sizeof(void*) * 4);
+	if (list->size == list->capacity) {
+		size_t capacity = list->capacity ? list->capacity * 2 : 4;
+		void **p = (void**)realloc(list->elements, sizeof(void*) * capacity);
 		if (!p)
 			return -1;
 		list->elements = p;
-		list->capacity = 4;
-		list->elements[0] = element;
-		list->size = 1;
-	} else if (list->size == list->capacity) {
-		void **p = (void**)malloc(sizeof(void*) * list->capacity * 2);
-		if (!p)
-			return -1;
-		memcpy(p, list->elements, sizeof(void*) * list->size);
-		free(list->elements);
-		list->elements = p;
-		list->capacity = list->capacity * 2;
-		list->elements[list->size] = element;
-		list->size = list->size + 1;
-	} else {
-		list->elements[list->size] = element;
-		list->size = list->size + 1;
+		list->capacity = capacity;
 	}
 
+	list->elements[list->size] = element;
+	list->size = list->size + 1;
 	return 0;
 }
 
@@ -61,4 +49,20 @@ void * list_remove(list_t *list, size_t index)
 		sizeof(void*) * (list->size - index - 1));
 	list->size = list->size - 1;
 	return element;
-}
\ No newline at end of file
+}
+
+/* Inserts the given pointer at the given index, shifting the following
+   elements back by one. Returns 0 if successful, -1 if unsuccessful. */
+int list_insert(list_t *list, size_t index, void *element)
+{
+	if (index > list->size)
+		return -1;
+
+	/* Grow the list by one, then open a gap at index. */
+	if (list_append(list, element) < 0)
+		return -1;
+	memmove(list->elements + index + 1, list->elements + index,
+		sizeof(void*) * (list->size - index - 1));
+	list->elements[index] = element;
+	return 0;
+}
@@ -0,0 +1,790 @@
+/* Primary source file for the load generator. */
+
+/* For epoll_pwait2(). */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+
+#include "loadgen.h"
+#include "htable.h"
+
+#define LG_MAX_THREADS 64
+#define LG_EPOLL_EVENTS 256
+
+static const char *op_names[LG_OPS] = { "open", "close", "read", "write", "lseek", "other" };
+
+/* Settings shared by every worker. */
+static struct sockaddr_in server_address;
+static int nthreads = 1;
+static int nidentities = 64;
+static double rate = 0;
+static double duration = 5;
+static uint64_t timeout_ns = 250000000ULL;
+static size_t io_size = 16;
+static unsigned mix[LG_OPS];
+static unsigned mix_total;
+
+static lg_identity_t *identities;
+static lg_record_t *records;
+static size_t nrecords;
+static htable_t identity_table;
+
+/* An identity waiting for the time of its next record. */
+typedef struct {
+	uint64_t due;
+	int identity;
+} lg_due_t;
+
+/* State of one worker thread. */
+typedef struct {
+	int index;
+	int *owned; /* Indices of the identities this worker drives */
+	int nowned;
+	int *idle; /* Stack of owned identities with nothing in flight */
+	int nidle;
+	int nbusy;
+	lg_due_t *waiting; /* Min-heap of idle identities by when they replay next */
+	int nwaiting;
+	uint64_t rng;
+	lg_results_t results;
+} lg_worker_t;
+
+/* Returns a monotonic timestamp in nanoseconds. */
+static uint64_t now_ns(void)
+{
+	return stats_now();
+}
+
+/* Returns the next pseudo-random number of a worker (xorshift64). */
+static uint64_t next_random(lg_worker_t *worker)
+{
+	uint64_t x = worker->rng;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	worker->rng = x;
+	return x;
+}
+
+/* Classifies an operation string by its command. */
+static lg_op_t classify(const char *operation)
+{
+	for (int op = 0; op < LG_OTHER; ++op) {
+		size_t len = strlen(op_names[op]);
+		if (strncmp(operation, op_names[op], len) == 0 &&
+			(operation[len] == ' ' || operation[len] == '\0'))
+			return (lg_op_t)op;
+	}
+	return LG_OTHER;
+}
+
+/* Parses an op mix such as "read=70,write=20,lseek=5,close=5". Returns
+   0 if successful, -1 if it is malformed. */
+static int parse_mix(const char *spec)
+{
+	memset(mix, 0, sizeof(mix));
+	mix_total = 0;
+
+	char *copy = strdup(spec);
+	char *save;
+	for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r((char*)0, ",", &save)) {
+		char *eq = strchr(item, '=');
+		if (!eq) {
+			free(copy);
+			return -1;
+		}
+		*eq = '\0';
+		lg_op_t op = classify(item);
+		if (op != LG_CLOSE && op != LG_READ && op != LG_WRITE && op != LG_LSEEK) {
+			free(copy);
+			return -1;
+		}
+		mix[op] = (unsigned)atoi(eq + 1);
+		mix_total += mix[op];
+	}
+
+	free(copy);
+	return mix_total > 0 ? 0 : -1;
+}
+
+/* Key used to look up an identity while loading a replay file. */
+typedef struct {
+	const char *machine;
+	int32_t client;
+} identity_key_t;
+
+static int match_identity(const void *element, const void *key)
+{
+	const lg_identity_t *identity = &identities[(intptr_t)element - 1];
+	const identity_key_t *ikey = (const identity_key_t*)key;
+	return identity->client == ikey->client && strcmp(identity->machine, ikey->machine) == 0;
+}
+
+static uint64_t hash_identity(const char *machine, int32_t client)
+{
+	uint64_t hash = htable_hash(machine, strlen(machine), HTABLE_SEED);
+	return htable_hash(&client, sizeof(client), hash);
+}
+
+/* Finds the value of a field in a flat JSON object. Strings are
+   unescaped into value. Returns 0 if found, -1 if not. */
+static int json_field(const char *line, const char *name, char *value, size_t capacity)
+{
+	char pattern[32];
+	snprintf(pattern, sizeof(pattern), "\"%s\"", name);
+
+	const char *p = strstr(line, pattern);
+	if (!p)
+		return -1;
+	p += strlen(pattern);
+	while (*p == ' ' || *p == '\t')
+		++p;
+	if (*p++ != ':')
+		return -1;
+	while (*p == ' ' || *p == '\t')
+		++p;
+
+	size_t n = 0;
+	if (*p == '"') {
+		for (++p; *p && *p != '"'; ++p) {
+			char c = *p;
+			if (c == '\\' && p[1]) {
+				++p;
+				c = *p == 'n' ? '\n' : *p == 't' ? '\t' : *p;
+			}
+			if (n + 1 < capacity)
+				value[n++] = c;
+		}
+		if (*p != '"')
+			return -1;
+	} else {
+		while (*p && *p != ',' && *p != '}' && *p != ' ' && n + 1 < capacity)
+			value[n++] = *p++;
+	}
+	value[n] = '\0';
+	return 0;
+}
+
+/* Adds an identity to a worker's heap of those waiting to replay. */
+static void push_waiting(lg_worker_t *worker, uint64_t due, int identity)
+{
+	int i = worker->nwaiting++;
+	while (i > 0 && worker->waiting[(i - 1) / 2].due > due) {
+		worker->waiting[i] = worker->waiting[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	worker->waiting[i].due = due;
+	worker->waiting[i].identity = identity;
+}
+
+/* Removes the identity due first from a worker's heap and returns it. */
+static lg_due_t pop_waiting(lg_worker_t *worker)
+{
+	lg_due_t top = worker->waiting[0];
+	lg_due_t last = worker->waiting[--worker->nwaiting];
+	int i = 0;
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= worker->nwaiting)
+			break;
+		if (child + 1 < worker->nwaiting && worker->waiting[child + 1].due < worker->waiting[child].due)
+			child = child + 1;
+		if (worker->waiting[child].due >= last.due)
+			break;
+		worker->waiting[i] = worker->waiting[child];
+		i = child;
+	}
+	worker->waiting[i] = last;
+	return top;
+}
+
+/* Loads a JSONL request stream, one object per line with the fields
+   "machine", "client" and "op", and optionally "request", "incarnation"
+   and "at_us". Every distinct (machine, client) pair becomes an identity,
+   whose records are chained in order. */
+static void load_replay(const char *path)
+{
+	FILE *in = fopen(path, "r");
+	if (!in)
+		fail_with_error("fopen() failed");
+
+	size_t record_capacity = 1024, identity_capacity = 64;
+	records = (lg_record_t*)malloc(record_capacity * sizeof(lg_record_t));
+	identities = (lg_identity_t*)calloc(identity_capacity, sizeof(lg_identity_t));
+	int *last = (int*)malloc(identity_capacity * sizeof(int));
+	if (!records || !identities || !last)
+		fail_with_error("malloc() failed");
+	htable_init(&identity_table);
+	nidentities = 0;
+
+	char line[1024], machine[24], field[96];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), in)) {
+		++lineno;
+		if (line[strspn(line, " \t\r\n")] == '\0')
+			continue;
+
+		if (json_field(line, "machine", machine, sizeof(machine)) < 0 ||
+			json_field(line, "client", field, sizeof(field)) < 0) {
+			fprintf(stderr, "%s:%d: missing machine or client\n", path, lineno);
+			exit(1);
+		}
+		int32_t client = atoi(field);
+
+		if (nrecords == record_capacity) {
+			record_capacity *= 2;
+			records = (lg_record_t*)realloc(records, record_capacity * sizeof(lg_record_t));
+			if (!records)
+				fail_with_error("realloc() failed");
+		}
+		lg_record_t *record = &records[nrecords];
+		memset(record, 0, sizeof(lg_record_t));
+		if (json_field(line, "op", record->operation, sizeof(record->operation)) < 0) {
+			fprintf(stderr, "%s:%d: missing op\n", path, lineno);
+			exit(1);
+		}
+		record->request = json_field(line, "request", field, sizeof(field)) == 0 ? atoi(field) : 0;
+		record->incarnation = json_field(line, "incarnation", field, sizeof(field)) == 0 ? atoi(field) : 0;
+		record->at_us = json_field(line, "at_us", field, sizeof(field)) == 0 ? atoll(field) : -1;
+		record->next = -1;
+
+		/* Identities are stored in the table as index + 1 so that none
+		is a null pointer. */
+		identity_key_t key = { machine, client };
+		uint64_t hash = hash_identity(machine, client);
+		intptr_t found = (intptr_t)htable_find(&identity_table, hash, match_identity, &key);
+		if (!found) {
+			if ((size_t)nidentities == identity_capacity) {
+				identity_capacity *= 2;
+				identities = (lg_identity_t*)realloc(identities, identity_capacity * sizeof(lg_identity_t));
+				last = (int*)realloc(last, identity_capacity * sizeof(int));
+				if (!identities || !last)
+					fail_with_error("realloc() failed");
+			}
+			lg_identity_t *identity = &identities[nidentities];
+			memset(identity, 0, sizeof(lg_identity_t));
+			strcpy(identity->machine, machine);
+			identity->client = client;
+			identity->next_record = -1;
+			last[nidentities] = -1;
+			nidentities = nidentities + 1;
+			found = nidentities;
+			if (htable_insert(&identity_table, hash, (void*)found) < 0)
+				fail_with_error("htable_insert() failed");
+		}
+		record->identity = (int)found - 1;
+		if (last[record->identity] < 0)
+			identities[record->identity].next_record = (int)nrecords;
+		else
+			records[last[record->identity]].next = (int)nrecords;
+		last[record->identity] = (int)nrecords;
+		nrecords = nrecords + 1;
+	}
+
+	free(last);
+	fclose(in);
+}
+
+/* Creates the synthetic identities. Each gets its own machine, so they
+   spread over every server worker, and machine names carry the process
+   ID so a new run never collides with the request numbers of an old one. */
+static void make_identities(void)
+{
+	identities = (lg_identity_t*)calloc(nidentities, sizeof(lg_identity_t));
+	if (!identities)
+		fail_with_error("calloc() failed");
+
+	for (int i = 0; i < nidentities; ++i) {
+		snprintf(identities[i].machine, sizeof(identities[i].machine), "lg%d.%d", (int)getpid(), i);
+		identities[i].client = 1;
+	}
+}
+
+/* Sends (or resends) the pending request of an identity. */
+static void transmit(lg_worker_t *worker, lg_identity_t *identity, uint64_t now)
+{
+	ssize_t sent = send(identity->sock, identity->pending, identity->pending_size, 0);
+	if (sent != (ssize_t)identity->pending_size && errno != EAGAIN && errno != ENOBUFS &&
+		errno != ECONNREFUSED)
+		fail_with_error("send() failed");
+	identity->sent = now;
+}
+
+/* Returns the next whitespace-separated token at *p and its length,
+   advancing *p past it. Returns a null pointer at the end. */
+static const char *next_token(const char **p, size_t *len)
+{
+	while (**p == ' ')
+		++*p;
+	if (**p == '\0')
+		return (const char*)0;
+	const char *token = *p;
+	while (**p && **p != ' ')
+		++*p;
+	*len = (size_t)(*p - token);
+	return token;
+}
+
+/* Returns whether a token is the given word. */
+static int token_is(const char *token, size_t len, const char *word)
+{
+	return token && strlen(word) == len && strncmp(token, word, len) == 0;
+}
+
+/* Encodes a text operation as the identity's pending binary request,
+   with the same grammar the server reads text requests with. An unknown
+   command is sent as OP_INVALID, which the server answers with EINVAL. */
+static void encode(lg_identity_t *identity, const char *operation)
+{
+	static const char *commands[] = { "", "open", "close", "read", "write", "lseek", "", "",
+		"renew", "", "lock", "unlock" };
+	bin_request_t request;
+	memset(&request, 0, sizeof(request));
+	request.magic = BIN_REQUEST_MAGIC;
+	request.version = BIN_REQUEST_VERSION;
+	strcpy(request.machine, identity->machine);
+	request.client = identity->client;
+	request.request = identity->request;
+	request.incarnation = identity->incarnation;
+
+	const char *p = operation;
+	size_t len = 0;
+	const char *command = next_token(&p, &len);
+	for (int op = OP_OPEN; op <= OP_UNLOCK; ++op)
+		if (command && commands[op][0] && token_is(command, len, commands[op]))
+			request.opcode = (uint8_t)op;
+
+	size_t name_len = 0;
+	const char *name = next_token(&p, &name_len);
+	const char *data = "";
+	const char *arg;
+	switch (request.opcode) {
+	case OP_OPEN:
+		arg = next_token(&p, &len);
+		request.mode = token_is(arg, len, "read") ? 1 : token_is(arg, len, "write") ? 2 :
+			token_is(arg, len, "readwrite") ? 3 : 0;
+		arg = next_token(&p, &len);
+		if (token_is(arg, len, "ranges")) {
+			request.mode |= BIN_MODE_RANGES;
+			arg = next_token(&p, &len);
+		}
+		if (token_is(arg, len, "wait"))
+			request.flags = BIN_FLAG_WAIT;
+		break;
+	case OP_LOCK:
+		arg = next_token(&p, &len);
+		request.mode = token_is(arg, len, "read") ? 1 : token_is(arg, len, "write") ? 2 : 0;
+		/* Fall through to the range. */
+	case OP_UNLOCK:
+		arg = next_token(&p, &len);
+		request.offset = arg ? strtoll(arg, (char**)0, 10) : 0;
+		arg = next_token(&p, &len);
+		request.length = arg ? (uint32_t)strtoul(arg, (char**)0, 10) : 0;
+		break;
+	case OP_READ:
+		arg = next_token(&p, &len);
+		request.length = arg ? (uint32_t)strtoul(arg, (char**)0, 10) : 0;
+		break;
+	case OP_LSEEK:
+		arg = next_token(&p, &len);
+		request.offset = arg ? strtoll(arg, (char**)0, 10) : 0;
+		break;
+	case OP_WRITE:
+		/* The data is everything after the space following the name. */
+		while (*p == ' ')
+			++p;
+		data = p;
+		request.length = (uint32_t)strlen(p);
+		break;
+	default:
+		break;
+	}
+
+	request.name_len = (uint16_t)name_len;
+	size_t data_len = request.opcode == OP_WRITE ? request.length : 0;
+	memcpy(identity->pending, &request, sizeof(request));
+	if (name_len)
+		memcpy(identity->pending + sizeof(request), name, name_len);
+	memcpy(identity->pending + sizeof(request) + name_len, data, data_len);
+	identity->pending_size = sizeof(request) + name_len + data_len;
+}
+
+/* Starts a request on an idle identity. intended is when it should have
+   been sent, which latency is measured from. */
+static void start(lg_worker_t *worker, lg_identity_t *identity, const char *operation,
+	int32_t request, int32_t incarnation, uint64_t intended, uint64_t now)
+{
+	identity->request = request ? request : identity->request + 1;
+	identity->incarnation = incarnation;
+	identity->op = classify(operation);
+	identity->intended = intended;
+	identity->busy = 1;
+	worker->nbusy = worker->nbusy + 1;
+
+	encode(identity, operation);
+	transmit(worker, identity, now);
+}
+
+/* Picks the next synthetic operation of an identity from the op mix. An
+   identity whose file is closed always opens it first. */
+static void next_operation(lg_worker_t *worker, lg_identity_t *identity, char *operation, size_t capacity)
+{
+	static const char payload[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	int client = identity->client;
+
+	if (!identity->file_open) {
+		snprintf(operation, capacity, "open f%d readwrite", client);
+		return;
+	}
+
+	unsigned pick = (unsigned)(next_random(worker) % mix_total);
+	lg_op_t op = LG_CLOSE;
+	for (int i = 0; i < LG_OPS; ++i) {
+		if (pick < mix[i]) {
+			op = (lg_op_t)i;
+			break;
+		}
+		pick -= mix[i];
+	}
+
+	switch (op) {
+	case LG_READ:
+		snprintf(operation, capacity, "read f%d %zu", client, io_size);
+		break;
+	case LG_WRITE:
+		snprintf(operation, capacity, "write f%d %.*s", client, (int)io_size, payload);
+		break;
+	case LG_LSEEK:
+		snprintf(operation, capacity, "lseek f%d 0", client);
+		break;
+	default:
+		snprintf(operation, capacity, "close f%d", client);
+	}
+}
+
+/* Records the reply to an identity's request in flight. */
+static void complete(lg_worker_t *worker, lg_identity_t *identity, const bin_response_t *response, uint64_t now)
+{
+	lg_results_t *results = &worker->results;
+	lg_op_t op = identity->op;
+
+	results->completed[op] = results->completed[op] + 1;
+	if (response->status != 0)
+		results->errors[op] = results->errors[op] + 1;
+	hist_record(&results->latency[op], now - identity->intended);
+
+	if (op == LG_OPEN && response->status == 0)
+		identity->file_open = 1;
+	else if (op == LG_CLOSE || (op == LG_OPEN && response->status != 0))
+		identity->file_open = 0;
+
+	identity->busy = 0;
+	worker->nbusy = worker->nbusy - 1;
+	worker->idle[worker->nidle++] = (int)(identity - identities);
+}
+
+/* Issues whatever requests are due, and returns how many nanoseconds
+   until more are. Returns UINT64_MAX if nothing more is scheduled. */
+static uint64_t issue(lg_worker_t *worker, uint64_t now, uint64_t begin, uint64_t *next_send, uint64_t interval)
+{
+	char operation[80];
+
+	if (records) {
+		/* Replay each identity's records in order. A record waits for
+		its identity's previous request and for its time, but not for
+		other identities, so one slow identity holds up no other. */
+		while (worker->nidle > 0) {
+			int index = worker->idle[--worker->nidle];
+			int next = identities[index].next_record;
+			if (next >= 0)
+				push_waiting(worker, records[next].at_us < 0 ? now :
+					begin + (uint64_t)records[next].at_us * 1000, index);
+		}
+		while (worker->nwaiting > 0 && worker->waiting[0].due <= now) {
+			lg_due_t due = pop_waiting(worker);
+			lg_identity_t *identity = &identities[due.identity];
+			lg_record_t *record = &records[identity->next_record];
+			identity->next_record = record->next;
+			start(worker, identity, record->operation, record->request, record->incarnation, due.due, now);
+		}
+		return worker->nwaiting > 0 ? worker->waiting[0].due - now : UINT64_MAX;
+	}
+
+	if (interval == 0) {
+		/* Closed loop: every identity always has a request in flight. */
+		while (worker->nidle > 0) {
+			lg_identity_t *identity = &identities[worker->idle[--worker->nidle]];
+			next_operation(worker, identity, operation, sizeof(operation));
+			start(worker, identity, operation, 0, 0, now, now);
+		}
+		return UINT64_MAX;
+	}
+
+	/* Open loop: send on schedule. When every identity is busy, the
+	schedule falls behind and the late requests are charged the delay,
+	so a slow server cannot hide its queueing from the percentiles. */
+	while (*next_send <= now && worker->nidle > 0) {
+		lg_identity_t *identity = &identities[worker->idle[--worker->nidle]];
+		next_operation(worker, identity, operation, sizeof(operation));
+		start(worker, identity, operation, 0, 0, *next_send, now);
+		*next_send += interval;
+	}
+	return *next_send > now ? *next_send - now : timeout_ns;
+}
+
+/* Drives one worker's identities until the run ends. */
+static void *run_worker(void *arg)
+{
+	lg_worker_t *worker = (lg_worker_t*)arg;
+	int epfd = epoll_create1(0);
+	if (epfd < 0)
+		fail_with_error("epoll_create1() failed");
+
+	for (int i = 0; i < worker->nowned; ++i) {
+		lg_identity_t *identity = &identities[worker->owned[i]];
+		if ((identity->sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+			fail_with_error("socket() failed");
+		if (connect(identity->sock, (struct sockaddr*)&server_address, sizeof(server_address)) < 0)
+			fail_with_error("connect() failed");
+		fcntl(identity->sock, F_SETFL, fcntl(identity->sock, F_GETFL) | O_NONBLOCK);
+
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.u32 = (uint32_t)worker->owned[i];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, identity->sock, &event) < 0)
+			fail_with_error("epoll_ctl() failed");
+	}
+
+	uint64_t begin = now_ns();
+	uint64_t end = begin + (uint64_t)(duration * 1e9);
+	uint64_t interval = rate > 0 ? (uint64_t)(1e9 * nthreads / rate) : 0;
+	uint64_t next_send = begin;
+	uint64_t last_scan = begin;
+	struct epoll_event events[LG_EPOLL_EVENTS];
+	union {
+		bin_response_t response;
+		char bytes[sizeof(bin_response_t) + 64];
+	} reply;
+
+	for (;;) {
+		uint64_t now = now_ns();
+		char sending = now < end;
+		uint64_t wait = sending ? issue(worker, now, begin, &next_send, interval) : UINT64_MAX;
+
+		/* Stop once the run is over (or the replay is done) and every
+		request in flight has been answered or given up on. */
+		if (worker->nbusy == 0 && (!sending || (records && wait == UINT64_MAX)))
+			break;
+		if (!sending && now >= end + 4 * timeout_ns)
+			break;
+
+		if (wait > timeout_ns)
+			wait = timeout_ns;
+		struct timespec timeout = { (time_t)(wait / 1000000000), (long)(wait % 1000000000) };
+		int n = epoll_pwait2(epfd, events, LG_EPOLL_EVENTS, &timeout, (const sigset_t*)0);
+		if (n < 0 && errno != EINTR)
+			fail_with_error("epoll_pwait2() failed");
+
+		now = now_ns();
+		for (int i = 0; i < n; ++i) {
+			lg_identity_t *identity = &identities[events[i].data.u32];
+			ssize_t size;
+			while ((size = recv(identity->sock, &reply, sizeof(reply), 0)) >= 0) {
+				/* A late reply to a retransmitted request is a duplicate,
+				and one to an earlier request is stale. Reads longer
+				than the buffer are cut short, which leaves the header. */
+				if (identity->busy && (size_t)size >= sizeof(bin_response_t) &&
+					reply.response.magic == BIN_REQUEST_MAGIC &&
+					reply.response.request == identity->request)
+					complete(worker, identity, &reply.response, now);
+			}
+		}
+
+		/* Resend requests whose replies are overdue. */
+		if (now - last_scan >= timeout_ns / 4) {
+			last_scan = now;
+			for (int i = 0; i < worker->nowned; ++i) {
+				lg_identity_t *identity = &identities[worker->owned[i]];
+				if (identity->busy && now - identity->sent >= timeout_ns) {
+					worker->results.retransmits[identity->op] = worker->results.retransmits[identity->op] + 1;
+					transmit(worker, identity, now);
+				}
+			}
+		}
+	}
+
+	close(epfd);
+	return (void*)0;
+}
+
+/* Displays the command line usage and exits the process. */
+static void print_usage(const char *program)
+{
+	fprintf(stderr, "Usage: %s [--threads N] [--concurrency N | --rate OPS [--clients N]]\n"
+		"       [--duration SEC] [--mix read=70,write=20,lseek=5,close=5] [--size BYTES]\n"
+		"       [--timeout-ms MS] [--replay FILE.jsonl] SERVER_IP PORT\n", program);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option long_options[] = {
+		{ "threads", required_argument, 0, 't' },
+		{ "concurrency", required_argument, 0, 'c' },
+		{ "clients", required_argument, 0, 'n' },
+		{ "rate", required_argument, 0, 'r' },
+		{ "duration", required_argument, 0, 'd' },
+		{ "mix", required_argument, 0, 'm' },
+		{ "size", required_argument, 0, 's' },
+		{ "timeout-ms", required_argument, 0, 'o' },
+		{ "replay", required_argument, 0, 'p' },
+		{ 0, 0, 0, 0 }
+	};
+
+	const char *replay = (const char*)0;
+	parse_mix("read=70,write=20,lseek=5,close=5");
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_options, 0)) != -1) {
+		switch (opt) {
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > LG_MAX_THREADS)
+				print_usage(argv[0]);
+			break;
+		case 'c':
+		case 'n':
+			nidentities = atoi(optarg);
+			if (nidentities < 1)
+				print_usage(argv[0]);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'm':
+			if (parse_mix(optarg) < 0)
+				print_usage(argv[0]);
+			break;
+		case 's':
+			io_size = (size_t)atol(optarg);
+			if (io_size < 1 || io_size > 60)
+				print_usage(argv[0]);
+			break;
+		case 'o':
+			timeout_ns = (uint64_t)atol(optarg) * 1000000ULL;
+			if (timeout_ns == 0)
+				print_usage(argv[0]);
+			break;
+		case 'p':
+			replay = optarg;
+			break;
+		default:
+			print_usage(argv[0]);
+		}
+	}
+
+	if (argc - optind != 2)
+		print_usage(argv[0]);
+
+	memset(&server_address, 0, sizeof(server_address));
+	server_address.sin_family = AF_INET;
+	server_address.sin_addr.s_addr = inet_addr(argv[optind]);
+	server_address.sin_port = htons(atoi(argv[optind + 1]));
+
+	if (replay)
+		load_replay(replay);
+	else
+		make_identities();
+	if (nthreads > nidentities)
+		nthreads = nidentities;
+
+	/* Deal the identities out to the workers. */
+	lg_worker_t *workers = (lg_worker_t*)calloc(nthreads, sizeof(lg_worker_t));
+	pthread_t *threads = (pthread_t*)calloc(nthreads, sizeof(pthread_t));
+	if (!workers || !threads)
+		fail_with_error("calloc() failed");
+	for (int t = 0; t < nthreads; ++t) {
+		lg_worker_t *worker = &workers[t];
+		worker->index = t;
+		worker->rng = 0x9E3779B97F4A7C15ULL * (uint64_t)(t + 1) ^ (uint64_t)getpid();
+		worker->owned = (int*)malloc((nidentities / nthreads + 1) * sizeof(int));
+		worker->idle = (int*)malloc((nidentities / nthreads + 1) * sizeof(int));
+		worker->waiting = (lg_due_t*)malloc((nidentities / nthreads + 1) * sizeof(lg_due_t));
+		if (!worker->owned || !worker->idle || !worker->waiting)
+			fail_with_error("malloc() failed");
+		for (int i = t; i < nidentities; i += nthreads) {
+			worker->owned[worker->nowned++] = i;
+			worker->idle[worker->nidle++] = i;
+		}
+		for (int op = 0; op < LG_OPS; ++op)
+			hist_init(&worker->results.latency[op]);
+	}
+
+	uint64_t begin = now_ns();
+	for (int t = 0; t < nthreads; ++t)
+		if (pthread_create(&threads[t], (const pthread_attr_t*)0, run_worker, &workers[t]) != 0)
+			fail_with_error("pthread_create() failed");
+	for (int t = 0; t < nthreads; ++t)
+		pthread_join(threads[t], (void**)0);
+	double elapsed = (double)(now_ns() - begin) / 1e9;
+
+	/* Merge the workers' results and report them. */
+	lg_results_t *total = (lg_results_t*)calloc(1, sizeof(lg_results_t));
+	histogram_t *all = (histogram_t*)calloc(1, sizeof(histogram_t));
+	if (!total || !all)
+		fail_with_error("calloc() failed");
+	for (int t = 0; t < nthreads; ++t) {
+		for (int op = 0; op < LG_OPS; ++op) {
+			total->completed[op] += workers[t].results.completed[op];
+			total->errors[op] += workers[t].results.errors[op];
+			total->retransmits[op] += workers[t].results.retransmits[op];
+			hist_merge(&total->latency[op], &workers[t].results.latency[op]);
+		}
+	}
+
+	printf("%-6s %10s %8s %8s %12s %10s %10s %10s %10s\n", "op", "count", "errors",
+		"resent", "ops/s", "p50_us", "p99_us", "p999_us", "max_us");
+	uint64_t completed = 0, errors = 0, retransmits = 0;
+	for (int op = 0; op <= LG_OPS; ++op) {
+		const histogram_t *hist = op < LG_OPS ? &total->latency[op] : all;
+		uint64_t count = op < LG_OPS ? total->completed[op] : completed;
+		uint64_t failed = op < LG_OPS ? total->errors[op] : errors;
+		uint64_t resent = op < LG_OPS ? total->retransmits[op] : retransmits;
+		if (op < LG_OPS) {
+			if (count == 0 && resent == 0)
+				continue;
+			completed += count;
+			errors += failed;
+			retransmits += resent;
+			hist_merge(all, hist);
+		}
+		printf("%-6s %10llu %8llu %8llu %12.1f %10.1f %10.1f %10.1f %10.1f\n",
+			op < LG_OPS ? op_names[op] : "total", (unsigned long long)count,
+			(unsigned long long)failed, (unsigned long long)resent, (double)count / elapsed,
+			hist_quantile(hist, 0.5) / 1e3, hist_quantile(hist, 0.99) / 1e3,
+			hist_quantile(hist, 0.999) / 1e3, hist->max / 1e3);
+	}
+
+	return 0;
+}
+
+void fail_with_error(const char* msg)
+{
+	perror(msg);
+	exit(1);
+}
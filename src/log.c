@@ -0,0 +1,220 @@
+/* Leveled, asynchronous logging used in the server. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "log.h"
+
+/* Number of slots in the ring. Must be a power of two. */
+#define LOG_RING_SLOTS 4096
+
+/* Longest message kept; longer messages are truncated. */
+#define LOG_LINE_MAX 240
+
+/* Room a line takes in the flusher's buffer at most: the level name,
+   the message and the newline. */
+#define LOG_OUTPUT_MAX (LOG_LINE_MAX + 16)
+
+/* A slot of the ring. seq tells producers and the consumer whose turn
+   it is: a slot at position pos is free for a producer when
+   seq == pos, and holds a message for the consumer when seq == pos + 1. */
+typedef struct {
+	uint64_t seq;
+	uint16_t len;
+	uint8_t level;
+	char text[LOG_LINE_MAX];
+} log_slot_t;
+
+log_level_t log_level = LOG_LEVEL_WARNING;
+
+static log_slot_t log_ring[LOG_RING_SLOTS];
+static uint64_t log_tail; /* Next position a producer claims */
+static uint64_t log_head; /* Next position the consumer reads */
+static uint64_t log_drops;
+static uint64_t log_drops_reported;
+static pthread_mutex_t log_consumer_lock = PTHREAD_MUTEX_INITIALIZER;
+static char log_ring_ready;
+
+/* The flusher sleeps on log_wakeup while the ring is empty, with
+   log_sleeping set, and a producer that sees it set signals it. */
+static pthread_mutex_t log_wakeup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wakeup = PTHREAD_COND_INITIALIZER;
+static char log_sleeping;
+
+static const char *log_level_names[] = { "ERROR", "WARNING", "INFO", "DEBUG" };
+
+/* Gives every slot its initial sequence number. */
+static void log_ring_init(void)
+{
+	for (uint64_t i = 0; i < LOG_RING_SLOTS; ++i)
+		__atomic_store_n(&log_ring[i].seq, i, __ATOMIC_RELAXED);
+	__atomic_store_n(&log_ring_ready, 1, __ATOMIC_RELEASE);
+}
+
+/* Formats a message into the log ring. Producers claim a slot by
+   advancing log_tail with a compare-and-swap, so any number of threads
+   can log at once without locking. */
+void log_write(log_level_t level, const char *format, ...)
+{
+	if (!__atomic_load_n(&log_ring_ready, __ATOMIC_ACQUIRE)) {
+		__atomic_fetch_add(&log_drops, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	uint64_t pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+	log_slot_t *slot;
+	for (;;) {
+		slot = &log_ring[pos & (LOG_RING_SLOTS - 1)];
+		uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (seq < pos) {
+			/* The consumer has not freed this slot yet: the ring is full. */
+			__atomic_fetch_add(&log_drops, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(slot->text, LOG_LINE_MAX, format, args);
+	va_end(args);
+
+	slot->len = (uint16_t)(len < 0 ? 0 : len >= LOG_LINE_MAX ? LOG_LINE_MAX - 1 : len);
+	slot->level = (uint8_t)level;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with the fence in log_flusher(): either the flusher sees
+	   this message before it sleeps, or this sees it sleeping. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&log_sleeping, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&log_wakeup_lock);
+		pthread_cond_signal(&log_wakeup);
+		pthread_mutex_unlock(&log_wakeup_lock);
+	}
+}
+
+/* Writes the queued messages to standard output. Returns the number of
+   messages written. The caller must hold log_consumer_lock. */
+static size_t log_consume(void)
+{
+	char buffer[8192];
+	size_t used = 0;
+	size_t count = 0;
+
+	for (;;) {
+		log_slot_t *slot = &log_ring[log_head & (LOG_RING_SLOTS - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log_head + 1)
+			break;
+
+		if (used + LOG_OUTPUT_MAX > sizeof(buffer)) {
+			fwrite(buffer, 1, used, stdout);
+			used = 0;
+		}
+		used += (size_t)snprintf(buffer + used, sizeof(buffer) - used, "%s: %.*s\n",
+			log_level_names[slot->level], (int)slot->len, slot->text);
+
+		/* Hand the slot back to producers for the next lap of the ring. */
+		__atomic_store_n(&slot->seq, log_head + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+		log_head = log_head + 1;
+		count = count + 1;
+	}
+
+	uint64_t drops = __atomic_load_n(&log_drops, __ATOMIC_RELAXED);
+	if (drops != log_drops_reported) {
+		if (used + LOG_OUTPUT_MAX > sizeof(buffer)) {
+			fwrite(buffer, 1, used, stdout);
+			used = 0;
+		}
+		used += (size_t)snprintf(buffer + used, sizeof(buffer) - used,
+			"WARNING: %llu log messages dropped\n",
+			(unsigned long long)(drops - log_drops_reported));
+		log_drops_reported = drops;
+	}
+
+	if (used > 0) {
+		fwrite(buffer, 1, used, stdout);
+		fflush(stdout);
+	}
+
+	return count;
+}
+
+/* Writes every queued message from the calling thread. */
+void log_drain(void)
+{
+	pthread_mutex_lock(&log_consumer_lock);
+	log_consume();
+	pthread_mutex_unlock(&log_consumer_lock);
+}
+
+/* Returns whether the flusher has anything to write. */
+static char log_pending(void)
+{
+	log_slot_t *slot = &log_ring[log_head & (LOG_RING_SLOTS - 1)];
+	return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == log_head + 1 ||
+		__atomic_load_n(&log_drops, __ATOMIC_RELAXED) != log_drops_reported;
+}
+
+/* Body of the background thread writing the log. Sleeps until a
+   message is logged whenever the ring is empty. */
+static void *log_flusher(void *arg)
+{
+	for (;;) {
+		pthread_mutex_lock(&log_consumer_lock);
+		log_consume();
+		pthread_mutex_unlock(&log_consumer_lock);
+
+		pthread_mutex_lock(&log_wakeup_lock);
+		__atomic_store_n(&log_sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		while (!log_pending())
+			pthread_cond_wait(&log_wakeup, &log_wakeup_lock);
+		__atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&log_wakeup_lock);
+	}
+
+	return (void*)0;
+}
+
+/* Starts the background thread that writes queued messages. */
+void log_init(log_level_t level)
+{
+	pthread_t thread;
+
+	log_level = level;
+	log_ring_init();
+	if (pthread_create(&thread, (const pthread_attr_t*)0, log_flusher, (void*)0) != 0) {
+		perror("FATAL: pthread_create() failed");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
+
+/* Returns the number of messages dropped because the ring was full. */
+uint64_t log_dropped(void)
+{
+	return __atomic_load_n(&log_drops, __ATOMIC_RELAXED);
+}
+
+/* Parses a level name. Returns 0 if successful, -1 if unknown. */
+int log_parse_level(const char *name, log_level_t *level)
+{
+	for (int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; ++i) {
+		if (strcasecmp(name, log_level_names[i]) == 0) {
+			*level = (log_level_t)i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
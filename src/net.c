@@ -0,0 +1,476 @@
+/* The datagram receive and send loop used in the server. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+
+#include "net.h"
+
+#ifndef SO_REUSEPORT
+#define SO_REUSEPORT 15
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+/* A datagram handed from the worker that received it to the worker that
+   owns it. */
+typedef struct net_handoff {
+	struct net_handoff *next;
+	struct sockaddr_in from;
+	size_t size;
+	char message[];
+} net_handoff_t;
+
+/* State owned by one worker. Only the mailbox fields are touched by
+   other threads, and only under lock. */
+typedef struct {
+	int index;
+	int sock;
+	int wake_fd;
+	int watch_fd;
+	void (*watch_ready)(void);
+	pthread_t thread;
+
+	pthread_mutex_t lock;
+	net_handoff_t *mailbox_head;
+	net_handoff_t *mailbox_tail;
+
+	/* Receive slots. */
+	struct mmsghdr *in;
+	struct iovec *in_iov;
+	struct sockaddr_in *in_addrs;
+	char *messages;
+
+	/* Replies queued since the last flush. */
+	int out_slots;
+	struct mmsghdr *out;
+	struct iovec *out_iov;
+	struct sockaddr_in *out_addrs;
+	char *replies;
+	int nout;
+} net_worker_t;
+
+static const net_options_t *net_options;
+static net_handler_t net_handler;
+static void (*net_init)(void);
+static net_worker_t *workers;
+static __thread net_worker_t *current_worker;
+
+/* Makes the calling worker poll fd along with its socket. */
+void net_watch(int fd, void (*ready)(void))
+{
+	current_worker->watch_fd = fd;
+	current_worker->watch_ready = ready;
+}
+
+/* Returns the index of the calling worker. */
+int net_worker_index(void)
+{
+	return current_worker ? current_worker->index : 0;
+}
+
+/* Returns the index of the worker that owns a shard key. The hash is
+   h = h * 31 + byte over the bytes before the first NUL, computed with
+   32-bit wraparound so the kernel steering program can reproduce it. */
+int net_shard_of(const char *key, size_t key_len, int threads)
+{
+	uint32_t hash = 0;
+	for (size_t i = 0; i < key_len && key[i]; ++i)
+		hash = hash * 31 + (unsigned char)key[i];
+	return (int)(hash % (uint32_t)threads);
+}
+
+/* Attaches a classic BPF program to the SO_REUSEPORT group that selects
+   the socket of the worker owning each datagram, using the same hash as
+   net_shard_of(). The program sees the UDP payload at offset 0. Returns
+   0 if successful, -1 if the kernel refused the program. */
+static int net_attach_steering(int sock, const net_options_t *options)
+{
+	struct sock_filter code[8 + NET_MAX_SHARD_KEY * 7];
+	int n = 0;
+	int key_len = (int)options->shard_key_len;
+	int done = 2 + key_len * 7;
+
+	/* M[0] holds the running hash. */
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_IMM, 0);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_ST, 0);
+	for (int i = 0; i < key_len; ++i) {
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+			(uint32_t)(options->shard_key_offset + i));
+		code[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0,
+			(uint8_t)(done - (n + 1)), 0);
+		n++;
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TAX, 0);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_MEM, 0);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 31);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_ST, 0);
+	}
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_MEM, 0);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)options->threads);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+	struct sock_fprog prog = { (unsigned short)n, code };
+	return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+/* Creates a UDP socket bound to the given port on all addresses. */
+static int net_open_socket(unsigned short port, int reuseport)
+{
+	int sock;
+	struct sockaddr_in server_address;
+
+	if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+		fail_with_error("FATAL: socket() failed");
+
+	int one = 1;
+	if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+		fail_with_error("FATAL: setsockopt(SO_REUSEPORT) failed");
+
+	memset(&server_address, 0, sizeof(server_address));
+	server_address.sin_family = AF_INET;
+	server_address.sin_addr.s_addr = htonl(INADDR_ANY);
+	server_address.sin_port = htons(port);
+
+	if (bind(sock, (struct sockaddr*) &server_address, sizeof(server_address)) < 0)
+		fail_with_error("FATAL: bind() failed");
+
+	return sock;
+}
+
+/* Allocates a worker's buffers. */
+static void net_worker_init(net_worker_t *w, int index, int sock)
+{
+	size_t batch = net_options->batch_size;
+
+	memset(w, 0, sizeof(net_worker_t));
+	w->index = index;
+	w->sock = sock;
+	w->wake_fd = -1;
+	w->watch_fd = -1;
+	pthread_mutex_init(&w->lock, (const pthread_mutexattr_t*)0);
+
+	w->in = (struct mmsghdr*)calloc(batch, sizeof(struct mmsghdr));
+	w->in_iov = (struct iovec*)calloc(batch, sizeof(struct iovec));
+	w->in_addrs = (struct sockaddr_in*)calloc(batch, sizeof(struct sockaddr_in));
+	w->messages = (char*)malloc(net_options->message_capacity * batch);
+	w->out_slots = batch > NET_MIN_REPLY_SLOTS ? (int)batch : NET_MIN_REPLY_SLOTS;
+	w->out = (struct mmsghdr*)calloc(w->out_slots, sizeof(struct mmsghdr));
+	w->out_iov = (struct iovec*)calloc(w->out_slots, sizeof(struct iovec));
+	w->out_addrs = (struct sockaddr_in*)calloc(w->out_slots, sizeof(struct sockaddr_in));
+	w->replies = (char*)malloc(net_options->reply_capacity * w->out_slots);
+	if (!w->in || !w->in_iov || !w->in_addrs || !w->messages ||
+		!w->out || !w->out_iov || !w->out_addrs || !w->replies)
+		fail_with_error("FATAL: malloc() failed");
+
+	if (net_options->threads > 1 && (w->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+		fail_with_error("FATAL: eventfd() failed");
+}
+
+/* Sends every queued reply, after committing whatever the requests they
+   answer changed. sendmmsg() may stop early, so continue from wherever
+   it left off. */
+static void net_flush(net_worker_t *w)
+{
+	if (net_options->commit)
+		net_options->commit();
+
+	if (w->nout == 1) {
+		if (sendto(w->sock, w->out_iov[0].iov_base, w->out_iov[0].iov_len, 0,
+			(struct sockaddr*) &w->out_addrs[0], sizeof(struct sockaddr_in)) != (ssize_t)w->out_iov[0].iov_len)
+			fail_with_error("FATAL: sendto() sent a different number of bytes than expected");
+	} else {
+		for (int sent = 0; sent < w->nout;) {
+			int n = sendmmsg(w->sock, w->out + sent, w->nout - sent, 0);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				fail_with_error("FATAL: sendmmsg() failed");
+			}
+			sent += n;
+		}
+	}
+
+	w->nout = 0;
+}
+
+/* Starts a reply datagram to the given address on the calling worker.
+   Replies are built in per-slot buffers, because a later request in the
+   same batch may replace a response an earlier one refers to. */
+char *net_reply_start(const struct sockaddr_in *to, size_t *capacity)
+{
+	net_worker_t *w = current_worker;
+	if (w->nout == w->out_slots)
+		net_flush(w);
+
+	int slot = w->nout;
+	w->out_addrs[slot] = *to;
+	*capacity = net_options->reply_capacity;
+	return w->replies + net_options->reply_capacity * slot;
+}
+
+/* Queues the reply started by net_reply_start(). */
+void net_reply_finish(size_t size)
+{
+	net_worker_t *w = current_worker;
+	if (size == 0)
+		return;
+
+	int slot = w->nout;
+	w->out_iov[slot].iov_base = w->replies + net_options->reply_capacity * slot;
+	w->out_iov[slot].iov_len = size;
+	memset(&w->out[slot].msg_hdr, 0, sizeof(struct msghdr));
+	w->out[slot].msg_hdr.msg_name = &w->out_addrs[slot];
+	w->out[slot].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	w->out[slot].msg_hdr.msg_iov = &w->out_iov[slot];
+	w->out[slot].msg_hdr.msg_iovlen = 1;
+	w->nout = slot + 1;
+}
+
+/* Copies a datagram into the mailbox of the worker that owns it. If
+   memory runs out the datagram is dropped, and the client will
+   retransmit. */
+static void net_hand_off(net_worker_t *owner, char *message, size_t size, struct sockaddr_in *from)
+{
+	net_handoff_t *handoff = (net_handoff_t*)malloc(sizeof(net_handoff_t) + size);
+	if (!handoff)
+		return;
+	handoff->next = (net_handoff_t*)0;
+	handoff->from = *from;
+	handoff->size = size;
+	memcpy(handoff->message, message, size);
+
+	pthread_mutex_lock(&owner->lock);
+	if (owner->mailbox_tail)
+		owner->mailbox_tail->next = handoff;
+	else
+		owner->mailbox_head = handoff;
+	owner->mailbox_tail = handoff;
+	pthread_mutex_unlock(&owner->lock);
+
+	uint64_t one = 1;
+	if (write(owner->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		fail_with_error("FATAL: write() to eventfd failed");
+}
+
+/* Handles every datagram other workers have handed to this one. */
+static void net_drain_mailbox(net_worker_t *w)
+{
+	uint64_t count;
+	if (read(w->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		fail_with_error("FATAL: read() from eventfd failed");
+
+	pthread_mutex_lock(&w->lock);
+	net_handoff_t *handoff = w->mailbox_head;
+	w->mailbox_head = w->mailbox_tail = (net_handoff_t*)0;
+	pthread_mutex_unlock(&w->lock);
+
+	while (handoff) {
+		net_handoff_t *next = handoff->next;
+		net_handler(handoff->message, handoff->size, &handoff->from);
+		free(handoff);
+		handoff = next;
+	}
+}
+
+/* Handles a received datagram here or hands it to the worker owning its
+   shard key. Datagrams too short to hold the key are handled where
+   they arrive. */
+static void net_dispatch(net_worker_t *w, char *message, size_t size, struct sockaddr_in *from)
+{
+	if (net_options->threads > 1 &&
+		size >= net_options->shard_key_offset + net_options->shard_key_len) {
+		int owner = net_shard_of(message + net_options->shard_key_offset,
+			net_options->shard_key_len, net_options->threads);
+		if (owner != w->index) {
+			net_hand_off(&workers[owner], message, size, from);
+			return;
+		}
+	}
+
+	net_handler(message, size, from);
+}
+
+/* Returns the microseconds left until the deadline, or 0 if it passed. */
+static long net_remaining_us(const struct timespec *deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long remaining = (deadline->tv_sec - now.tv_sec) * 1000000L +
+		(deadline->tv_nsec - now.tv_nsec) / 1000L;
+	return remaining > 0 ? remaining : 0;
+}
+
+/* Receives up to a batch of datagrams into the worker's receive slots.
+   Blocks for the first one unless flags contains MSG_DONTWAIT, then
+   keeps collecting until the batch is full or the wait budget runs out.
+   Returns the number of datagrams received. */
+static int net_receive(net_worker_t *w, int flags)
+{
+	int batch = (int)net_options->batch_size;
+
+	for (int i = 0; i < batch; ++i) {
+		w->in_iov[i].iov_base = w->messages + net_options->message_capacity * i;
+		w->in_iov[i].iov_len = net_options->message_capacity;
+		memset(&w->in[i].msg_hdr, 0, sizeof(struct msghdr));
+		w->in[i].msg_hdr.msg_name = &w->in_addrs[i];
+		w->in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		w->in[i].msg_hdr.msg_iov = &w->in_iov[i];
+		w->in[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	if (batch == 1) {
+		ssize_t message_size = recvmsg(w->sock, &w->in[0].msg_hdr, flags);
+		if (message_size < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			fail_with_error("FATAL: recvfrom() failed");
+		}
+		w->in[0].msg_len = (unsigned int)message_size;
+		return 1;
+	}
+
+	int received = recvmmsg(w->sock, w->in, batch, flags | MSG_WAITFORONE, (struct timespec*)0);
+	if (received < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		fail_with_error("FATAL: recvmmsg() failed");
+	}
+
+	if (received >= batch || net_options->batch_wait_us <= 0)
+		return received;
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += net_options->batch_wait_us / 1000000L;
+	deadline.tv_nsec += (net_options->batch_wait_us % 1000000L) * 1000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec += 1;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	while (received < batch) {
+		long remaining = net_remaining_us(&deadline);
+		if (remaining == 0)
+			break;
+
+		struct pollfd pfd = { w->sock, POLLIN, 0 };
+		struct timespec timeout = { remaining / 1000000L, (remaining % 1000000L) * 1000L };
+		int ready = ppoll(&pfd, 1, &timeout, (const sigset_t*)0);
+		if (ready < 0 && errno != EINTR)
+			fail_with_error("FATAL: ppoll() failed");
+		if (ready <= 0)
+			continue;
+
+		int more = recvmmsg(w->sock, w->in + received, batch - received, MSG_DONTWAIT, (struct timespec*)0);
+		if (more < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			fail_with_error("FATAL: recvmmsg() failed");
+		if (more > 0)
+			received += more;
+	}
+
+	return received;
+}
+
+/* Receives and answers datagrams forever. A worker with other workers
+   beside it also waits on its mailbox, one with a watched descriptor
+   waits on that too, and a worker with a timer waits no longer than the
+   timer asks. */
+static void net_worker_loop(net_worker_t *w)
+{
+	for (;;) {
+		int received;
+		long timeout = -1;
+
+		if (net_options->timer) {
+			timeout = net_options->timer();
+			if (w->nout > 0)
+				net_flush(w);
+		}
+
+		if (w->wake_fd >= 0 || w->watch_fd >= 0 || timeout >= 0) {
+			/* Descriptors that are not used are negative, which poll()
+			   skips. */
+			struct pollfd pfds[3] = { { w->sock, POLLIN, 0 }, { w->wake_fd, POLLIN, 0 },
+				{ w->watch_fd, POLLIN, 0 } };
+			if (poll(pfds, 3, timeout > INT_MAX ? INT_MAX : (int)timeout) < 0) {
+				if (errno == EINTR)
+					continue;
+				fail_with_error("FATAL: poll() failed");
+			}
+
+			if (pfds[2].revents & POLLIN)
+				w->watch_ready();
+			if (pfds[1].revents & POLLIN)
+				net_drain_mailbox(w);
+			received = (pfds[0].revents & POLLIN) ? net_receive(w, MSG_DONTWAIT) : 0;
+		} else {
+			received = net_receive(w, 0);
+		}
+
+		for (int i = 0; i < received; ++i)
+			net_dispatch(w, (char*)w->in_iov[i].iov_base, w->in[i].msg_len, &w->in_addrs[i]);
+
+		if (w->nout > 0)
+			net_flush(w);
+		else if (net_options->commit)
+			net_options->commit();
+	}
+}
+
+/* Entrypoint of every worker thread. */
+static void *net_worker_main(void *arg)
+{
+	net_worker_t *w = (net_worker_t*)arg;
+	current_worker = w;
+	if (net_init)
+		net_init();
+	net_worker_loop(w);
+	return (void*)0;
+}
+
+/* Opens one socket per worker on the given port, then receives and
+   answers datagrams forever. The calling thread becomes worker 0. */
+void net_serve(unsigned short port, const net_options_t *options,
+	net_handler_t handler, void (*init)(void))
+{
+	int threads = options->threads;
+
+	net_options = options;
+	net_handler = handler;
+	net_init = init;
+
+	workers = (net_worker_t*)calloc(threads, sizeof(net_worker_t));
+	if (!workers)
+		fail_with_error("FATAL: malloc() failed");
+
+	/* Sockets join the SO_REUSEPORT group in bind order, which is the
+	   order the steering program indexes them in. */
+	for (int i = 0; i < threads; ++i)
+		net_worker_init(&workers[i], i, net_open_socket(port, threads > 1));
+
+	if (threads > 1 && net_attach_steering(workers[0].sock, options) < 0)
+		perror("WARNING: Could not attach the shard steering program; datagrams will be handed off between workers");
+
+	for (int i = 1; i < threads; ++i) {
+		if (pthread_create(&workers[i].thread, (const pthread_attr_t*)0, net_worker_main, &workers[i]) != 0)
+			fail_with_error("FATAL: pthread_create() failed");
+	}
+
+	net_worker_main(&workers[0]);
+}
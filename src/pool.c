@@ -0,0 +1,62 @@
+/* A fixed-size object allocator used in the server. */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+/* Rounds sizes up so every object in a slab stays suitably aligned for
+   any type. */
+#define POOL_ALIGN 16
+
+/* Initializes the pool. Slabs hold per_slab objects of object_size
+   bytes each. */
+void pool_init(pool_t *pool, size_t object_size, size_t per_slab)
+{
+	memset(pool, 0, sizeof(pool_t));
+	if (object_size < sizeof(void*))
+		object_size = sizeof(void*);
+	pool->object_size = (object_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	pool->per_slab = per_slab ? per_slab : 1;
+}
+
+/* Allocates a new slab and threads all of its objects onto the free
+   list. Returns 0 if successful, -1 if unsuccessful. */
+static int pool_grow(pool_t *pool)
+{
+	char *slab = (char*)malloc(pool->object_size * pool->per_slab);
+	if (!slab)
+		return -1;
+
+	for (size_t i = 0; i < pool->per_slab; ++i) {
+		void **object = (void**)(slab + pool->object_size * i);
+		*object = pool->free_list;
+		pool->free_list = object;
+	}
+	pool->slabs = pool->slabs + 1;
+	return 0;
+}
+
+/* Returns an uninitialized object, or a null pointer if memory could
+   not be allocated. */
+void * pool_alloc(pool_t *pool)
+{
+	if (!pool->free_list && pool_grow(pool) < 0)
+		return (void*)0;
+
+	void **object = (void**)pool->free_list;
+	pool->free_list = *object;
+	pool->in_use = pool->in_use + 1;
+	return object;
+}
+
+/* Returns an object to the pool it was allocated from. */
+void pool_free(pool_t *pool, void *object)
+{
+	if (!object)
+		return;
+
+	*(void**)object = pool->free_list;
+	pool->free_list = object;
+	pool->in_use = pool->in_use - 1;
+}
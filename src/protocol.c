@@ -0,0 +1,378 @@
+/* Decoding of requests and encoding of responses for both wire formats. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "protocol.h"
+#include "net.h"
+
+/* Returns nonzero if the datagram starts with the binary magic number
+and a supported version. */
+char is_binary_request(const char *message, size_t message_size)
+{
+    const bin_request_t *request = (const bin_request_t*)message;
+    return message_size >= sizeof(bin_request_t) &&
+        request->magic == BIN_REQUEST_MAGIC &&
+        request->version == BIN_REQUEST_VERSION;
+}
+
+/* Fills the header fields shared by both formats. The machine name must
+be NUL-terminated within its field. Returns 0 if successful, -1 if not. */
+static int decode_header(const char *machine, size_t machine_size, int32_t client,
+    int32_t request, int32_t incarnation, request_header_t *header)
+{
+    size_t len = strnlen(machine, machine_size);
+    if (len == 0 || len == machine_size)
+        return -1;
+
+    header->machine = machine;
+    header->client = (int)client;
+    header->request = (int)request;
+    header->incarnation = (int)incarnation;
+    header->from = (const struct sockaddr_in*)0;
+    header->message = (const char*)0;
+    header->message_size = 0;
+    header->deferred = 0;
+    header->binary = 0;
+    return 0;
+}
+
+/* Returns the next whitespace-separated token in [*p, end) and its
+length, advancing *p past it. Returns a null pointer at the end. */
+static const char *next_token(const char **p, const char *end, size_t *len)
+{
+    const char *s = *p;
+    while (s < end && isspace((unsigned char)*s))
+        ++s;
+    const char *start = s;
+    while (s < end && !isspace((unsigned char)*s))
+        ++s;
+    *p = s;
+    *len = (size_t)(s - start);
+    return *len ? start : (const char*)0;
+}
+
+/* Returns nonzero if a token equals the given word. */
+static char token_is(const char *token, size_t len, const char *word)
+{
+    return token && strlen(word) == len && memcmp(token, word, len) == 0;
+}
+
+/* Parses a decimal integer token, or returns 0 if there is none. */
+static long token_long(const char *token, size_t len)
+{
+    char buffer[24];
+    if (!token || len >= sizeof(buffer))
+        return 0;
+    memcpy(buffer, token, len);
+    buffer[len] = '\0';
+    return strtol(buffer, (char**)0, 10);
+}
+
+/* Decodes a text request_t in place. The operation string has the form
+"<command> <filename> [<argument>]", where the argument of write is the
+rest of the string. open takes the mode and optionally "ranges" and
+"wait", lock takes "read" or "write", the offset and the length of the
+range, and unlock the offset and length. Unknown commands decode to
+OP_INVALID so the client gets an EINVAL response. Returns 0 if
+successful, -1 if the request is malformed and should be ignored. */
+int decode_text_request(request_t *request, request_header_t *header, op_t *op)
+{
+    if (decode_header(request->machine, sizeof(request->machine), request->client,
+        request->request, request->incarnation, header) < 0)
+        return -1;
+
+    memset(op, 0, sizeof(op_t));
+    op->max_result = TEXT_RESULT_SIZE;
+
+    const char *p = request->operation;
+    const char *end = p + strnlen(request->operation, sizeof(request->operation));
+    size_t len;
+    const char *command = next_token(&p, end, &len);
+
+    if (token_is(command, len, "open"))
+        op->opcode = OP_OPEN;
+    else if (token_is(command, len, "close"))
+        op->opcode = OP_CLOSE;
+    else if (token_is(command, len, "read"))
+        op->opcode = OP_READ;
+    else if (token_is(command, len, "write"))
+        op->opcode = OP_WRITE;
+    else if (token_is(command, len, "lseek"))
+        op->opcode = OP_LSEEK;
+    else if (token_is(command, len, "renew"))
+        op->opcode = OP_RENEW;
+    else if (token_is(command, len, "lock"))
+        op->opcode = OP_LOCK;
+    else if (token_is(command, len, "unlock"))
+        op->opcode = OP_UNLOCK;
+    else
+        return 0;
+
+    op->filename = next_token(&p, end, &op->filename_len);
+    if (!op->filename) {
+        op->filename = "";
+        op->filename_len = 0;
+    }
+
+    const char *arg;
+    switch (op->opcode) {
+    case OP_OPEN:
+        arg = next_token(&p, end, &len);
+        if (token_is(arg, len, "read"))
+            op->mode = LOCK_READ;
+        else if (token_is(arg, len, "write"))
+            op->mode = LOCK_WRITE;
+        else if (token_is(arg, len, "readwrite"))
+            op->mode = LOCK_READ | LOCK_WRITE;
+        arg = next_token(&p, end, &len);
+        if (token_is(arg, len, "ranges")) {
+            op->mode |= LOCK_RANGES;
+            arg = next_token(&p, end, &len);
+        }
+        if (token_is(arg, len, "wait"))
+            op->flags |= OP_FLAG_WAIT;
+        break;
+    case OP_LOCK:
+        arg = next_token(&p, end, &len);
+        if (token_is(arg, len, "read"))
+            op->mode = LOCK_READ;
+        else if (token_is(arg, len, "write"))
+            op->mode = LOCK_WRITE;
+        /* Fall through to the range. */
+    case OP_UNLOCK:
+        arg = next_token(&p, end, &len);
+        op->offset = token_long(arg, len);
+        arg = next_token(&p, end, &len);
+        op->length = token_long(arg, len);
+        break;
+    case OP_READ:
+        arg = next_token(&p, end, &len);
+        op->length = token_long(arg, len);
+        break;
+    case OP_LSEEK:
+        arg = next_token(&p, end, &len);
+        op->offset = token_long(arg, len);
+        break;
+    case OP_WRITE:
+        /* The data is everything after the whitespace following the
+        filename. */
+        while (p < end && isspace((unsigned char)*p))
+            ++p;
+        op->data = p;
+        op->length = end - p;
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+/* Checks that the payload of an OP_COMPOUND request holds exactly count
+operations. Returns 0 if so, -1 if not. */
+static int check_compound(const char *payload, size_t size, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i) {
+        bin_op_t bop;
+        if (size < sizeof(bin_op_t))
+            return -1;
+        memcpy(&bop, payload, sizeof(bin_op_t));
+        size_t op_size = sizeof(bin_op_t) + bop.name_len + (bop.opcode == OP_WRITE ? bop.length : 0);
+        if (bop.name_len > MAX_FILENAME_LEN || op_size > size)
+            return -1;
+        payload += op_size;
+        size -= op_size;
+    }
+    return size == 0 ? 0 : -1;
+}
+
+/* Decodes the next operation of an OP_COMPOUND request that
+decode_binary_request() accepted, and advances *cursor past it.
+Operations that may not be part of a compound decode to OP_INVALID. */
+void decode_compound_op(const char **cursor, op_t *op)
+{
+    bin_op_t bop;
+    memcpy(&bop, *cursor, sizeof(bin_op_t));
+
+    memset(op, 0, sizeof(op_t));
+    switch (bop.opcode) {
+    case OP_OPEN:
+    case OP_CLOSE:
+    case OP_READ:
+    case OP_WRITE:
+    case OP_LSEEK:
+    case OP_RENEW:
+    case OP_LOCK:
+    case OP_UNLOCK:
+        op->opcode = (opcode_t)bop.opcode;
+        break;
+    default:
+        op->opcode = OP_INVALID;
+    }
+    op->filename = *cursor + sizeof(bin_op_t);
+    op->filename_len = bop.name_len;
+    op->mode = (lock_t)(bop.mode & (LOCK_READ | LOCK_WRITE | LOCK_RANGES));
+    op->offset = bop.offset;
+    op->length = bop.length;
+    if (bop.opcode == OP_WRITE)
+        op->data = op->filename + op->filename_len;
+
+    *cursor = op->filename + op->filename_len + (bop.opcode == OP_WRITE ? bop.length : 0);
+}
+
+/* Decodes a binary request in place, without copying the name or data.
+Returns 0 if successful, -1 if the request is malformed and should be
+ignored. */
+int decode_binary_request(char *message, size_t message_size,
+    request_header_t *header, op_t *op)
+{
+    bin_request_t *request = (bin_request_t*)message;
+
+    if (decode_header(request->machine, sizeof(request->machine), request->client,
+        request->request, request->incarnation, header) < 0)
+        return -1;
+
+    size_t payload = message_size - sizeof(bin_request_t);
+    if (request->name_len > MAX_FILENAME_LEN || request->name_len > payload)
+        return -1;
+    if (request->opcode == OP_WRITE && request->length != payload - request->name_len)
+        return -1;
+    if (request->opcode == OP_RESEND &&
+        (size_t)request->length * sizeof(uint32_t) != payload - request->name_len)
+        return -1;
+    if (request->opcode == OP_COMPOUND && (request->name_len != 0 ||
+        check_compound(message + sizeof(bin_request_t), payload, request->length) < 0))
+        return -1;
+
+    memset(op, 0, sizeof(op_t));
+    op->opcode = request->opcode <= OP_UNLOCK ? (opcode_t)request->opcode : OP_INVALID;
+    /* Fields that must be 0 stay free for later versions only if they
+    are checked now, so a request setting them gets EINVAL. */
+    if ((request->flags & ~BIN_FLAG_WAIT) || request->reserved != 0 || request->padding != 0)
+        op->opcode = OP_INVALID;
+    op->max_result = op->opcode == OP_READ_STREAM ? BIN_MAX_STREAM : (int64_t)BIN_MAX_RESULT;
+    op->filename = message + sizeof(bin_request_t);
+    op->filename_len = request->name_len;
+    op->mode = (lock_t)(request->mode & (LOCK_READ | LOCK_WRITE | LOCK_RANGES));
+    op->offset = request->offset;
+    op->length = request->length;
+    if (op->opcode == OP_WRITE || op->opcode == OP_RESEND || op->opcode == OP_COMPOUND)
+        op->data = op->filename + op->filename_len;
+    if (request->flags & BIN_FLAG_WAIT)
+        op->flags |= OP_FLAG_WAIT;
+    header->binary = 1;
+
+    return 0;
+}
+
+/* Queues one chunk of a streamed read. */
+static void send_chunk(response_t *response, int request, uint32_t seq, uint32_t chunks,
+    struct sockaddr_in *to)
+{
+    size_t capacity;
+    char *reply = net_reply_start(to, &capacity);
+    size_t offset = (size_t)seq * BIN_CHUNK_SIZE;
+    size_t size = (size_t)response->size - offset;
+    if (size > BIN_CHUNK_SIZE)
+        size = BIN_CHUNK_SIZE;
+
+    bin_chunk_t *chunk = (bin_chunk_t*)reply;
+    chunk->magic = BIN_REQUEST_MAGIC;
+    chunk->status = response->status;
+    chunk->request = (int32_t)request;
+    chunk->size = response->size;
+    chunk->seq = seq;
+    chunk->chunks = chunks;
+    memcpy(reply + sizeof(bin_chunk_t), response->result + offset, size);
+    net_reply_finish(sizeof(bin_chunk_t) + size);
+}
+
+/* Queues up to BIN_STREAM_WINDOW chunks of a streamed read: for
+OP_RESEND the first of those it lists, otherwise the first of the
+stream. An empty or failed stream is a single chunk with no data, which
+answers any resend. */
+static void send_stream(request_header_t *header, op_t *op, response_t *response,
+    struct sockaddr_in *to)
+{
+    uint32_t chunks = response->size > 0 ?
+        (uint32_t)(((size_t)response->size + BIN_CHUNK_SIZE - 1) / BIN_CHUNK_SIZE) : 1;
+
+    if (op->opcode != OP_RESEND || response->size <= 0) {
+        for (uint32_t seq = 0; seq < chunks && seq < BIN_STREAM_WINDOW; ++seq)
+            send_chunk(response, header->request, seq, chunks, to);
+        return;
+    }
+
+    for (int64_t i = 0; i < op->length && i < BIN_STREAM_WINDOW; ++i) {
+        uint32_t seq;
+        memcpy(&seq, op->data + i * sizeof(uint32_t), sizeof(seq));
+        if (seq < chunks)
+            send_chunk(response, header->request, seq, chunks, to);
+    }
+}
+
+/* Queues the response to a request in the format the request came in.
+Streamed reads are sent as a sequence of chunks; for OP_RESEND only the
+chunks it lists are sent. */
+void send_response(request_header_t *header, op_t *op, response_t *response,
+    char binary, struct sockaddr_in *to)
+{
+    size_t capacity;
+
+    if (!binary) {
+        /* Text responses always carry the full result field. */
+        char *reply = net_reply_start(to, &capacity);
+        memcpy(reply, response, TEXT_RESPONSE_SIZE);
+        net_reply_finish(TEXT_RESPONSE_SIZE);
+        return;
+    }
+
+    if (op->opcode == OP_READ_STREAM || op->opcode == OP_RESEND) {
+        send_stream(header, op, response, to);
+        return;
+    }
+
+    /* Only reads and compounds carry their result. */
+    size_t data = op->opcode == OP_READ || op->opcode == OP_COMPOUND ? (size_t)response->size : 0;
+    char *reply = net_reply_start(to, &capacity);
+    bin_response_t *bin = (bin_response_t*)reply;
+    bin->magic = BIN_REQUEST_MAGIC;
+    bin->status = response->status;
+    bin->request = (int32_t)header->request;
+    bin->size = response->size;
+    memcpy(reply + sizeof(bin_response_t), response->result, data);
+    net_reply_finish(sizeof(bin_response_t) + data);
+}
+
+/* Returns a printable name of an opcode. */
+const char *opcode_name(opcode_t opcode)
+{
+    switch (opcode) {
+    case OP_OPEN:
+        return "open";
+    case OP_CLOSE:
+        return "close";
+    case OP_READ:
+        return "read";
+    case OP_WRITE:
+        return "write";
+    case OP_LSEEK:
+        return "lseek";
+    case OP_READ_STREAM:
+        return "read-stream";
+    case OP_RESEND:
+        return "resend";
+    case OP_RENEW:
+        return "renew";
+    case OP_COMPOUND:
+        return "compound";
+    case OP_LOCK:
+        return "lock";
+    case OP_UNLOCK:
+        return "unlock";
+    default:
+        return "invalid";
+    }
+}
@@ -0,0 +1,324 @@
+/* Byte-range locks on a file, kept in an interval tree, used in the server. */
+
+#include <stdlib.h>
+
+#include "rangelock.h"
+
+/* Orders a range and owner against a lock. Returns a negative number,
+   0, or a positive number as the range sorts before, with, or after the
+   lock. */
+static int rangelock_compare(uint64_t start, uint64_t end, const void *owner,
+	const rangelock_t *lock)
+{
+	if (start != lock->start)
+		return start < lock->start ? -1 : 1;
+	if (end != lock->end)
+		return end < lock->end ? -1 : 1;
+	if (owner != lock->owner)
+		return (uintptr_t)owner < (uintptr_t)lock->owner ? -1 : 1;
+	return 0;
+}
+
+static int rangelock_height(const rangelock_t *lock)
+{
+	return lock ? lock->height : 0;
+}
+
+/* Recomputes a lock's height and max_end from its children. */
+static void rangelock_update(rangelock_t *lock)
+{
+	int left = rangelock_height(lock->left);
+	int right = rangelock_height(lock->right);
+	lock->height = (left > right ? left : right) + 1;
+	lock->max_end = lock->end;
+	if (lock->left && lock->left->max_end > lock->max_end)
+		lock->max_end = lock->left->max_end;
+	if (lock->right && lock->right->max_end > lock->max_end)
+		lock->max_end = lock->right->max_end;
+}
+
+static rangelock_t *rangelock_rotate_left(rangelock_t *lock)
+{
+	rangelock_t *right = lock->right;
+	lock->right = right->left;
+	right->left = lock;
+	rangelock_update(lock);
+	rangelock_update(right);
+	return right;
+}
+
+static rangelock_t *rangelock_rotate_right(rangelock_t *lock)
+{
+	rangelock_t *left = lock->left;
+	lock->left = left->right;
+	left->right = lock;
+	rangelock_update(lock);
+	rangelock_update(left);
+	return left;
+}
+
+/* Restores the AVL balance of a subtree whose children differ in height
+   by at most two, and returns its new root. */
+static rangelock_t *rangelock_balance(rangelock_t *lock)
+{
+	rangelock_update(lock);
+	int balance = rangelock_height(lock->left) - rangelock_height(lock->right);
+	if (balance > 1) {
+		if (rangelock_height(lock->left->left) < rangelock_height(lock->left->right))
+			lock->left = rangelock_rotate_left(lock->left);
+		return rangelock_rotate_right(lock);
+	}
+	if (balance < -1) {
+		if (rangelock_height(lock->right->right) < rangelock_height(lock->right->left))
+			lock->right = rangelock_rotate_right(lock->right);
+		return rangelock_rotate_left(lock);
+	}
+	return lock;
+}
+
+static rangelock_t *rangelock_insert(rangelock_t *root, rangelock_t *lock)
+{
+	if (!root)
+		return lock;
+	if (rangelock_compare(lock->start, lock->end, lock->owner, root) < 0)
+		root->left = rangelock_insert(root->left, lock);
+	else
+		root->right = rangelock_insert(root->right, lock);
+	return rangelock_balance(root);
+}
+
+/* Unlinks the first lock of a subtree into *first, and returns the
+   subtree's new root. */
+static rangelock_t *rangelock_remove_first(rangelock_t *root, rangelock_t **first)
+{
+	if (!root->left) {
+		*first = root;
+		return root->right;
+	}
+	root->left = rangelock_remove_first(root->left, first);
+	return rangelock_balance(root);
+}
+
+/* Unlinks a lock of the subtree, and returns the subtree's new root. */
+static rangelock_t *rangelock_remove(rangelock_t *root, const rangelock_t *lock)
+{
+	int order = rangelock_compare(lock->start, lock->end, lock->owner, root);
+	if (order < 0) {
+		root->left = rangelock_remove(root->left, lock);
+	} else if (order > 0) {
+		root->right = rangelock_remove(root->right, lock);
+	} else {
+		if (!root->right)
+			return root->left;
+		rangelock_t *next;
+		rangelock_t *right = rangelock_remove_first(root->right, &next);
+		next->left = root->left;
+		next->right = right;
+		root = next;
+	}
+	return rangelock_balance(root);
+}
+
+static void rangelock_free(rangelock_t *lock)
+{
+	if (!lock)
+		return;
+	rangelock_free(lock->left);
+	rangelock_free(lock->right);
+	free(lock);
+}
+
+void rangelock_tree_init(rangelock_tree_t *tree)
+{
+	tree->root = (rangelock_t*)0;
+	tree->count = 0;
+}
+
+void rangelock_tree_destroy(rangelock_tree_t *tree)
+{
+	rangelock_free(tree->root);
+	rangelock_tree_init(tree);
+}
+
+/* Searches a subtree for a conflicting lock. Locks sorted after one that
+   starts at or past end cannot overlap the range, and nothing in a
+   subtree whose max_end is at or before start can. */
+static const rangelock_t *rangelock_find_conflict(const rangelock_t *lock, uint64_t start,
+	uint64_t end, const void *owner, char write)
+{
+	while (lock && lock->max_end > start) {
+		const rangelock_t *found = rangelock_find_conflict(lock->left, start, end, owner, write);
+		if (found)
+			return found;
+		if (lock->start >= end)
+			return (const rangelock_t*)0;
+		if (lock->end > start && lock->owner != owner && (write || lock->write))
+			return lock;
+		lock = lock->right;
+	}
+	return (const rangelock_t*)0;
+}
+
+const rangelock_t *rangelock_conflict(const rangelock_tree_t *tree, uint64_t start, uint64_t end,
+	const void *owner, char write)
+{
+	return rangelock_find_conflict(tree->root, start, end, owner, write);
+}
+
+int rangelock_set(rangelock_tree_t *tree, uint64_t start, uint64_t end, const void *owner,
+	char write)
+{
+	rangelock_t *lock = tree->root;
+	while (lock) {
+		int order = rangelock_compare(start, end, owner, lock);
+		if (order == 0) {
+			lock->write = write;
+			return 0;
+		}
+		lock = order < 0 ? lock->left : lock->right;
+	}
+
+	lock = (rangelock_t*)malloc(sizeof(rangelock_t));
+	if (!lock)
+		return -1;
+	lock->start = start;
+	lock->end = end;
+	lock->owner = owner;
+	lock->write = write;
+	lock->left = (rangelock_t*)0;
+	lock->right = (rangelock_t*)0;
+	rangelock_update(lock);
+	tree->root = rangelock_insert(tree->root, lock);
+	tree->count = tree->count + 1;
+	return 0;
+}
+
+/* Finds one of the owner's locks that overlaps [start, end) in a
+   subtree, or returns a null pointer. */
+static rangelock_t *rangelock_find_owned(rangelock_t *lock, uint64_t start, uint64_t end,
+	const void *owner)
+{
+	while (lock && lock->max_end > start) {
+		rangelock_t *found = rangelock_find_owned(lock->left, start, end, owner);
+		if (found)
+			return found;
+		if (lock->start >= end)
+			return (rangelock_t*)0;
+		if (lock->end > start && lock->owner == owner)
+			return lock;
+		lock = lock->right;
+	}
+	return (rangelock_t*)0;
+}
+
+/* Counts the owner's locks in a subtree that extend past [start, end)
+   on both sides, each of which releasing the range splits in two. */
+static size_t rangelock_count_splits(const rangelock_t *lock, uint64_t start, uint64_t end,
+	const void *owner)
+{
+	size_t count = 0;
+	while (lock && lock->max_end > end) {
+		count += rangelock_count_splits(lock->left, start, end, owner);
+		if (lock->start >= start)
+			return count;
+		if (lock->end > end && lock->owner == owner)
+			count = count + 1;
+		lock = lock->right;
+	}
+	return count;
+}
+
+/* Puts back the part [start, end) of a released lock in the node given,
+   or, if the owner already holds a lock on exactly that range, frees
+   the node and makes that lock exclusive if the part was. */
+static void rangelock_put_back(rangelock_tree_t *tree, rangelock_t *lock, uint64_t start,
+	uint64_t end)
+{
+	rangelock_t *held = tree->root;
+	while (held) {
+		int order = rangelock_compare(start, end, lock->owner, held);
+		if (order == 0) {
+			held->write = held->write || lock->write;
+			free(lock);
+			return;
+		}
+		held = order < 0 ? held->left : held->right;
+	}
+
+	lock->start = start;
+	lock->end = end;
+	lock->left = (rangelock_t*)0;
+	lock->right = (rangelock_t*)0;
+	rangelock_update(lock);
+	tree->root = rangelock_insert(tree->root, lock);
+	tree->count = tree->count + 1;
+}
+
+long rangelock_release(rangelock_tree_t *tree, uint64_t start, uint64_t end, const void *owner)
+{
+	/* Take the nodes the split locks need first, so that running out of
+	   memory changes nothing. */
+	rangelock_t *spare = (rangelock_t*)0;
+	for (size_t i = rangelock_count_splits(tree->root, start, end, owner); i > 0; --i) {
+		rangelock_t *lock = (rangelock_t*)malloc(sizeof(rangelock_t));
+		if (!lock) {
+			while (spare) {
+				rangelock_t *next = spare->left;
+				free(spare);
+				spare = next;
+			}
+			return -1;
+		}
+		lock->left = spare;
+		spare = lock;
+	}
+
+	/* Take out every overlapping lock before putting back the parts
+	   outside the range, so that none of them is found again. */
+	rangelock_t *released = (rangelock_t*)0;
+	long count = 0;
+	rangelock_t *lock;
+	while ((lock = rangelock_find_owned(tree->root, start, end, owner))) {
+		tree->root = rangelock_remove(tree->root, lock);
+		tree->count = tree->count - 1;
+		lock->left = released;
+		released = lock;
+		count = count + 1;
+	}
+
+	while (released) {
+		lock = released;
+		released = lock->left;
+		uint64_t lock_start = lock->start;
+		uint64_t lock_end = lock->end;
+		if (lock_start < start && lock_end > end) {
+			rangelock_t *after = spare;
+			spare = spare->left;
+			after->owner = lock->owner;
+			after->write = lock->write;
+			rangelock_put_back(tree, after, end, lock_end);
+			rangelock_put_back(tree, lock, lock_start, start);
+		} else if (lock_start < start) {
+			rangelock_put_back(tree, lock, lock_start, start);
+		} else if (lock_end > end) {
+			rangelock_put_back(tree, lock, end, lock_end);
+		} else {
+			free(lock);
+		}
+	}
+	return count;
+}
+
+static void rangelock_visit(const rangelock_t *lock, rangelock_visit_t visit, void *arg)
+{
+	if (!lock)
+		return;
+	rangelock_visit(lock->left, visit, arg);
+	visit(lock, arg);
+	rangelock_visit(lock->right, visit, arg);
+}
+
+void rangelock_each(const rangelock_tree_t *tree, rangelock_visit_t visit, void *arg)
+{
+	rangelock_visit(tree->root, visit, arg);
+}
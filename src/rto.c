@@ -0,0 +1,39 @@
+/* A retransmission timeout estimator used in the client library. */
+
+#include "rto.h"
+
+void rto_init(rto_t *rto, long initial_ms, long min_ms, long max_ms)
+{
+	rto->have_rtt = 0;
+	rto->srtt = 0;
+	rto->rttvar = 0;
+	rto->rto_ms = initial_ms;
+	rto->min_rto_ms = min_ms;
+	rto->max_rto_ms = max_ms;
+}
+
+void rto_sample(rto_t *rto, uint64_t rtt_us)
+{
+	double rtt = (double)rtt_us;
+	if (!rto->have_rtt) {
+		rto->srtt = rtt;
+		rto->rttvar = rtt / 2;
+		rto->have_rtt = 1;
+	} else {
+		double delta = rto->srtt > rtt ? rto->srtt - rtt : rtt - rto->srtt;
+		rto->rttvar = 0.75 * rto->rttvar + 0.25 * delta;
+		rto->srtt = 0.875 * rto->srtt + 0.125 * rtt;
+	}
+
+	long timeout = (long)((rto->srtt + 4 * rto->rttvar) / 1000 + 1);
+	if (timeout < rto->min_rto_ms)
+		timeout = rto->min_rto_ms;
+	if (timeout > rto->max_rto_ms)
+		timeout = rto->max_rto_ms;
+	rto->rto_ms = timeout;
+}
+
+long rto_backoff(const rto_t *rto, long rto_ms)
+{
+	return rto_ms * 2 > rto->max_rto_ms ? rto->max_rto_ms : rto_ms * 2;
+}
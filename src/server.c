@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -11,135 +12,494 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <getopt.h>
 
 #include "server.h"
 #include "request.h"
 #include "list.h"
-
-char recv_buffer[sizeof(request_t) + 16];
-list_t client_list;
-list_t file_list;
-response_t invalid_req_resp;
+#include "htable.h"
+#include "intern.h"
+#include "net.h"
+#include "protocol.h"
+#include "pool.h"
+#include "log.h"
+#include "stats.h"
+#include "wal.h"
+
+/* Server state is owned by the worker thread serving it. Each worker
+serves a disjoint set of machines, and a client only ever locks files
+on its own machine, so no state is shared between workers. */
+__thread list_t client_list;
+__thread htable_t client_table;
+__thread list_t file_list;
+__thread htable_t file_table;
+__thread htable_t machine_table;
+__thread intern_t name_table;
+__thread fdcache_t fd_cache;
+__thread pool_t client_pool;
+__thread pool_t file_pool;
+__thread pool_t response_pools[RESPONSE_CLASSES];
+__thread pool_t waiter_pool;
+__thread lock_waiter_t *expiry_head;
+__thread lock_waiter_t *expiry_tail;
+__thread wheel_t lease_wheel;
+__thread pool_t io_pool;
+__thread const io_backend_t *disk_io;
+__thread bcache_t block_cache;
+__thread uint64_t next_flush;
+
+size_t fd_cache_capacity = 0;
+int server_threads = 1;
+
+/* How long a queued open waits before failing with ETIMEDOUT. 0 turns
+queueing off, so every conflicting open fails with EPERM. */
+long lock_wait_ms = 0;
+lock_queue_policy_t lock_queue_policy = LOCK_QUEUE_FIFO;
+
+/* How long a client holding locks may stay silent before its locks are
+released. 0 turns leases off. Lease expiry is checked every
+LEASE_TICK_MS milliseconds. */
+long lease_ms = 0;
+#define LEASE_TICK_MS 10
+
+/* Directory of the write-ahead log, or a null pointer if the client and
+lock tables are not logged. Each worker writes a snapshot after
+snapshot_every log entries. */
+const char *wal_directory = (const char*)0;
+size_t snapshot_every = 1000000;
+
+/* Catalog of the files created on disk, shared by all workers, so that
+files created by an earlier run can be opened for reading. Used when
+catalog_path is set. */
+const char *catalog_path = (const char*)0;
+catalog_t file_catalog;
+
+/* Backend that performs disk reads and writes. A worker where it is not
+available falls back to io_sync_backend. IO_DEPTH is how many operations
+a worker keeps in flight before performing more synchronously. */
+const io_backend_t *io_backend = &io_sync_backend;
+#define IO_DEPTH 256
+
+/* Blocks of file data cached in memory, divided evenly between the
+workers. 0 turns the cache off, so every read and write goes to the
+disk I/O backend. Reads and writes larger than CACHED_IO_MAX bytes
+always do, after the file's dirty blocks are written back. Dirty blocks
+are written back when their file is closed, every flush_interval_ms,
+and when the cache runs short of clean blocks; durability decides when
+written data is synced. */
+size_t block_cache_blocks = 0;
+long flush_interval_ms = 1000;
+durability_t durability = DURABILITY_NONE;
+#define CACHED_IO_MAX (16 * BCACHE_BLOCK_SIZE)
+
+/* Reads that do not go through the block cache are read ahead once a
+client makes READAHEAD_TRIGGER reads of a file in a row, each starting
+where the one before ended. Read-ahead starts with READAHEAD_MIN bytes
+and grows up to READAHEAD_MAX, or READAHEAD_SYNC_MAX with the sync
+backend, whose read-ahead holds up the worker; reads larger than
+READAHEAD_MIN are never served from it. */
+#define READAHEAD_TRIGGER 2
+#define READAHEAD_MIN (16 * 1024)
+#define READAHEAD_MAX (1024 * 1024)
+#define READAHEAD_SYNC_MAX (64 * 1024)
+static const bcache_ops_t disk_blocks = {
+    read_blocks, write_blocks, disk_file_size, sync_disk_file
+};
+
+/* Result capacities of the response pools. Larger responses, which only
+streamed reads need, come straight from the heap. */
+static const size_t response_class_sizes[RESPONSE_CLASSES] = {
+    TEXT_RESULT_SIZE, 4096, BIN_MAX_RESULT
+};
+static const size_t response_class_slabs[RESPONSE_CLASSES] = { 256, 32, 4 };
+
+/* Precedes every response, and records where it was allocated from. The
+padding keeps the response itself 16-byte aligned. */
+typedef struct {
+    size_t pool;
+    size_t padding;
+} response_prefix_t;
+
+#define RESPONSE_FROM_HEAP ((size_t)-1)
 
 #ifndef TEST
 int main(int argc, char** argv)
 {
-    int sock;
     unsigned short server_port;
-    struct sockaddr_in server_address;
-
-    /* Check number of arguments */
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s PORT\n", argv[0]);
-        exit(1);
+    net_options_t net_options;
+
+    static const struct option long_options[] = {
+        { "fd-cache", required_argument, 0, 'f' },
+        { "batch", required_argument, 0, 'b' },
+        { "batch-wait", required_argument, 0, 'w' },
+        { "threads", required_argument, 0, 't' },
+        { "log-level", required_argument, 0, 'l' },
+        { "stats-port", required_argument, 0, 's' },
+        { "lock-wait", required_argument, 0, 'q' },
+        { "lock-queue", required_argument, 0, 'Q' },
+        { "lease", required_argument, 0, 'L' },
+        { "wal", required_argument, 0, 'W' },
+        { "snapshot-every", required_argument, 0, 'S' },
+        { "catalog", required_argument, 0, 'C' },
+        { "io", required_argument, 0, 'I' },
+        { "block-cache", required_argument, 0, 'B' },
+        { "flush-interval", required_argument, 0, 'F' },
+        { "durability", required_argument, 0, 'D' },
+        { 0, 0, 0, 0 }
+    };
+
+    memset(&net_options, 0, sizeof(net_options));
+    net_options.batch_size = 1;
+    net_options.message_capacity = MAX_REQUEST_SIZE;
+    net_options.reply_capacity = BIN_MAX_DATAGRAM;
+    net_options.shard_key_offset = offsetof(request_t, machine);
+    net_options.shard_key_len = sizeof(((request_t*)0)->machine);
+
+    /* Parse options. */
+    log_level_t level = LOG_LEVEL_WARNING;
+    int stats_port = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, 0)) != -1) {
+        switch (opt) {
+        case 'f':
+            fd_cache_capacity = (size_t)atol(optarg);
+            break;
+        case 'b':
+            net_options.batch_size = (size_t)atol(optarg);
+            if (net_options.batch_size < 1 || net_options.batch_size > NET_MAX_BATCH)
+                print_usage(argv[0]);
+            break;
+        case 'w':
+            net_options.batch_wait_us = atol(optarg);
+            break;
+        case 't':
+            server_threads = atoi(optarg);
+            if (server_threads < 1 || server_threads > NET_MAX_THREADS)
+                print_usage(argv[0]);
+            break;
+        case 'l':
+            if (log_parse_level(optarg, &level) < 0)
+                print_usage(argv[0]);
+            break;
+        case 'q':
+            lock_wait_ms = atol(optarg);
+            if (lock_wait_ms < 0)
+                print_usage(argv[0]);
+            break;
+        case 'Q':
+            if (strcmp(optarg, "fifo") == 0)
+                lock_queue_policy = LOCK_QUEUE_FIFO;
+            else if (strcmp(optarg, "fair") == 0)
+                lock_queue_policy = LOCK_QUEUE_FAIR;
+            else
+                print_usage(argv[0]);
+            break;
+        case 'L':
+            lease_ms = atol(optarg);
+            if (lease_ms < 0)
+                print_usage(argv[0]);
+            break;
+        case 'W':
+            wal_directory = optarg;
+            break;
+        case 'S':
+            if (atol(optarg) < 1)
+                print_usage(argv[0]);
+            snapshot_every = (size_t)atol(optarg);
+            break;
+        case 'C':
+            catalog_path = optarg;
+            break;
+        case 'I':
+            io_backend = io_backend_named(optarg);
+            if (!io_backend)
+                print_usage(argv[0]);
+            break;
+        case 'B':
+            block_cache_blocks = (size_t)atol(optarg);
+            break;
+        case 'F':
+            flush_interval_ms = atol(optarg);
+            if (flush_interval_ms < 0)
+                print_usage(argv[0]);
+            break;
+        case 'D':
+            if (strcmp(optarg, "none") == 0)
+                durability = DURABILITY_NONE;
+            else if (strcmp(optarg, "close") == 0)
+                durability = DURABILITY_CLOSE;
+            else if (strcmp(optarg, "fsync") == 0)
+                durability = DURABILITY_FSYNC;
+            else
+                print_usage(argv[0]);
+            break;
+        case 's':
+            stats_port = atoi(optarg);
+            if (stats_port < 1 || stats_port > 65535)
+                print_usage(argv[0]);
+            break;
+        default:
+            print_usage(argv[0]);
+        }
     }
 
-    init();
+    /* Check number of arguments */
+    if (argc - optind != 1)
+        print_usage(argv[0]);
+    char *port_str = argv[optind];
+    /* Only data written through the block cache is synced. */
+    if (durability != DURABILITY_NONE && block_cache_blocks == 0)
+        print_usage(argv[0]);
+    net_options.threads = server_threads;
+    if (lock_wait_ms > 0 || lease_ms > 0 || (block_cache_blocks > 0 && flush_interval_ms > 0))
+        net_options.timer = run_timers;
 
     /* Convert port from string to int. */
-    server_port = (unsigned short)atoi(argv[1]);
-
-    /* Create socket for sending and receiving UDP datagrams. */
-    printf("INFO: Creating UDP socket.\n");
-    if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
-        fail_with_error("FATAL: socket() failed");
-
-    /* Build local address. */
-    memset(&server_address, 0, sizeof(server_address));
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_address.sin_port = htons(server_port);
-
-    /* Bind to the local address. */
-    printf("INFO: Binding UDP socket to port %s.\n", argv[1]);
-    if (bind(sock, (struct sockaddr*) &server_address, sizeof(server_address)) < 0)
-        fail_with_error("FATAL: bind() failed");
-
-    struct sockaddr_in client_address;
-    unsigned int client_addr_len = (unsigned int)sizeof(client_address);
-
-    printf("INFO: Listening for requests on port %s.\n", argv[1]);
-    for (;;) { /* Loop forever */
-        ssize_t message_size;
-
-        /* Block until a message is received. */
-        if ((message_size = recvfrom(sock, recv_buffer, sizeof(recv_buffer), 0,
-            (struct sockaddr*) &client_address, &client_addr_len)) < 0)
-            fail_with_error("FATAL: recvfrom() failed");
-
-        /* Located in a statically allocated buffer, so no need to free. */
-        char* client_ip_str = inet_ntoa(client_address.sin_addr);
-
-        /* Print log messages. */
-        if (message_size != sizeof(request_t)) {
-            /* Received message is invalid. Print a message then ignore and return to listening. */
-            printf("ERROR: Invalid request from %s (invalid size).\n", client_ip_str);
-        } else {
-            printf("INFO: Handling request from %s.\n", client_ip_str);
-
-            /* Handle request */
-            response_t *response = handle_request((request_t*) &recv_buffer);
-            if (response) {
-                if (sendto(sock, response, sizeof(response_t), 0,
-                    (struct sockaddr *) &client_address, sizeof(client_address)) != sizeof(response_t))
-                    fail_with_error("FATAL: sendto() sent a different number of bytes than expected");
-                printf("    INFO: Sent response to %s.\n", client_ip_str);
-            }
-        }
+    server_port = (unsigned short)atoi(port_str);
+
+    /* Start the background log writer. */
+    log_init(level);
+
+    /* Map the file catalog. */
+    if (catalog_path && catalog_open(&file_catalog, catalog_path) < 0)
+        fail_with_error("FATAL: cannot use the file catalog");
+
+    /* Read back the state logged by an earlier run. Each worker replays
+    its part in init(), and commits its log before sending replies. */
+    if (wal_directory) {
+        if (wal_load(wal_directory, server_threads, net_shard_of, snapshot_every) < 0)
+            fail_with_error("FATAL: cannot use the log directory");
+        net_options.commit = commit_batch;
     }
+    /* Under DURABILITY_FSYNC, the writes of a batch are synced together
+    before any of its replies are sent. */
+    if (block_cache_blocks > 0 && durability == DURABILITY_FSYNC)
+        net_options.commit = commit_batch;
+
+    /* Answer stats scrapes on the loopback address if requested. */
+    if (stats_port)
+        stats_serve((unsigned short)stats_port);
+
+    /* Create one UDP socket per worker, bind them to the local address,
+    and serve requests. Each worker runs init() for its own state. */
+    log_info("Listening for requests on port %s (%d threads, batch size %zu).",
+        port_str, server_threads, net_options.batch_size);
+    net_serve(server_port, &net_options, handle_datagram, init);
 
     /* Never reached */
     return 0;
 }
 #endif
 
-/* Displays an error message and exits the process. */
+/* Displays the command line usage and exits the process. */
+void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [--threads N] [--fd-cache N] [--batch N] [--batch-wait USEC]\n"
+        "       [--log-level error|warning|info|debug] [--stats-port PORT]\n"
+        "       [--lock-wait MS] [--lock-queue fifo|fair] [--lease MS]\n"
+        "       [--wal DIR] [--snapshot-every N] [--catalog FILE] [--io sync|uring]\n"
+        "       [--block-cache N] [--flush-interval MS] [--durability none|close|fsync] PORT\n", program);
+    exit(1);
+}
+
+/* Validates a received datagram and handles the request it carries.
+Binary requests are recognized by their magic number; anything else must
+be a text request_t. Queues the response, in the format of the request,
+if one should be sent. */
+void handle_datagram(char *message, size_t message_size, struct sockaddr_in *from)
+{
+    uint64_t start = stats_now();
+    if (serve_datagram(message, message_size, from, 0) < 0)
+        return;
+    stats_record(HIST_REQUEST, stats_now() - start);
+    stats_count(STAT_REQUESTS);
+
+    /* The request may have let queued opens of other clients through. */
+    run_ready_clients();
+}
+
+/* Decodes a datagram and handles the request it carries. Queues the
+response, in the format of the request, if one should be sent. Returns
+0 if the datagram held a request, -1 if it was invalid. */
+int serve_datagram(char *message, size_t message_size, struct sockaddr_in *from, char deferred)
+{
+    /* Located in a statically allocated buffer, so no need to free. */
+    char *client_ip_str = inet_ntoa(from->sin_addr);
+    request_header_t header;
+    op_t op;
+
+    char binary = is_binary_request(message, message_size);
+    if (binary) {
+        if (decode_binary_request(message, message_size, &header, &op) < 0) {
+            log_error("Invalid binary request from %s.", client_ip_str);
+            return -1;
+        }
+    } else if (message_size != sizeof(request_t)) {
+        /* Received message is invalid. Print a message then ignore and return to listening. */
+        log_error("Invalid request from %s (invalid size).", client_ip_str);
+        return -1;
+    } else if (decode_text_request((request_t*)message, &header, &op) < 0) {
+        log_error("Invalid request from %s (invalid machine name).", client_ip_str);
+        return -1;
+    }
+
+    log_info("Handling request from %s.", client_ip_str);
+
+    /* Handle request */
+    header.from = from;
+    header.message = message;
+    header.message_size = message_size;
+    header.deferred = deferred;
+    response_t *response = handle_request(&header, &op);
+    if (response) {
+        send_response(&header, &op, response, binary, from);
+        log_info("Sending response to %s.", client_ip_str);
+    }
+    return 0;
+}
+
+/* Displays an error message and exits the process. Queued log messages
+are written first so they appear before the error. */
 void fail_with_error(const char* msg)
 {
+    int error = errno;
+    log_drain();
+    errno = error;
     perror(msg);
     exit(1);
 }
 
-/* Performs application-logic specific initialization. */
+/* Reports an inconsistency in the server's data structures and exits
+the process. */
+void fail_with_inconsistency(const char *file, int line)
+{
+    log_drain();
+    fprintf(stderr, "FATAL: Internal data structure inconsistency (%s:%d).\n", file, line);
+    exit(1);
+}
+
+/* Performs application-logic specific initialization of the calling
+worker's state. */
 void init()
 {
+    /* Give this worker its own counters and histograms. */
+    stats_register_thread();
+
     /* Initialize data structures */
     list_init(&client_list);
+    htable_init(&client_table);
     list_init(&file_list);
+    htable_init(&file_table);
+    htable_init(&machine_table);
+    intern_init(&name_table);
+    /* The descriptor budget is split evenly between the workers. */
+    size_t capacity = (fd_cache_capacity ? fd_cache_capacity : FDCACHE_DEFAULT_CAPACITY) / server_threads;
+    fdcache_init(&fd_cache, capacity ? capacity : 1);
+
+    /* Initialize the object pools. */
+    pool_init(&client_pool, sizeof(client_t), 256);
+    pool_init(&file_pool, sizeof(file_entry_t), 256);
+    for (int i = 0; i < RESPONSE_CLASSES; ++i)
+        pool_init(&response_pools[i], sizeof(response_prefix_t) + sizeof(response_t) +
+            response_class_sizes[i], response_class_slabs[i]);
+    pool_init(&waiter_pool, sizeof(lock_waiter_t), 64);
+    expiry_head = expiry_tail = (lock_waiter_t*)0;
+    wheel_init(&lease_wheel, stats_now() / 1000000, LEASE_TICK_MS);
+
+    /* Start the disk I/O backend, and poll for its completions. */
+    pool_init(&io_pool, sizeof(pending_io_t), 64);
+    int io_fd;
+    disk_io = io_backend;
+    if (disk_io->init(IO_DEPTH, complete_io, &io_fd) < 0) {
+        log_warning("The %s I/O backend is not available. Using synchronous I/O.", disk_io->name);
+        disk_io = &io_sync_backend;
+        disk_io->init(IO_DEPTH, complete_io, &io_fd);
+    }
+    if (io_fd >= 0)
+        net_watch(io_fd, reap_io);
+
+    /* The block cache is split evenly between the workers like the
+    descriptor cache. */
+    if (block_cache_blocks > 0) {
+        size_t blocks = block_cache_blocks / server_threads;
+        if (bcache_init(&block_cache, blocks ? blocks : 1, &disk_blocks,
+            durability == DURABILITY_FSYNC) < 0)
+            fail_with_error("FATAL: cannot allocate the block cache");
+        next_flush = stats_now() / 1000000 + (uint64_t)flush_interval_ms;
+    }
 
-    /* Initialize generic response to invalid requests. */
-    memset(&invalid_req_resp, 0, sizeof(response_t));
-    invalid_req_resp.status = EINVAL;
+    /* Rebuild the worker's clients and locks from the log. Leases start
+    over, so clients get a full lease to come back after a restart. */
+    if (wal_directory) {
+        wal_recover(net_worker_index(), apply_wal_entry, write_snapshot);
+        for (int i = 0, end = client_list.size; i < end; ++i)
+            renew_lease((client_t*)list_at(&client_list, i));
+    }
 }
 
 /* Builds the response to a client request. */
-response_t *handle_request(request_t *request)
+response_t *handle_request(request_header_t *header, op_t *op)
 {
-    client_t *client = retrieve_client(request);
+    client_t *client = retrieve_client(header);
     if (!client)
         return (response_t*)0;
 
-    if ((int)request->incarnation != client->last_incarn) {
-        printf("    WARNING: Client incarnation number has changed.\n");
+    /* Remember where to send replies that are not answers to a request. */
+    if (header->from) {
+        client->address = *header->from;
+        client->binary = header->binary;
+    }
+
+    /* Any traffic from the client shows it is alive. */
+    renew_lease(client);
+
+    if (header->incarnation < client->last_incarn) {
+        /* Sent before the client restarted. */
+        log_warning("Request is from an earlier incarnation. Request ignored.");
+        stats_count(STAT_STALE_REQUESTS);
+        return (response_t*)0;
+    }
+
+    if (header->incarnation > client->last_incarn) {
+        /* The client restarted, so it lost everything it held and numbers
+        its requests from the start again. */
+        log_warning("Client incarnation number has changed.");
+        client->last_incarn = header->incarnation;
+        client->last_request = header->request - 1;
+        forget_responses(client);
         clear_locks(client);
-        client->last_incarn = (int)request->incarnation;
     }
 
     response_t *response;
+    recent_request_t *recent = find_recent(client, header->request);
+
+    if (op->opcode == OP_RESEND) {
+        /* Resending chunks of a streamed read never counts as a new
+        request. */
+        if (recent) {
+            stats_count(STAT_RETRANSMIT_HITS);
+            return recent->response;
+        }
+        log_warning("Resend does not match a recent request.");
+        return (response_t*)0;
+    }
 
-    if (request->request < client->last_request) {
-        /* Request has already been completed. */
-        printf("    WARNING: Request has already been completed.\nRequest ignored.\n");
-        response = (response_t*)0;
-
-    } else if (request->request == client->last_request) {
+    if (recent) {
         /* Request has already been completed but send stored response. */
-        printf("    WARNING: Request has already been completed. Sending stored response.\n");
-        response = client->last_response;
+        log_warning("Request has already been completed. Sending stored response.");
+        stats_count(STAT_RETRANSMIT_HITS);
+        response = recent->response;
+
+    } else if (header->request <= client->last_request - DEDUP_WINDOW) {
+        /* Request is too old to tell whether it has been completed. */
+        log_warning("Request has already been completed. Request ignored.");
+        stats_count(STAT_STALE_REQUESTS);
+        response = (response_t*)0;
 
     } else {
-        /* Request number is higher than previous. This is a new request. */
-        printf("    INFO: Request is new.\n");
+        /* Request has not been performed yet. It is either newer than any
+        before, or arrived out of order within the window. */
+        log_info("Request is new.");
 
         /* Generate a random number to decide between the 3 options. */
         /* FIXME */
@@ -148,141 +508,364 @@ response_t *handle_request(request_t *request)
 
         if (rnd == 0) {
             /* Drop the request. */
-            printf("    INFO: Dropping the request.\n");
-            response = (response_t*)0;
+            log_info("Dropping the request.");
+            return (response_t*)0;
+        }
 
+        if (rnd == 1) {
+            /* Perform the request but drop the response. */
+            log_info("Performing the request but dropping the reply.");
         } else {
-            if (rnd == 1) {
-                /* Perform the request but drop the response. */
-                printf("    INFO: Performing the request but dropping the reply.\n");
-            } else {
-                /* Perform the request. */
-                printf("    INFO: Performing the request.\n");
-            }
-
             /* Perform the request. */
-            response = dispatch_request(request, client);
-            if (client->last_response)
-                free(client->last_response);
-            client->last_response = response;
-
-            if (rnd == 1) {
-                /* Drop reply. */
-                response = (response_t*)0;
-            }
+            log_info("Performing the request.");
+        }
 
+        /* The requests before must be answered first, so that the client
+        sees its requests complete in order. While one waits for locks
+        or for the disk, later ones wait behind it. */
+        if (client->pending_io || client->waiting ||
+            (client->deferred_head && !header->deferred)) {
+            defer_request(client, header);
+            return (response_t*)0;
         }
 
-        /* Set the last request number. */
-        client->last_request = request->request;
+        /* Perform the request. A queued open or a read or write in
+        flight has no response yet, and is answered with the request's
+        number when it finishes. */
+        response = dispatch_request(op, client);
+        renew_lease(client);
+        if (client->waiting)
+            client->waiting->request = header->request;
+        if (client->pending_io)
+            client->pending_io->request = header->request;
+
+        if (header->request > client->last_request)
+            client->last_request = header->request;
+        char is_read = op->opcode == OP_READ || op->opcode == OP_READ_STREAM ||
+            op->opcode == OP_COMPOUND;
+        remember_response(client, header->request, response,
+            is_read && response ? (size_t)response->size : 0);
+
+        if (rnd == 1) {
+            /* Drop reply. */
+            response = (response_t*)0;
+        }
     }
 
     return response;
 }
 
-/* Retrieves the client structure associated with a client or constructs a new one. */
-client_t *retrieve_client(request_t *request)
+/* Clients whose deferred requests can run, in the order they became
+ready. */
+static __thread client_t *ready_head;
+static __thread client_t *ready_tail;
+
+/* Queues a copy of a request until the client's earlier requests have
+been answered. A retransmission of a request already queued, or one
+beyond DEFERRED_MAX, is dropped; the client sends it again. */
+void defer_request(client_t *client, request_header_t *header)
 {
-    char *req_machine = request->machine;
-    int req_id = (int)request->client;
-    client_t *client;
+    for (deferred_request_t *d = client->deferred_head; d; d = d->next) {
+        if (d->request == header->request) {
+            log_warning("Request is already deferred. Request ignored.");
+            return;
+        }
+    }
+    if (!header->message || client->deferred_count >= DEFERRED_MAX) {
+        log_warning("Too many requests are deferred. Request ignored.");
+        return;
+    }
 
-    char found = 0;
-    /* Iterate through all clients in the client table. */
-    for (int i = 0, end = client_list.size; i < end; ++i) {
-        client = (client_t*)list_at(&client_list, i);
+    deferred_request_t *deferred =
+        (deferred_request_t*)malloc(sizeof(deferred_request_t) + header->message_size);
+    if (!deferred)
+        fail_with_error("FATAL: malloc() failed");
+    deferred->next = (deferred_request_t*)0;
+    deferred->request = header->request;
+    deferred->from = *header->from;
+    deferred->size = header->message_size;
+    memcpy(deferred->message, header->message, header->message_size);
+
+    if (client->deferred_tail)
+        client->deferred_tail->next = deferred;
+    else
+        client->deferred_head = deferred;
+    client->deferred_tail = deferred;
+    client->deferred_count = client->deferred_count + 1;
+    log_info("Deferred request %d behind the client's earlier requests.", header->request);
+}
 
-        /* Match on machine name and client number. */
-        if (strcmp(req_machine, client->machine) == 0 && req_id == client->id) {
-            found = 1;
-            printf("    INFO: Found record for machine=\"%s\" and client=%d.\n", req_machine, req_id);
-            break;
+/* Removes the client's oldest deferred request and returns it. */
+static deferred_request_t *pop_deferred(client_t *client)
+{
+    deferred_request_t *deferred = client->deferred_head;
+    client->deferred_head = deferred->next;
+    if (!client->deferred_head)
+        client->deferred_tail = (deferred_request_t*)0;
+    client->deferred_count = client->deferred_count - 1;
+    return deferred;
+}
+
+/* Frees the client's deferred requests without handling them. */
+void drop_deferred(client_t *client)
+{
+    while (client->deferred_head)
+        free(pop_deferred(client));
+}
+
+/* Puts a client whose earlier request has just been answered on the
+worker's ready list. The deferred requests are not handled here, since
+this may be called while another request is being handled, but from
+run_ready_clients() once the worker is between requests. */
+void make_ready(client_t *client)
+{
+    if (client->ready || !client->deferred_head)
+        return;
+    client->ready = 1;
+    client->ready_next = (client_t*)0;
+    if (ready_tail)
+        ready_tail->ready_next = client;
+    else
+        ready_head = client;
+    ready_tail = client;
+}
+
+/* Handles the deferred requests of the clients on the ready list. A
+client whose request waits again keeps the rest queued until that one
+is answered. */
+void run_ready_clients(void)
+{
+    while (ready_head) {
+        client_t *client = ready_head;
+        ready_head = client->ready_next;
+        if (!ready_head)
+            ready_tail = (client_t*)0;
+        client->ready = 0;
+
+        while (client->deferred_head && !client->pending_io && !client->waiting) {
+            deferred_request_t *deferred = pop_deferred(client);
+            serve_datagram(deferred->message, deferred->size, &deferred->from, 1);
+            free(deferred);
+        }
+    }
+}
+
+/* Returns the slot of the client's ring that holds the given request
+number. */
+static recent_request_t *recent_slot(client_t *client, int request)
+{
+    return &client->recent[(unsigned)request % DEDUP_WINDOW];
+}
+
+/* Returns the client's remembered request with the given number, or a
+null pointer if it has not been performed or has left the window. */
+recent_request_t *find_recent(client_t *client, int request)
+{
+    recent_request_t *recent = recent_slot(client, request);
+    if (recent->request != request || request <= client->last_request - DEDUP_WINDOW)
+        return (recent_request_t*)0;
+    return recent;
+}
+
+/* Keeps the streamed reads the client's ring remembers to at most
+RECENT_STREAM_BYTES of data, forgetting the data of the oldest ones
+other than the given request. A retransmit or resend of a forgotten
+stream gets EIO, as after a crash, and the client reads again. */
+static void forget_streams(client_t *client, int keep)
+{
+    for (;;) {
+        size_t bytes = 0;
+        recent_request_t *oldest = (recent_request_t*)0;
+        for (int i = 0; i < DEDUP_WINDOW; ++i) {
+            recent_request_t *recent = &client->recent[i];
+            if (!recent->response || recent->result_len <= BIN_MAX_RESULT)
+                continue;
+            bytes += recent->result_len;
+            if (recent->request != keep && (!oldest || recent->request < oldest->request))
+                oldest = recent;
         }
+        if (bytes <= RECENT_STREAM_BYTES || !oldest)
+            return;
+
+        resp_free(oldest->response);
+        oldest->response = resp_from_status(EIO);
+        oldest->result_len = 0;
+    }
+}
+
+/* Remembers the response to one of the client's requests and logs it.
+The request that shared its slot is DEDUP_WINDOW or more requests
+older, so it has left the window and its response is freed. A response
+to a request that has itself left the window meanwhile is dropped. */
+void remember_response(client_t *client, int request, response_t *response, size_t result_len)
+{
+    if (request <= client->last_request - DEDUP_WINDOW) {
+        resp_free(response);
+        return;
+    }
+
+    recent_request_t *recent = recent_slot(client, request);
+    if (recent->response != response)
+        resp_free(recent->response);
+    recent->request = request;
+    recent->result_len = (uint32_t)result_len;
+    recent->response = response;
+    record_client(client, recent);
+    if (result_len > BIN_MAX_RESULT)
+        forget_streams(client, request);
+}
+
+/* Forgets every remembered request of the client. */
+void forget_responses(client_t *client)
+{
+    for (int i = 0; i < DEDUP_WINDOW; ++i) {
+        resp_free(client->recent[i].response);
+        client->recent[i].response = (response_t*)0;
+        /* A number that cannot match any request the slot could hold. */
+        client->recent[i].request = i + 1;
     }
+}
+
+/* Key used to look up a client in the client table. */
+typedef struct {
+    const char *machine;
+    int id;
+} client_key_t;
+
+/* Matches a client record against a client_key_t. */
+static int match_client(const void *element, const void *key)
+{
+    const client_t *client = (const client_t*)element;
+    const client_key_t *ckey = (const client_key_t*)key;
+    return ckey->id == client->id && strcmp(ckey->machine, client->machine) == 0;
+}
+
+/* Computes the client table hash of a machine name and client number. */
+static uint64_t hash_client(const char *machine, int id)
+{
+    uint64_t hash = htable_hash(machine, strlen(machine), HTABLE_SEED);
+    return htable_hash(&id, sizeof(id), hash);
+}
+
+/* Retrieves the client structure associated with a client or constructs a new one. */
+client_t *retrieve_client(request_header_t *header)
+{
+    const char *req_machine = header->machine;
+    int req_id = header->client;
+    client_t *client;
 
-    if (!found) {
-        client = (client_t*)malloc(sizeof(client_t));
+    /* Look the client up in the client table by machine name and client number. */
+    client_key_t key = { req_machine, req_id };
+    uint64_t hash = hash_client(req_machine, req_id);
+    client = (client_t*)htable_find(&client_table, hash, match_client, &key);
+
+    if (client) {
+        log_info("Found record for machine=\"%s\" and client=%d.", req_machine, req_id);
+    } else {
+        client = (client_t*)pool_alloc(&client_pool);
         /* Check for a null pointer */
         if (!client)
             return 0;
         memset(client, 0, sizeof(client_t));
         strcpy(client->machine, req_machine);
         client->id = req_id;
-        client->last_request = request->request - 1;
-        client->last_incarn = request->incarnation;
-        client->last_response = (response_t*)0;
+        client->last_request = header->request - 1;
+        client->last_incarn = header->incarnation;
+        forget_responses(client);
+        fstate_vec_init(&client->fstates);
+        wheel_timer_init(&client->lease);
+        if (htable_insert(&client_table, hash, client) < 0) {
+            pool_free(&client_pool, client);
+            return 0;
+        }
         list_append(&client_list, client);
-        printf("    INFO: Created new record for machine=\"%s\" and client=%d.\n", req_machine, req_id);
+        log_info("Created new record for machine=\"%s\" and client=%d.", req_machine, req_id);
     }
 
     return client;
 }
 
-/* Removes all locks held by the specified client. */
+/* Removes all locks held by the specified client, and forgets the
+files it had open. */
 /* Called when the incarnation number for client has incremented. */
 void clear_locks(client_t *client)
 {
-    printf("    INFO: Clearing locks held by machine=\"%s\" and client=%d.\n", client->machine, client->id);
-
-    /* Iterate through all files on the system. */
-    for (int i = 0, end = file_list.size; i < end; ++i) {
-        file_entry_t *file = list_at(&file_list, i);
-
-        if (file->lock == LOCK_WRITE) {
-            /* Check if this client is the one holding the write lock on this file. */
-            if (client == file->writeholder) {
-                file->lock = LOCK_UNLOCKED;
-                file->writeholder = (void*)0;
-                printf("    INFO: Cleared write lock on file %s.\n", file->filename);
-            }
-
-        } else if (file->lock == LOCK_READ) {
-            /* Iterate through all clients that have readlocks on the file. */
-            for (int j = 0, endj = file->readholders.size; j < endj; ++j) {
-                client_t *readclient = (client_t*)list_at(&(file->readholders), j);
+    log_info("Clearing locks held by machine=\"%s\" and client=%d.", client->machine, client->id);
 
-                /* Check if the client is the same as the client we are clearing. */
-                if (client == readclient) {
-                    /* Remove the readlock that this client holds. */
-                    list_remove(&(file->readholders), j);
-                    printf("    INFO: Cleared read lock on file %s.\n", file->filename);
-                    break;
-                }
-            }
-
-            /* Check if there are no more read locks remaining. */
-            if (file->readholders.size == 0) {
-                file->lock = LOCK_UNLOCKED;
-            }
+    if (wal_directory) {
+        wal_entry_t entry;
+        init_wal_entry(&entry, WAL_CLEAR, client);
+        wal_append(&entry);
+    }
 
-        }
+    if (client->waiting)
+        cancel_waiter(client);
+    drop_deferred(client);
+
+    /* Every lock a client holds belongs to one of its open files, so only
+    those files need to be visited. */
+    while (client->fstates.size > 0) {
+        file_state_t fstate = *fstate_vec_at(&client->fstates, client->fstates.size - 1);
+        fstate_vec_remove(&client->fstates, client->fstates.size - 1);
+        if (release_lock(fstate.file, client) < 0)
+            fail_with_inconsistency(__FILE__, __LINE__);
+        log_info("Cleared %s lock on file %s.", fstate.mode & LOCK_WRITE ? "write" : "read",
+            fstate.file->filename);
+        grant_waiters(fstate.file);
+        free_readahead(&fstate);
     }
 }
 
-/* Reads the command contained in a request, then calls the appropriate
-function to perform the command. */
-response_t *dispatch_request(request_t *request, client_t *client)
+/* Calls the appropriate function to perform a decoded operation. */
+response_t *dispatch_request(op_t *op, client_t *client)
 {
-    /* Scan the command from the operation string. */
-    char command[20];
-    sscanf(request->operation, "%s", command);
-    printf("    INFO: Requested operation => %s\n", request->operation);
+    log_info("Requested operation => %s %.*s", opcode_name(op->opcode),
+        (int)op->filename_len, op->filename);
 
     response_t *response;
-
-    if (strcmp(command, "open") == 0) {
-        response = perform_open(request, client);
-    } else if (strcmp(command, "close") == 0) {
-        response = perform_close(request, client);
-    } else if (strcmp(command, "read") == 0) {
-        response = perform_read(request, client);
-    } else if (strcmp(command, "write") == 0) {
-        response = perform_write(request, client);
-    } else if (strcmp(command, "lseek") == 0) {
-        response = perform_lseek(request, client);
-    } else {
+    uint64_t start = stats_now();
+
+    switch (op->opcode) {
+    case OP_OPEN:
+        response = perform_open(op, client);
+        stats_record(HIST_OPEN, stats_now() - start);
+        break;
+    case OP_CLOSE:
+        response = perform_close(op, client);
+        stats_record(HIST_CLOSE, stats_now() - start);
+        break;
+    case OP_READ:
+    case OP_READ_STREAM:
+        /* Operations still in flight are timed when they complete. */
+        response = perform_read(op, client);
+        if (!client->pending_io)
+            stats_record(HIST_READ, stats_now() - start);
+        break;
+    case OP_WRITE:
+        response = perform_write(op, client);
+        if (!client->pending_io)
+            stats_record(HIST_WRITE, stats_now() - start);
+        break;
+    case OP_LSEEK:
+        response = perform_lseek(op, client);
+        stats_record(HIST_LSEEK, stats_now() - start);
+        break;
+    case OP_RENEW:
+        /* Every request renews the lease, so there is nothing more to do. */
+        response = resp_from_status(0);
+        break;
+    case OP_LOCK:
+        response = perform_lock(op, client);
+        break;
+    case OP_UNLOCK:
+        response = perform_unlock(op, client);
+        break;
+    case OP_COMPOUND:
+        response = perform_compound(op, client);
+        break;
+    default:
         /* Received an invalid request. */
-        printf("    ERROR: The requested operation is invalid.\n");
+        log_error("The requested operation is invalid.");
         response = resp_from_status(EINVAL);
     }
 
@@ -290,27 +873,24 @@ response_t *dispatch_request(request_t *request, client_t *client)
 }
 
 /* Performs the open operation. */
-response_t *perform_open(request_t *request, client_t* client)
+response_t *perform_open(op_t *op, client_t* client)
 {
-    char filename[24];
-    char strmode[10];
     response_t *response;
 
-    sscanf(request->operation, "%*s %s %s", filename, strmode);
+    file_entry_t *file = find_file(op->filename, op->filename_len, client->machine);
 
-    file_entry_t *file = find_file(filename, request->machine);
+    /* A file created by an earlier run is only known to the catalog. */
+    if (!file && catalog_path && catalog_contains(&file_catalog, client->machine,
+        strlen(client->machine), op->filename, op->filename_len))
+        file = new_file(op->filename, op->filename_len, client->machine);
 
-    /* Parse the string mode to the lock_t value. */
-    lock_t mode;
-    if (strcmp(strmode, "read") == 0) {
-        mode = LOCK_READ;
-    } else if (strcmp(strmode, "write") == 0) {
-        mode = LOCK_WRITE;
-    } else if (strcmp(strmode, "readwrite") == 0) {
-        mode = LOCK_READ | LOCK_WRITE;
-    } else {
+    /* Check the requested mode. */
+    lock_t mode = op->mode;
+    lock_t access = (lock_t)(mode & (LOCK_READ | LOCK_WRITE));
+    const char *strmode = access == LOCK_READ ? "read" : access == LOCK_WRITE ? "write" : "readwrite";
+    if (access == LOCK_UNLOCKED) {
         /* Received an invalid value for the mode argument. */
-        printf("    ERROR: Received invalid value for the mode argument.\n");
+        log_error("Received invalid value for the mode argument.");
         return resp_from_status(EINVAL);
     }
 
@@ -318,257 +898,852 @@ response_t *perform_open(request_t *request, client_t* client)
         /* Verify that this client does not already have this file open. */
         if (check_open(client, file, LOCK_READ | LOCK_WRITE)) {
             /* Can't open the same file again. */
-            printf("    ERROR: Client already has %s open.\n", filename);
+            log_error("Client already has %s open.", file->filename);
             return resp_from_status(EINVAL);
         }
 
-        lock_t lock = file->lock;
-        if (lock == LOCK_UNLOCKED) {
-            /* File is not opened. Open it and add the appropriate lock. */
-            if (mode & LOCK_WRITE) {
-                set_lock(file, client, LOCK_WRITE);
-                add_fstate(client, file, mode, 0);
-            } else {
-                set_lock(file, client, LOCK_READ);
-                add_fstate(client, file, mode, 0);
-            }
-            response = resp_from_status(0);
+        if (file->waiters_head) {
+            /* Opens are already queued for this file, and a new one must
+            not overtake them. */
+            response = (response_t*)0;
 
-        } else if (lock == LOCK_READ) {
-            /* File is already open in read mode. If this request is exclusively for
-            read, this request can be performed. */
-            if (mode == LOCK_READ) {
-                /* Add this client to the list of clients holding a read lock on
-                this file. */
-                set_lock(file, client, LOCK_READ);
-                add_fstate(client, file, LOCK_READ, 0);
-                response = resp_from_status(0);
-
-            } else {
-                /* File cannot be opened in the requested mode (write or readwrite). */
-                response = resp_from_status(EPERM);
-            }
+        } else if (lock_allows(file, mode)) {
+            /* Open the file and add the appropriate lock. */
+            set_lock(file, client, mode);
+            add_fstate(client, file, mode, 0);
+            response = resp_from_status(0);
 
         } else {
-            /* File has a write lock on it. It cannot be opened in read or write by
-            any other client. */
-            response = resp_from_status(EPERM);
+            /* Existing locks prevent opening the file in the requested
+            mode. */
+            response = (response_t*)0;
         }
 
-        if (response->status == 0) {
+        if (response) {
             /* Request was successful. */
-            printf("    INFO: Opened %s in %s mode.\n", filename, strmode);
+            log_info("Opened %s in %s mode.", file->filename, strmode);
+        } else if ((op->flags & OP_FLAG_WAIT) && lock_wait_ms > 0) {
+            /* Wait for the locks to be released. The response is sent
+            when the open is granted or times out. */
+            enqueue_waiter(file, client, mode);
+            log_info("Queued open of %s in %s mode.", file->filename, strmode);
         } else {
-            printf("    ERROR: Existing locks prevent opening %s in %s mode.\n", filename, strmode);
+            log_error("Existing locks prevent opening %s in %s mode.", file->filename, strmode);
+            stats_count(STAT_LOCK_CONFLICTS);
+            response = resp_from_status(EPERM);
         }
 
     } else {
         /* File could not be found. If write mode was request create new file,
         otherwise return error. */
-        if (mode & LOCK_WRITE) {
-            file = new_file(filename, client->machine);
-            set_lock(file, client, LOCK_WRITE);
+        if (op->filename_len == 0 || op->filename_len > MAX_FILENAME_LEN ||
+            memchr(op->filename, '\0', op->filename_len)) {
+            log_error("Invalid filename.");
+            response = resp_from_status(EINVAL);
+
+        } else if (mode & LOCK_WRITE) {
+            file = new_file(op->filename, op->filename_len, client->machine);
+            set_lock(file, client, mode);
             add_fstate(client, file, mode, 0);
 
-            /* Create file on disk by opening then closing the file. */
-            int fd = open_disk_file(file, O_WRONLY | O_CREAT, (mode_t)00644);
-            if (close(fd) < 0)
-                fail_with_error("FATAL: close() failed");
+            /* Create file on disk. The descriptor stays in the cache for
+            the writes that follow. */
+            if (open_disk_file(file, O_CREAT, (mode_t)00644) < 0)
+                fail_with_error("FATAL: open() failed");
+            if (catalog_path && catalog_add(&file_catalog, file->machine, strlen(file->machine),
+                file->filename, op->filename_len) < 0)
+                log_warning("Could not add %s to the file catalog.", file->filename);
 
             response = resp_from_status(0);
-            printf("    INFO: Created new file %s in mode %s.\n", filename, strmode);
+            log_info("Created new file %s in mode %s.", file->filename, strmode);
 
         } else {
             response = resp_from_status(ENOENT);
-            printf("    ERROR: File does not exist and read mode requested.\n");
+            log_error("File does not exist and read mode requested.");
         }
     }
 
     return response;
 }
 
+/* Returns nonzero if the file's locks allow an open in the given mode. A
+write lock is only granted on an unlocked file, and read locks and
+byte-range opens share the file with their own kind. */
+char lock_allows(file_entry_t *file, lock_t mode)
+{
+    if (file->lock == LOCK_UNLOCKED)
+        return 1;
+    if (mode & LOCK_RANGES)
+        return file->lock == LOCK_RANGES;
+    return mode == LOCK_READ && file->lock == LOCK_READ;
+}
+
 /* Adds an opened file record with the given information to the client. */
 void add_fstate(client_t *client, file_entry_t *file, lock_t mode, size_t position)
 {
-    file_state_t *fstate = (file_state_t*)malloc(sizeof(file_state_t));
-    fstate->file = file;
-    fstate->mode = mode;
-    fstate->position = position;
-    list_append(&client->fstates, fstate);
+    file_state_t fstate;
+    memset(&fstate, 0, sizeof(fstate));
+    fstate.file = file;
+    fstate.mode = mode;
+    fstate.position = position;
+    fstate.next_read = position;
+
+    file_state_t *added = fstate_vec_append(&client->fstates, fstate);
+    if (!added)
+        fail_with_error("FATAL: malloc() failed");
+    record_fstate(WAL_OPEN, client, added);
 }
 
-/* Sets the lock on the given file to the specified client. */
+/* Sets the lock an open in the given mode takes on the file to the
+specified client. */
 void set_lock(file_entry_t *file, client_t *client, lock_t mode)
 {
-    if (mode & LOCK_WRITE) {
+    if (mode & LOCK_RANGES) {
+        file->lock = LOCK_RANGES;
+        if (!client_vec_append(&file->readholders, client))
+            fail_with_error("FATAL: malloc() failed");
+    } else if (mode & LOCK_WRITE) {
         file->lock = LOCK_WRITE;
         file->writeholder = client;
     } else {
         file->lock = LOCK_READ;
-        list_append(&file->readholders, client);
+        if (!client_vec_append(&file->readholders, client))
+            fail_with_error("FATAL: malloc() failed");
     }
 }
 
-/* Allocates a new file_entry object and copies the filename and
-machine provided into the object. */
-file_entry_t *new_file(char *filename, char *machine)
-{
-    file_entry_t *file = (file_entry_t*)malloc(sizeof(file_entry_t));
-    strcpy(file->filename, filename);
-    strcpy(file->machine, machine);
-    list_append(&file_list, file);
-    return file;
-}
-
-/* Performs the close operation. */
-response_t *perform_close(request_t *request, client_t *client)
+/* Releases the lock the given client holds on the file, with any of its
+byte-range locks. Returns 0 if successful, -1 if the client holds no
+lock on it. */
+int release_lock(file_entry_t *file, client_t *client)
 {
-    char filename[24];
-    response_t *response;
+    if (file->lock == LOCK_WRITE) {
+        if (file->writeholder != client)
+            return -1;
+        file->writeholder = (client_t*)0;
+        file->lock = LOCK_UNLOCKED;
+        return 0;
+    }
 
-    sscanf(request->operation, "%*s %s", filename);
-    file_entry_t *file = find_file(filename, request->machine);
+    if (file->lock != LOCK_READ && file->lock != LOCK_RANGES)
+        return -1;
 
-    if (file) {
-        if (check_open(client, file, LOCK_READ | LOCK_WRITE)) {
-            /* File exists and client has file open. Operation can be performed.
-            Need to remove fstate from client struct and client from holding a
-            lock on the file. */
-            char found = 0;
-            for (int i = 0, end = client->fstates.size; i < end; ++i) {
-                file_state_t *fstate = (file_state_t*)list_at(&client->fstates, i);
-                if (fstate->file == file) {
-                    list_remove(&client->fstates, i);
-                    found = 1;
-                    break;
-                }
+    for (size_t i = 0, end = file->readholders.size; i < end; ++i) {
+        if (*client_vec_at(&file->readholders, i) == client) {
+            client_vec_remove(&file->readholders, i);
+            if (file->lock == LOCK_RANGES)
+                rangelock_release(&file->range_locks, 0, UINT64_MAX, client);
+            if (file->readholders.size == 0) {
+                /* We just removed the last client holding a read lock on
+                the file. The file is now unlocked. */
+                file->lock = LOCK_UNLOCKED;
             }
+            return 0;
+        }
+    }
 
-            if (!found) {
-                printf("FATAL: Internal data structure inconsistency (%s:%d).\n", __FILE__, __LINE__);
-                exit(1);
-            }
+    return -1;
+}
 
-            /* File must either have a read or write lock since this client
-            has it open. */
-            if (file->lock == LOCK_WRITE) {
-                file->writeholder = (client_t*)0;
-                file->lock = LOCK_UNLOCKED;
+/* Queues an open of the file until its locks allow it. */
+void enqueue_waiter(file_entry_t *file, client_t *client, lock_t mode)
+{
+    lock_waiter_t *waiter = (lock_waiter_t*)pool_alloc(&waiter_pool);
+    if (!waiter)
+        fail_with_error("FATAL: pool_alloc() failed");
+    memset(waiter, 0, sizeof(lock_waiter_t));
+    waiter->client = client;
+    waiter->file = file;
+    waiter->mode = mode;
+    waiter->deadline = stats_now() / 1000000 + (uint64_t)lock_wait_ms;
+
+    waiter->prev = file->waiters_tail;
+    if (file->waiters_tail)
+        file->waiters_tail->next = waiter;
+    else
+        file->waiters_head = waiter;
+    file->waiters_tail = waiter;
 
-            } else {
-                /* File must have a read lock. */
-                found = 0;
-                for (int i = 0, end = file->readholders.size; i < end; ++i) {
-                    client_t *c = (client_t*)list_at(&file->readholders, i);
-                    if (c == client) {
-                        list_remove(&file->readholders, i);
-                        found = 1;
-                        break;
-                    }
-                }
+    waiter->expiry_prev = expiry_tail;
+    if (expiry_tail)
+        expiry_tail->expiry_next = waiter;
+    else
+        expiry_head = waiter;
+    expiry_tail = waiter;
 
-                if (!found) {
-                    printf("FATAL: Internal data structure inconsistency (%s:%d).\n", __FILE__, __LINE__);
-                    exit(1);
-                }
+    client->waiting = waiter;
+    stats_count(STAT_LOCK_WAITS);
+}
 
-                if (file->readholders.size == 0) {
-                    /* We just removed the last client holding a read lock on the file.
-                    The file is now unlocked. */
-                    file->lock = LOCK_UNLOCKED;
-                }
-            }
+/* Unlinks a waiter from its file's queue and the expiry list, and frees it. */
+static void remove_waiter(lock_waiter_t *waiter)
+{
+    file_entry_t *file = waiter->file;
 
-            response = resp_from_status(0);
-            printf("Closed %s.\n", file->filename);
+    if (waiter->prev)
+        waiter->prev->next = waiter->next;
+    else
+        file->waiters_head = waiter->next;
+    if (waiter->next)
+        waiter->next->prev = waiter->prev;
+    else
+        file->waiters_tail = waiter->prev;
 
-        } else {
-            /* File exists but client does not have file open. */
-            printf("    ERROR: File exists but not opened by client.\n");
-            response = resp_from_status(EINVAL);
-        }
-    } else {
-        /* File does not exist. */
-        printf("    ERROR: File does not exist.\n");
-        response = resp_from_status(ENOENT);
-    }
+    if (waiter->expiry_prev)
+        waiter->expiry_prev->expiry_next = waiter->expiry_next;
+    else
+        expiry_head = waiter->expiry_next;
+    if (waiter->expiry_next)
+        waiter->expiry_next->expiry_prev = waiter->expiry_prev;
+    else
+        expiry_tail = waiter->expiry_prev;
 
-    return response;
+    waiter->client->waiting = (lock_waiter_t*)0;
+    pool_free(&waiter_pool, waiter);
 }
 
-/* Performs the read operation. */
-response_t *perform_read(request_t *request, client_t *client)
+/* Sends the client the response to one of its requests, outside of a
+request. */
+static void send_recent_response(client_t *client, recent_request_t *recent, opcode_t opcode)
 {
-    char filename[24];
-    int numbytes;
-    response_t *response;
+    request_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.machine = client->machine;
+    header.client = client->id;
+    header.request = recent->request;
+    header.incarnation = client->last_incarn;
+
+    op_t op;
+    memset(&op, 0, sizeof(op));
+    op.opcode = opcode;
+
+    send_response(&header, &op, recent->response, client->binary, &client->address);
+}
 
-    sscanf(request->operation, "%*s %s %d", filename, &numbytes);
-    file_entry_t *file = find_file(filename, request->machine);
+/* Answers a client's queued open, which was the given request, with the
+given status. The response is remembered, so a retransmitted open gets
+it too. */
+static void answer_waiter(client_t *client, int request, int status)
+{
+    remember_response(client, request, resp_from_status(status), 0);
+    recent_request_t *recent = find_recent(client, request);
+    if (recent)
+        send_recent_response(client, recent, OP_OPEN);
+    make_ready(client);
+}
 
-    if (!file) {
-        /* File does not exist. */
-        printf("    ERROR: File does not exist.\n");
-        return resp_from_status(EINVAL);
-    }
+/* Grants a queued open: takes the lock, opens the file for the client,
+and tells the client. */
+static void grant_waiter(lock_waiter_t *waiter)
+{
+    client_t *client = waiter->client;
+    file_entry_t *file = waiter->file;
+    lock_t mode = waiter->mode;
+    int request = waiter->request;
+
+    remove_waiter(waiter);
+    set_lock(file, client, mode);
+    add_fstate(client, file, mode, 0);
+    renew_lease(client);
+    log_info("Granted queued open of %s to machine=\"%s\" and client=%d.",
+        file->filename, client->machine, client->id);
+    answer_waiter(client, request, 0);
+}
 
-    /* Check that the client has the file open in the correct
-    mode. */
-    if (!check_open(client, file, LOCK_READ)) {
-        /* File exists but not opened by client (or not in right mode). */
-        printf("    ERROR: Client does not have file open in correct mode.\n");
-        return resp_from_status(EINVAL);
-    }
+/* Grants queued opens on the file that its locks now allow. Writers are
+granted alone; readers are granted together, either the run of readers
+at the head of the queue or, under LOCK_QUEUE_FAIR, every queued
+reader, and byte-range opens likewise with their own kind. */
+void grant_waiters(file_entry_t *file)
+{
+    lock_waiter_t *waiter = file->waiters_head;
+    if (!waiter || !lock_allows(file, waiter->mode))
+        return;
 
-    /* Check if number of bytes to be read is valid. */
-    if (numbytes <= 0 || numbytes > 80) {
-        printf("    ERROR: Invalid number of bytes to read (%d).\n", numbytes);
-        return resp_from_status(EINVAL);
+    if (!(waiter->mode & LOCK_RANGES) && (waiter->mode & LOCK_WRITE)) {
+        grant_waiter(waiter);
+        return;
     }
-    /* Everything is correct, we can perform the read.
-    mode argument is not needed. */
-    int fd = open_disk_file(file, O_RDONLY, 0);
-    
-    file_state_t *fstate = find_fstate(client, file);
-    if (fstate->position != 0)
-        lseek(fd, fstate->position, SEEK_SET);
 
-    response = resp_from_status(0);
-    size_t size = read(fd, &response->result, numbytes);
-    if (size < 0) {
-        response->status = errno;
-        response->size = 0;
-    } else {
-        response->size = size;
+    while (waiter) {
+        lock_waiter_t *next = waiter->next;
+        if (lock_allows(file, waiter->mode))
+            grant_waiter(waiter);
+        else if (lock_queue_policy == LOCK_QUEUE_FIFO)
+            break;
+        waiter = next;
     }
+}
 
-    size_t position = lseek(fd, 0, SEEK_CUR);
-    if (position < 0)
-        fail_with_error("FATAL: lseek() failed");
-
-    fstate->position = position;
+/* Withdraws the client's queued open. Openers queued behind it may now
+be grantable. */
+void cancel_waiter(client_t *client)
+{
+    file_entry_t *file = client->waiting->file;
+    remove_waiter(client->waiting);
+    grant_waiters(file);
+}
 
-    if (close(fd) < 0)
-        fail_with_error("FATAL: close() failed");
+/* Fails queued opens whose deadline has passed with ETIMEDOUT. Returns
+the milliseconds until the next deadline, or -1 if nothing is queued. */
+long expire_waiters(void)
+{
+    uint64_t now = stats_now() / 1000000;
+
+    while (expiry_head && expiry_head->deadline <= now) {
+        lock_waiter_t *waiter = expiry_head;
+        client_t *client = waiter->client;
+        file_entry_t *file = waiter->file;
+        int request = waiter->request;
+
+        log_info("Queued open of %s by machine=\"%s\" and client=%d timed out.",
+            file->filename, client->machine, client->id);
+        remove_waiter(waiter);
+        stats_count(STAT_LOCK_WAIT_TIMEOUTS);
+        answer_waiter(client, request, ETIMEDOUT);
+        grant_waiters(file);
+    }
 
-    printf("    INFO: Performed read.\n");
-    return response;
+    return expiry_head ? (long)(expiry_head->deadline - now) : -1;
 }
 
-/* Performs the write operation. */
-response_t *perform_write(request_t *request, client_t *client)
+/* Extends the client's lease if it holds locks or waits for them, or
+drops it if not, so that only clients with something to lose are
+tracked. */
+void renew_lease(client_t *client)
 {
-    char filename[24];
-    char data[80];
-    memset(data, 0, sizeof(data));
-    response_t *response;
+    if (lease_ms <= 0)
+        return;
 
-    sscanf(request->operation, "%*s %s %80c", filename, data);
-    file_entry_t *file = find_file(filename, request->machine);
+    if (client->fstates.size > 0 || client->waiting)
+        wheel_schedule(&lease_wheel, &client->lease, stats_now() / 1000000 + (uint64_t)lease_ms);
+    else
+        wheel_cancel(&lease_wheel, &client->lease);
+}
+
+/* Releases the locks of a client whose lease ran out. */
+static void expire_lease(wheel_timer_t *timer, void *arg)
+{
+    client_t *client = (client_t*)((char*)timer - offsetof(client_t, lease));
+
+    log_warning("Lease of machine=\"%s\" and client=%d expired. Releasing its locks.",
+        client->machine, client->id);
+    stats_count(STAT_LEASE_EXPIRIES);
+    clear_locks(client);
+}
+
+/* Runs the worker's due timers: queued open deadlines, lease expiry and
+writing back the block cache, then the deferred requests of clients
+these answered. Returns the milliseconds until it must be called again,
+or -1 if nothing is scheduled. */
+long run_timers(void)
+{
+    long wait = -1;
+
+    if (lock_wait_ms > 0)
+        wait = expire_waiters();
+
+    if (lease_ms > 0) {
+        uint64_t now = stats_now() / 1000000;
+        wheel_advance(&lease_wheel, now, expire_lease, (void*)0);
+        long lease_wait = wheel_next_ms(&lease_wheel, now);
+        if (lease_wait >= 0 && (wait < 0 || lease_wait < wait))
+            wait = lease_wait;
+    }
+
+    if (block_cache_blocks > 0 && flush_interval_ms > 0) {
+        uint64_t now = stats_now() / 1000000;
+        if (now >= next_flush) {
+            if (bcache_flush(&block_cache, 0) < 0)
+                log_error("Could not write back cached blocks: %s", strerror(errno));
+            next_flush = now + (uint64_t)flush_interval_ms;
+        }
+        long flush_wait = (long)(next_flush - now);
+        if (wait < 0 || flush_wait < wait)
+            wait = flush_wait;
+    }
+
+    run_ready_clients();
+    return wait;
+}
+
+/* Makes the changes of a batch of requests durable before their replies
+are sent: syncs the files written through the block cache under
+DURABILITY_FSYNC, then commits the write-ahead log. */
+void commit_batch(void)
+{
+    if (block_cache_blocks > 0 && durability == DURABILITY_FSYNC &&
+        bcache_flush(&block_cache, 1) < 0)
+        log_error("Could not sync written files: %s", strerror(errno));
+
+    if (wal_directory)
+        wal_commit();
+}
+
+/* Fills in a log entry about the client. */
+void init_wal_entry(wal_entry_t *entry, wal_type_t type, client_t *client)
+{
+    memset(entry, 0, sizeof(wal_entry_t));
+    entry->type = type;
+    entry->machine = client->machine;
+    entry->machine_len = strlen(client->machine);
+    entry->client = client->id;
+    entry->request = client->last_request;
+    entry->incarnation = client->last_incarn;
+}
+
+/* Logs a new file. */
+void record_file(file_entry_t *file)
+{
+    if (!wal_directory)
+        return;
+
+    wal_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.type = WAL_FILE;
+    entry.machine = file->machine;
+    entry.machine_len = strlen(file->machine);
+    entry.filename = file->filename;
+    entry.filename_len = strlen(file->filename);
+    wal_append(&entry);
+}
+
+/* Logs one of the client's requests with its response, or with status
+-1 if it has none yet. */
+void record_client(client_t *client, recent_request_t *recent)
+{
+    if (!wal_directory)
+        return;
+
+    wal_entry_t entry;
+    init_wal_entry(&entry, WAL_CLIENT, client);
+    entry.request = recent->request;
+    response_t *response = recent->response;
+    if (!response) {
+        entry.status = -1;
+    } else if (recent->result_len > BIN_MAX_RESULT) {
+        /* Logging a streamed read would write all of its data again, so
+        after a crash a retransmitted one gets EIO and the client reads
+        again. */
+        entry.status = EIO;
+    } else {
+        entry.status = response->status;
+        entry.value = response->size;
+        entry.data = response->result;
+        entry.data_len = recent->result_len;
+    }
+    wal_append(&entry);
+}
+
+/* Logs the state of one of the client's open files. */
+void record_fstate(wal_type_t type, client_t *client, file_state_t *fstate)
+{
+    if (!wal_directory)
+        return;
+
+    wal_entry_t entry;
+    init_wal_entry(&entry, type, client);
+    entry.filename = fstate->file->filename;
+    entry.filename_len = strlen(fstate->file->filename);
+    entry.mode = fstate->mode;
+    entry.value = (int64_t)fstate->position;
+    wal_append(&entry);
+}
+
+/* Logs a byte-range lock the client took on [start, end) in the given
+mode, or with WAL_UNLOCK, its release of the range. */
+void record_range(wal_type_t type, client_t *client, file_entry_t *file, uint64_t start,
+    uint64_t end, lock_t mode)
+{
+    if (!wal_directory)
+        return;
+
+    wal_entry_t entry;
+    init_wal_entry(&entry, type, client);
+    entry.filename = file->filename;
+    entry.filename_len = strlen(file->filename);
+    entry.mode = mode;
+    entry.value = (int64_t)start;
+    entry.data = (const char*)&end;
+    entry.data_len = sizeof(end);
+    wal_append(&entry);
+}
+
+/* Applies a logged state change to the calling worker's state. An entry
+may be applied to state that already includes it, since a snapshot and
+the log written after it can overlap, so every change is applied as
+setting a value rather than as a step from the previous one. */
+void apply_wal_entry(const wal_entry_t *entry)
+{
+    char machine[sizeof(((client_t*)0)->machine)];
+    if (entry->machine_len == 0 || entry->machine_len >= sizeof(machine))
+        return;
+    memcpy(machine, entry->machine, entry->machine_len);
+    machine[entry->machine_len] = '\0';
+
+    file_entry_t *file = (file_entry_t*)0;
+    if (entry->filename_len > 0) {
+        file = find_file(entry->filename, entry->filename_len, machine);
+        if (!file)
+            file = new_file(entry->filename, entry->filename_len, machine);
+    }
+    if (entry->type == WAL_FILE)
+        return;
+
+    request_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.machine = machine;
+    header.client = entry->client;
+    header.request = entry->request;
+    header.incarnation = entry->incarnation;
+    client_t *client = retrieve_client(&header);
+    if (!client)
+        fail_with_error("FATAL: malloc() failed");
+    file_state_t *fstate = file ? find_fstate(client, file) : (file_state_t*)0;
+
+    switch (entry->type) {
+    case WAL_CLIENT: {
+        response_t *response = (response_t*)0;
+        if (entry->status >= 0) {
+            response = resp_with_capacity(entry->status, entry->data_len);
+            if (!response)
+                fail_with_error("FATAL: malloc() failed");
+            response->size = (int32_t)entry->value;
+            memcpy(response->result, entry->data, entry->data_len);
+        }
+        client->last_incarn = entry->incarnation;
+        if (entry->request > client->last_request)
+            client->last_request = entry->request;
+        remember_response(client, entry->request, response, entry->data_len);
+        break;
+    }
+    case WAL_OPEN:
+        if (fstate) {
+            fstate->position = (size_t)entry->value;
+        } else if (file) {
+            lock_t mode = (lock_t)entry->mode;
+            set_lock(file, client, mode);
+            add_fstate(client, file, mode, (size_t)entry->value);
+        }
+        break;
+    case WAL_CLOSE:
+        if (fstate) {
+            free_readahead(fstate);
+            fstate_vec_remove(&client->fstates, fstate - fstate_vec_at(&client->fstates, 0));
+            if (release_lock(file, client) < 0)
+                fail_with_inconsistency(__FILE__, __LINE__);
+        }
+        break;
+    case WAL_POSITION:
+        if (fstate)
+            fstate->position = (size_t)entry->value;
+        break;
+    case WAL_LOCK:
+    case WAL_UNLOCK: {
+        uint64_t end;
+        if (!fstate || entry->data_len != sizeof(end))
+            break;
+        memcpy(&end, entry->data, sizeof(end));
+        if (entry->type == WAL_UNLOCK ?
+            rangelock_release(&file->range_locks, (uint64_t)entry->value, end, client) < 0 :
+            rangelock_set(&file->range_locks, (uint64_t)entry->value, end, client,
+            entry->mode == LOCK_WRITE) < 0)
+            fail_with_error("FATAL: malloc() failed");
+        break;
+    }
+    case WAL_CLEAR:
+        /* A restarted client's numbers start over, which a client that
+        lost its lease keeps its own. */
+        if (entry->incarnation > client->last_incarn) {
+            client->last_incarn = entry->incarnation;
+            client->last_request = entry->request;
+            forget_responses(client);
+        }
+        clear_locks(client);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Logs the requests a client remembers, oldest first, so that the
+newest sets its highest request number. A client that remembers none
+is logged as its highest request without a response. */
+static void record_recent(client_t *client)
+{
+    char recorded = 0;
+    for (int request = client->last_request - DEDUP_WINDOW + 1;
+        request <= client->last_request; ++request) {
+        recent_request_t *recent = find_recent(client, request);
+        if (recent) {
+            record_client(client, recent);
+            recorded = 1;
+        }
+    }
+    if (!recorded) {
+        recent_request_t none = { client->last_request, 0, (response_t*)0 };
+        record_client(client, &none);
+    }
+}
+
+/* Logs one byte-range lock of the file passed as arg. */
+static void record_range_lock(const rangelock_t *lock, void *arg)
+{
+    record_range(WAL_LOCK, (client_t*)lock->owner, (file_entry_t*)arg, lock->start, lock->end,
+        lock->write ? LOCK_WRITE : LOCK_READ);
+}
+
+/* Logs the calling worker's whole state: every file, then every client
+with the requests it remembers and the files it has open, then the
+byte-range locks on those files. */
+void write_snapshot(void)
+{
+    for (int i = 0, end = file_list.size; i < end; ++i)
+        record_file((file_entry_t*)list_at(&file_list, i));
+
+    for (int i = 0, end = client_list.size; i < end; ++i) {
+        client_t *client = (client_t*)list_at(&client_list, i);
+        record_recent(client);
+        for (int j = 0, fend = client->fstates.size; j < fend; ++j)
+            record_fstate(WAL_OPEN, client, fstate_vec_at(&client->fstates, j));
+    }
+
+    for (int i = 0, end = file_list.size; i < end; ++i) {
+        file_entry_t *file = (file_entry_t*)list_at(&file_list, i);
+        rangelock_each(&file->range_locks, record_range_lock, file);
+    }
+}
+
+/* Key used to look up a file in the file table. Both names are interned,
+so the key is hashed and compared by address. */
+typedef struct {
+    const char *machine;
+    const char *filename;
+} file_key_t;
+
+/* All files belonging to one machine, sorted by filename so that files
+sharing a name prefix are contiguous. */
+typedef struct {
+    const char *machine;
+    list_t files;
+} machine_files_t;
+
+/* Matches a file entry against a file_key_t. */
+static int match_file(const void *element, const void *key)
+{
+    const file_entry_t *file = (const file_entry_t*)element;
+    const file_key_t *fkey = (const file_key_t*)key;
+    return file->machine == fkey->machine && file->filename == fkey->filename;
+}
+
+/* Computes the file table hash of a pair of interned names. */
+static uint64_t hash_file_key(const file_key_t *key)
+{
+    return htable_hash(key, sizeof(file_key_t), HTABLE_SEED);
+}
+
+/* Matches a machine_files_t against an interned machine name. */
+static int match_machine_files(const void *element, const void *key)
+{
+    return ((const machine_files_t*)element)->machine == (const char*)key;
+}
+
+/* Finds the file list of the given interned machine name, creating an
+empty one if create is set. */
+static machine_files_t *find_machine_files(const char *machine, char create)
+{
+    uint64_t hash = htable_hash(&machine, sizeof(machine), HTABLE_SEED);
+    machine_files_t *mfiles = (machine_files_t*)htable_find(&machine_table, hash,
+        match_machine_files, machine);
+    if (mfiles || !create)
+        return mfiles;
+
+    mfiles = (machine_files_t*)malloc(sizeof(machine_files_t));
+    if (!mfiles)
+        return (machine_files_t*)0;
+    mfiles->machine = machine;
+    list_init(&mfiles->files);
+    if (htable_insert(&machine_table, hash, mfiles) < 0) {
+        free(mfiles);
+        return (machine_files_t*)0;
+    }
+    return mfiles;
+}
+
+/* Returns the index of the first file in the machine's list whose name
+does not sort before the given name. */
+static size_t machine_files_lower_bound(machine_files_t *mfiles, const char *filename)
+{
+    size_t low = 0, high = mfiles->files.size;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        file_entry_t *file = (file_entry_t*)list_at(&mfiles->files, mid);
+        if (strcmp(file->filename, filename) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+/* Allocates a new file_entry object and copies the filename and
+machine provided into the object. */
+file_entry_t *new_file(const char *filename, size_t filename_len, const char *machine)
+{
+    const char *iname = intern(&name_table, filename, filename_len);
+    const char *imachine = intern(&name_table, machine, strlen(machine));
+    if (!iname || !imachine)
+        fail_with_error("FATAL: intern() failed");
+
+    machine_files_t *mfiles = find_machine_files(imachine, 1);
+    file_entry_t *file = (file_entry_t*)pool_alloc(&file_pool);
+    if (!mfiles || !file)
+        fail_with_error("FATAL: malloc() failed");
+    memset(file, 0, sizeof(file_entry_t));
+    client_vec_init(&file->readholders);
+    rangelock_tree_init(&file->range_locks);
+    fdcache_entry_init(&file->cached_fd);
+    bcache_file_init(&file->cached_blocks);
+    file->filename = iname;
+    file->machine = imachine;
+
+    /* Index the file by name, and by machine in filename order. */
+    file_key_t key = { imachine, iname };
+    if (htable_insert(&file_table, hash_file_key(&key), file) < 0 ||
+        list_insert(&mfiles->files, machine_files_lower_bound(mfiles, iname), file) < 0)
+        fail_with_error("FATAL: malloc() failed");
+
+    list_append(&file_list, file);
+    record_file(file);
+    return file;
+}
+
+/* Performs the close operation. */
+response_t *perform_close(op_t *op, client_t *client)
+{
+    response_t *response;
+
+    file_entry_t *file = find_file(op->filename, op->filename_len, client->machine);
+
+    if (file) {
+        if (check_open(client, file, LOCK_READ | LOCK_WRITE)) {
+            /* File exists and client has file open. Operation can be performed.
+            Need to remove fstate from client struct and client from holding a
+            lock on the file. */
+            char found = 0;
+            for (int i = 0, end = client->fstates.size; i < end; ++i) {
+                file_state_t *fstate = fstate_vec_at(&client->fstates, i);
+                if (fstate->file == file) {
+                    record_fstate(WAL_CLOSE, client, fstate);
+                    free_readahead(fstate);
+                    fstate_vec_remove(&client->fstates, i);
+                    found = 1;
+                    break;
+                }
+            }
+
+            if (!found) {
+                fail_with_inconsistency(__FILE__, __LINE__);
+            }
+
+            /* File must either have a read or write lock since this client
+            has it open. */
+            if (release_lock(file, client) < 0) {
+                fail_with_inconsistency(__FILE__, __LINE__);
+            }
+            grant_waiters(file);
+
+            response = resp_from_status(0);
+            if (block_cache_blocks > 0 && bcache_flush_file(&block_cache, &file->cached_blocks,
+                durability != DURABILITY_NONE) < 0) {
+                log_error("Could not write back %s: %s", file->filename, strerror(errno));
+                response->status = errno;
+            }
+            log_info("Closed %s.", file->filename);
+
+        } else {
+            /* File exists but client does not have file open. */
+            log_error("File exists but not opened by client.");
+            response = resp_from_status(EINVAL);
+        }
+    } else {
+        /* File does not exist. */
+        log_error("File does not exist.");
+        response = resp_from_status(ENOENT);
+    }
+
+    return response;
+}
+
+/* Performs the read operation. */
+response_t *perform_read(op_t *op, client_t *client)
+{
+    int64_t numbytes = op->length;
+    response_t *response;
+
+    file_entry_t *file = find_file(op->filename, op->filename_len, client->machine);
 
     if (!file) {
         /* File does not exist. */
-        printf("    ERROR: File does not exist.\n");
+        log_error("File does not exist.");
+        return resp_from_status(EINVAL);
+    }
+
+    /* Check that the client has the file open in the correct
+    mode. */
+    if (!check_open(client, file, LOCK_READ)) {
+        /* File exists but not opened by client (or not in right mode). */
+        log_error("Client does not have file open in correct mode.");
+        return resp_from_status(EINVAL);
+    }
+
+    /* Check if number of bytes to be read is valid. */
+    if (numbytes <= 0 || numbytes > op->max_result) {
+        log_error("Invalid number of bytes to read (%lld).", (long long)numbytes);
+        return resp_from_status(EINVAL);
+    }
+    /* Everything is correct, we can perform the read at the client's
+    position. mode argument is not needed. */
+    int fd = open_disk_file(file, 0, 0);
+    if (fd < 0) {
+        log_error("Could not open %s on disk.", file->filename);
+        return resp_from_status(errno);
+    }
+
+    file_state_t *fstate = find_fstate(client, file);
+    if (!check_range(client, fstate, (size_t)numbytes, 0)) {
+        log_error("Byte-range locks of other clients prevent the read.");
+        return resp_from_status(EAGAIN);
+    }
+
+    response = resp_with_capacity(0, (size_t)numbytes);
+    if (!response)
+        return resp_from_status(ENOMEM);
+
+    log_info("Performing read.");
+    if (block_cache_blocks > 0) {
+        if (numbytes <= CACHED_IO_MAX)
+            return perform_cached_io(op, client, fstate, response, (const char*)0, (size_t)numbytes);
+        if (bcache_flush_file(&block_cache, &file->cached_blocks, 0) < 0) {
+            response->status = errno;
+            return response;
+        }
+    }
+    if (serve_readahead(client, fstate, fd, response, (size_t)numbytes))
+        return response;
+    return submit_io(op, client, fstate, fd, response, (const char*)0, (size_t)numbytes);
+}
+
+/* Performs the write operation. */
+response_t *perform_write(op_t *op, client_t *client)
+{
+    response_t *response;
+
+    file_entry_t *file = find_file(op->filename, op->filename_len, client->machine);
+
+    if (!file) {
+        /* File does not exist. */
+        log_error("File does not exist.");
         return resp_from_status(EINVAL);
     }
 
@@ -576,52 +1751,425 @@ response_t *perform_write(request_t *request, client_t *client)
     mode. */
     if (!check_open(client, file, LOCK_WRITE)) {
         /* File exists but not opened by client (or not in right mode). */
-        printf("    ERROR: Client does not have file open in correct mode.\n");
+        log_error("Client does not have file open in correct mode.");
         return resp_from_status(EINVAL);
     }
 
-    /* Everything is correct, we can perform the write.
-    mode argument is not needed. */
-    int fd = open_disk_file(file, O_WRONLY, 0);
-    
+    /* Everything is correct, we can perform the write at the client's
+    position. mode argument is not needed. */
+    int fd = open_disk_file(file, 0, 0);
+    if (fd < 0) {
+        log_error("Could not open %s on disk.", file->filename);
+        return resp_from_status(errno);
+    }
+
     file_state_t *fstate = find_fstate(client, file);
-    if (fstate->position != 0)
-        lseek(fd, fstate->position, SEEK_SET);
+    if (!check_range(client, fstate, (size_t)op->length, 1)) {
+        log_error("Byte-range locks of other clients prevent the write.");
+        return resp_from_status(EAGAIN);
+    }
 
     response = resp_from_status(0);
-    size_t size = write(fd, data, strlen(data));
-    if (size < 0) {
+    cancel_readahead(fstate);
+
+    log_info("Performing write.");
+    if (block_cache_blocks > 0) {
+        if (op->length <= CACHED_IO_MAX)
+            return perform_cached_io(op, client, fstate, response, op->data, (size_t)op->length);
+        if (bcache_drop_file(&block_cache, &file->cached_blocks) < 0) {
+            response->status = errno;
+            return response;
+        }
+    }
+    return submit_io(op, client, fstate, fd, response, op->data, (size_t)op->length);
+}
+
+/* Reads or writes a client's open file at its position in the block
+cache, which reaches the disk itself for blocks it is missing. */
+static response_t *access_cache(client_t *client, file_state_t *fstate, response_t *response,
+    const char *data, size_t len)
+{
+    bcache_file_t *blocks = &fstate->file->cached_blocks;
+    off_t offset = (off_t)fstate->position;
+    ssize_t n = data ? bcache_write(&block_cache, blocks, data, len, offset) :
+        bcache_read(&block_cache, blocks, response->result, len, offset);
+
+    if (n < 0) {
         response->status = errno;
         response->size = 0;
     } else {
-        response->size = size;
+        response->size = (int32_t)n;
+        fstate->position = (size_t)offset + (size_t)n;
+        record_fstate(WAL_POSITION, client, fstate);
+    }
+    return response;
+}
+
+/* Applies the result of a finished disk operation to its response and
+to the client's position in the file. */
+static void finish_io(pending_io_t *pending)
+{
+    io_request_t *io = &pending->io;
+    response_t *response = pending->response;
+
+    if (pending->cached) {
+        /* Whatever the read missed is read again by the cache. */
+        bcache_file_t *blocks = &pending->file->cached_blocks;
+        if (io->result > 0)
+            bcache_fill(&block_cache, blocks, pending->data, (size_t)io->result, io->offset,
+                pending->version);
+        file_state_t *fstate = find_fstate(pending->client, pending->file);
+        if (fstate) {
+            access_cache(pending->client, fstate, response,
+                pending->opcode == OP_WRITE ? pending->data + io->len : (const char*)0,
+                pending->len);
+        } else {
+            response->status = EBADF;
+            response->size = 0;
+        }
+    } else if (io->result < 0) {
+        response->status = (int32_t)-io->result;
+        response->size = 0;
+    } else {
+        response->size = (int32_t)io->result;
+        /* Blocks cached while the write was in flight may be stale. */
+        if (io->write && block_cache_blocks > 0)
+            bcache_drop_file(&block_cache, &pending->file->cached_blocks);
+        file_state_t *fstate = find_fstate(pending->client, pending->file);
+        if (fstate) {
+            fstate->position = (size_t)io->offset + (size_t)io->result;
+            record_fstate(WAL_POSITION, pending->client, fstate);
+        }
     }
+    free(pending->data);
+}
 
-    size_t position = lseek(fd, 0, SEEK_CUR);
-    if (position < 0)
-        fail_with_error("FATAL: lseek() failed");
+/* Reads or writes a client's open file at its position through the
+block cache. data is the data to write, or a null pointer to read len
+bytes into the response. With an asynchronous backend, the blocks the
+cache is missing are read through the backend first, and the client is
+answered once they are in; a null pointer is returned then. */
+response_t *perform_cached_io(op_t *op, client_t *client, file_state_t *fstate,
+    response_t *response, const char *data, size_t len)
+{
+    bcache_file_t *blocks = &fstate->file->cached_blocks;
+    uint64_t first, last;
+    if (disk_io == &io_sync_backend || (op->flags & OP_FLAG_SYNC) ||
+        bcache_missing(&block_cache, blocks, len, (off_t)fstate->position, data != (const char*)0,
+        &first, &last) <= 0)
+        return access_cache(client, fstate, response, data, len);
+
+    int fd = open_disk_file(fstate->file, 0, 0);
+    if (fd < 0)
+        return access_cache(client, fstate, response, data, len);
+
+    size_t span = (size_t)(last - first + 1) * BCACHE_BLOCK_SIZE;
+    pending_io_t *pending = (pending_io_t*)pool_alloc(&io_pool);
+    if (!pending)
+        fail_with_error("FATAL: pool_alloc() failed");
+    memset(pending, 0, sizeof(pending_io_t));
+    pending->data = (char*)malloc(span + (data ? len : 0));
+    if (!pending->data)
+        fail_with_error("FATAL: malloc() failed");
+    if (data)
+        memcpy(pending->data + span, data, len);
+    pending->io.fd = fd;
+    pending->io.buf = pending->data;
+    pending->io.len = span;
+    pending->io.offset = (off_t)(first * BCACHE_BLOCK_SIZE);
+    pending->client = client;
+    pending->file = fstate->file;
+    pending->opcode = op->opcode;
+    pending->incarnation = client->last_incarn;
+    pending->response = response;
+    pending->start = stats_now();
+    pending->cached = 1;
+    pending->len = len;
+    pending->version = blocks->version;
+
+    if (disk_io->submit(&pending->io) == 0) {
+        client->pending_io = pending;
+        return (response_t*)0;
+    }
 
-    fstate->position = position;
+    finish_io(pending);
+    pool_free(&io_pool, pending);
+    return response;
+}
+
+/* Copies what the read-ahead buffers hold of the len bytes at offset
+into out, up to the first byte they do not hold. Returns the number of
+bytes copied. */
+static size_t copy_readahead(readahead_t *readahead, char *out, size_t offset, size_t len)
+{
+    readahead_buffer_t *buffers[2] = { &readahead->current, &readahead->next };
+    size_t done = 0;
+    for (int i = 0; i < 2 && done < len; ++i) {
+        readahead_buffer_t *buffer = buffers[i];
+        size_t position = offset + done;
+        if (position < buffer->offset || position >= buffer->offset + buffer->len)
+            continue;
+        size_t n = buffer->offset + buffer->len - position;
+        if (n > len - done)
+            n = len - done;
+        memcpy(out + done, buffer->data + (position - buffer->offset), n);
+        done += n;
+    }
+    return done;
+}
+
+/* Records the result of a read-ahead, unless it was cancelled or its
+open file went away meanwhile. */
+static void finish_readahead(pending_io_t *pending)
+{
+    readahead_t *readahead = pending->readahead;
+    ssize_t result = pending->io.result;
+    size_t requested = pending->io.len;
+    size_t offset = (size_t)pending->io.offset;
+    pool_free(&io_pool, pending);
+
+    readahead->inflight = 0;
+    if (readahead->orphaned) {
+        free(readahead->current.data);
+        free(readahead->next.data);
+        free(readahead);
+        return;
+    }
+    if (readahead->discard) {
+        readahead->discard = 0;
+        return;
+    }
+    if (result < 0)
+        return;
+
+    readahead->next.len = (size_t)result;
+    if ((size_t)result < requested)
+        readahead->eof = offset + (size_t)result;
+}
+
+/* Reads window bytes at offset ahead into the next buffer, through the
+disk I/O backend. */
+static void start_readahead(readahead_t *readahead, int fd, size_t offset)
+{
+    readahead_buffer_t *next = &readahead->next;
+    if (next->capacity < readahead->window) {
+        char *data = (char*)realloc(next->data, readahead->window);
+        if (!data)
+            return;
+        next->data = data;
+        next->capacity = readahead->window;
+    }
+    next->offset = offset;
+    next->len = 0;
+
+    pending_io_t *pending = (pending_io_t*)pool_alloc(&io_pool);
+    if (!pending)
+        fail_with_error("FATAL: pool_alloc() failed");
+    memset(pending, 0, sizeof(pending_io_t));
+    pending->io.fd = fd;
+    pending->io.buf = next->data;
+    pending->io.len = readahead->window;
+    pending->io.offset = (off_t)offset;
+    pending->readahead = readahead;
+    pending->start = stats_now();
+
+    if (disk_io->submit(&pending->io) == 0)
+        readahead->inflight = 1;
+    else
+        finish_readahead(pending);
+}
+
+/* Serves a small read from data read ahead if it holds it, and reads
+ahead of a client reading sequentially: once the current buffer is used
+up, the next one takes its place, and a new read-ahead starts where the
+data held ends. Files shared for byte-range locking are not read ahead,
+since other clients' writes would leave the data stale. Returns 1 if the
+read was served. */
+int serve_readahead(client_t *client, file_state_t *fstate, int fd, response_t *response, size_t len)
+{
+    if (len > READAHEAD_MIN || (fstate->mode & LOCK_RANGES))
+        return 0;
+
+    size_t position = fstate->position;
+    fstate->sequential = position == fstate->next_read ? fstate->sequential + 1 : 0;
+    fstate->next_read = position + len;
+
+    readahead_t *readahead = fstate->readahead;
+    if (!readahead) {
+        if (fstate->sequential < READAHEAD_TRIGGER)
+            return 0;
+        readahead = (readahead_t*)calloc(1, sizeof(readahead_t));
+        if (!readahead)
+            return 0;
+        readahead->window = READAHEAD_MIN;
+        readahead->eof = SIZE_MAX;
+        fstate->readahead = readahead;
+    }
+
+    /* Data up to the end of the file is a whole read. */
+    size_t done = copy_readahead(readahead, response->result, position, len);
+    char served = done == len || position + done == readahead->eof;
+    if (served) {
+        response->size = (int32_t)done;
+        fstate->position = position + done;
+        record_fstate(WAL_POSITION, client, fstate);
+    }
+
+    readahead_buffer_t *current = &readahead->current;
+    readahead_buffer_t *next = &readahead->next;
+    if (!readahead->inflight && next->len > 0 && fstate->next_read >= next->offset) {
+        readahead_buffer_t used = *current;
+        *current = *next;
+        *next = used;
+        next->len = 0;
+        if (readahead->window < (disk_io == &io_sync_backend ? READAHEAD_SYNC_MAX : READAHEAD_MAX))
+            readahead->window *= 2;
+    }
+
+    if (fstate->sequential >= READAHEAD_TRIGGER && !readahead->inflight && next->len == 0 &&
+        readahead->eof == SIZE_MAX) {
+        size_t end = current->offset + current->len;
+        if (current->len == 0 || fstate->next_read < current->offset || fstate->next_read > end) {
+            current->len = 0;
+            end = fstate->next_read;
+        }
+        start_readahead(readahead, fd, end);
+    }
+
+    return served;
+}
+
+/* Discards the data read ahead for an open file, when the client moves
+its position or writes. */
+void cancel_readahead(file_state_t *fstate)
+{
+    fstate->sequential = 0;
+    readahead_t *readahead = fstate->readahead;
+    if (!readahead)
+        return;
+
+    readahead->current.len = 0;
+    readahead->next.len = 0;
+    readahead->window = READAHEAD_MIN;
+    readahead->eof = SIZE_MAX;
+    if (readahead->inflight)
+        readahead->discard = 1;
+}
 
-    if (close(fd) < 0)
-        fail_with_error("FATAL: close() failed");
+/* Frees the read-ahead state of an open file that is going away. One
+still in flight is freed when it completes. */
+void free_readahead(file_state_t *fstate)
+{
+    readahead_t *readahead = fstate->readahead;
+    if (!readahead)
+        return;
+
+    fstate->readahead = (readahead_t*)0;
+    if (readahead->inflight) {
+        readahead->orphaned = 1;
+        return;
+    }
+    free(readahead->current.data);
+    free(readahead->next.data);
+    free(readahead);
+}
+
+/* Reads or writes a client's open file at its position through the
+disk I/O backend. data is the data to write, or a null pointer to read
+len bytes into the response. Returns the response if the operation
+completed at once, or a null pointer if the client is answered on
+completion. */
+response_t *submit_io(op_t *op, client_t *client, file_state_t *fstate, int fd,
+    response_t *response, const char *data, size_t len)
+{
+    pending_io_t *pending = (pending_io_t*)pool_alloc(&io_pool);
+    if (!pending)
+        fail_with_error("FATAL: pool_alloc() failed");
+    memset(pending, 0, sizeof(pending_io_t));
+    pending->io.fd = fd;
+    pending->io.write = data != (const char*)0;
+    pending->io.buf = data ? (char*)data : response->result;
+    pending->io.len = len;
+    pending->io.offset = (off_t)fstate->position;
+    pending->client = client;
+    pending->file = fstate->file;
+    pending->opcode = op->opcode;
+    pending->incarnation = client->last_incarn;
+    pending->response = response;
+    pending->start = stats_now();
+
+    if (data && disk_io != &io_sync_backend && !(op->flags & OP_FLAG_SYNC)) {
+        pending->data = (char*)malloc(len ? len : 1);
+        if (!pending->data)
+            fail_with_error("FATAL: malloc() failed");
+        memcpy(pending->data, data, len);
+        pending->io.buf = pending->data;
+    }
 
-    printf("    INFO: Performed write.\n");
+    const io_backend_t *backend = op->flags & OP_FLAG_SYNC ? &io_sync_backend : disk_io;
+    if (backend->submit(&pending->io) == 0) {
+        client->pending_io = pending;
+        return (response_t*)0;
+    }
+
+    finish_io(pending);
+    pool_free(&io_pool, pending);
     return response;
 }
 
+/* Completes a disk operation that was in flight, and answers the client
+with it as the response to its request. A client whose incarnation changed
+meanwhile has moved on, so it is not answered. */
+void complete_io(io_request_t *request)
+{
+    pending_io_t *pending = (pending_io_t*)request;
+    if (pending->readahead) {
+        finish_readahead(pending);
+        return;
+    }
+
+    client_t *client = pending->client;
+    response_t *response = pending->response;
+    opcode_t opcode = pending->opcode;
+    int number = pending->request;
+
+    client->pending_io = (pending_io_t*)0;
+    finish_io(pending);
+    stats_record(opcode == OP_WRITE ? HIST_WRITE : HIST_READ, stats_now() - pending->start);
+    char current = client->last_incarn == pending->incarnation;
+    pool_free(&io_pool, pending);
+    make_ready(client);
+
+    if (!current) {
+        resp_free(response);
+        return;
+    }
+
+    log_info("Completed %s for machine=\"%s\" and client=%d.", opcode_name(opcode),
+        client->machine, client->id);
+    remember_response(client, number, response, opcode == OP_WRITE ? 0 : (size_t)response->size);
+    recent_request_t *recent = find_recent(client, number);
+    if (recent)
+        send_recent_response(client, recent, opcode);
+}
+
+/* Completes every disk operation the backend has finished. */
+void reap_io(void)
+{
+    disk_io->reap();
+    run_ready_clients();
+}
+
 /* Performs the lseek operation. */
-response_t *perform_lseek(request_t *request, client_t *client)
+response_t *perform_lseek(op_t *op, client_t *client)
 {
-    char filename[24];
-    int position;
+    int64_t position = op->offset;
 
-    sscanf(request->operation, "%*s %s %d", filename, &position);
-    file_entry_t *file = find_file(filename, request->machine);
+    file_entry_t *file = find_file(op->filename, op->filename_len, client->machine);
 
     if (!file) {
         /* File does not exist. */
-        printf("    ERROR: File does not exist.\n");
+        log_error("File does not exist.");
         return resp_from_status(EINVAL);
     }
 
@@ -629,7 +2177,7 @@ response_t *perform_lseek(request_t *request, client_t *client)
     mode. */
     if (!check_open(client, file, LOCK_WRITE)) {
         /* File exists but not opened by client (or not in right mode). */
-        printf("    ERROR: Client does not have file open in correct mode.\n");
+        log_error("Client does not have file open in correct mode.");
         return resp_from_status(EINVAL);
     }
 
@@ -638,40 +2186,245 @@ response_t *perform_lseek(request_t *request, client_t *client)
 
     file_state_t *fstate = find_fstate(client, file);
     fstate->position = position;
+    cancel_readahead(fstate);
+    record_fstate(WAL_POSITION, client, fstate);
 
-    printf("    INFO: Performed lseek.\n");
+    log_info("Performed lseek.");
     return resp_from_status(0);
 }
 
-/* Generates a response with the given status code, and 0 for the
-response and response size. Caller's responsibility to deallocate. */
-response_t *resp_from_status(int status)
+/* Returns the end of the byte range of length bytes at offset, where a
+length of 0 means every byte from offset on. */
+static uint64_t range_end(uint64_t offset, uint64_t length)
 {
-        response_t *response = (response_t*)calloc(1, sizeof(response_t));
-        response->status = (int32_t)status;
-        return response;
+    if (length == 0 || length > UINT64_MAX - offset)
+        return UINT64_MAX;
+    return offset + length;
 }
 
-/* Finds the file entry with the given filename and machine name. */
-file_entry_t *find_file(char *filename, char *machine)
+/* Finds the client's state of a file it has open for byte-range locking
+with the given access, or returns a null pointer. */
+static file_state_t *find_range_fstate(op_t *op, client_t *client, lock_t access)
 {
-    char found = 0;
-    file_entry_t *file;
-    /* Iterate through all file entries. */
-    for (int i = 0, end = file_list.size; i < end; ++i) {
-        file = list_at(&file_list, i);
+    file_entry_t *file = find_file(op->filename, op->filename_len, client->machine);
+    if (!file) {
+        /* File does not exist. */
+        log_error("File does not exist.");
+        return (file_state_t*)0;
+    }
 
-        if (strcmp(machine, file->machine) == 0 &&
-            strcmp(filename, file->filename) == 0) {
-            found = 1;
+    file_state_t *fstate = find_fstate(client, file);
+    if (!fstate || !(fstate->mode & LOCK_RANGES) || !(fstate->mode & access)) {
+        log_error("Client does not have file open for byte-range locking in correct mode.");
+        return (file_state_t*)0;
+    }
+    return fstate;
+}
+
+/* Performs the lock operation. A shared lock needs the file open for
+reading and an exclusive one for writing. A lock that conflicts with
+another client's fails with EAGAIN rather than waiting for it. */
+response_t *perform_lock(op_t *op, client_t *client)
+{
+    lock_t mode = op->mode;
+    if ((mode != LOCK_READ && mode != LOCK_WRITE) || op->offset < 0 || op->length < 0) {
+        log_error("Received invalid byte-range lock.");
+        return resp_from_status(EINVAL);
+    }
+
+    file_state_t *fstate = find_range_fstate(op, client, mode);
+    if (!fstate)
+        return resp_from_status(EINVAL);
+
+    file_entry_t *file = fstate->file;
+    uint64_t start = (uint64_t)op->offset;
+    uint64_t end = range_end(start, (uint64_t)op->length);
+    if (rangelock_conflict(&file->range_locks, start, end, client, mode == LOCK_WRITE)) {
+        log_error("Byte-range locks of other clients prevent locking %s.", file->filename);
+        stats_count(STAT_LOCK_CONFLICTS);
+        return resp_from_status(EAGAIN);
+    }
+
+    if (rangelock_set(&file->range_locks, start, end, client, mode == LOCK_WRITE) < 0)
+        return resp_from_status(ENOMEM);
+    record_range(WAL_LOCK, client, file, start, end, mode);
+
+    log_info("Locked bytes %llu to %llu of %s.", (unsigned long long)start,
+        (unsigned long long)end, file->filename);
+    return resp_from_status(0);
+}
+
+/* Performs the unlock operation. As with POSIX record locks, the client's
+locks that extend past the range keep the bytes outside it. */
+response_t *perform_unlock(op_t *op, client_t *client)
+{
+    if (op->offset < 0 || op->length < 0) {
+        log_error("Received invalid byte-range lock.");
+        return resp_from_status(EINVAL);
+    }
+
+    file_state_t *fstate = find_range_fstate(op, client, LOCK_READ | LOCK_WRITE);
+    if (!fstate)
+        return resp_from_status(EINVAL);
+
+    file_entry_t *file = fstate->file;
+    uint64_t start = (uint64_t)op->offset;
+    uint64_t end = range_end(start, (uint64_t)op->length);
+    long released = rangelock_release(&file->range_locks, start, end, client);
+    if (released < 0)
+        return resp_from_status(ENOMEM);
+    if (released == 0) {
+        log_error("Client holds no byte-range locks in the range.");
+        return resp_from_status(EINVAL);
+    }
+    record_range(WAL_UNLOCK, client, file, start, end, LOCK_UNLOCKED);
+
+    log_info("Unlocked bytes %llu to %llu of %s.", (unsigned long long)start,
+        (unsigned long long)end, file->filename);
+    return resp_from_status(0);
+}
+
+/* Performs the operations of a compound request in order, up to the
+first that fails, and collects their results into one response. Reads
+and writes complete before the next operation starts, and reads may
+return no more than the reply has room left for. The request was
+checked to hold exactly op->length operations, each with a result
+smaller than itself. */
+response_t *perform_compound(op_t *op, client_t *client)
+{
+    response_t *response = resp_with_capacity(0, BIN_MAX_RESULT);
+    if (!response)
+        return resp_from_status(ENOMEM);
+
+    const char *cursor = op->data;
+    size_t used = 0;
+    for (int64_t i = 0; i < op->length; ++i) {
+        op_t sub;
+        decode_compound_op(&cursor, &sub);
+        sub.flags = OP_FLAG_SYNC;
+        /* Leave room for the results of this and every later operation. */
+        sub.max_result = (int64_t)(BIN_MAX_RESULT - used) -
+            (op->length - i) * (int64_t)sizeof(bin_result_t);
+
+        response_t *result = dispatch_request(&sub, client);
+        bin_result_t bin;
+        bin.status = result->status;
+        bin.size = result->size;
+        memcpy(response->result + used, &bin, sizeof(bin));
+        used += sizeof(bin);
+        if (sub.opcode == OP_READ && result->status == 0) {
+            memcpy(response->result + used, result->result, (size_t)result->size);
+            used += (size_t)result->size;
+        }
+        resp_free(result);
+
+        if (bin.status != 0) {
+            response->status = bin.status;
             break;
         }
     }
 
-    if (found)
-        return file;
+    response->size = (int32_t)used;
+    log_info("Performed compound of %lld operations.", (long long)op->length);
+    return response;
+}
+
+/* Generates a response with the given status code, and 0 for the
+response and response size. Caller's responsibility to deallocate with
+resp_free(). */
+response_t *resp_from_status(int status)
+{
+    response_t *response = resp_with_capacity(status, 0);
+    if (!response)
+        fail_with_error("FATAL: calloc() failed");
+    return response;
+}
+
+/* Generates a response like resp_from_status() with room for at least
+capacity bytes of result. Returns a null pointer if the memory could
+not be allocated. Caller's responsibility to deallocate with
+resp_free(). */
+response_t *resp_with_capacity(int status, size_t capacity)
+{
+    /* Every response can be sent as a text response. */
+    if (capacity < TEXT_RESULT_SIZE)
+        capacity = TEXT_RESULT_SIZE;
+
+    size_t pool = 0;
+    while (pool < RESPONSE_CLASSES && response_class_sizes[pool] < capacity)
+        ++pool;
+
+    response_prefix_t *prefix;
+    if (pool < RESPONSE_CLASSES) {
+        prefix = (response_prefix_t*)pool_alloc(&response_pools[pool]);
+    } else {
+        prefix = (response_prefix_t*)malloc(sizeof(response_prefix_t) + sizeof(response_t) + capacity);
+        pool = RESPONSE_FROM_HEAP;
+    }
+    if (!prefix)
+        return (response_t*)0;
+    prefix->pool = pool;
+
+    /* Pooled memory is reused, so clear the header and the part of the
+    result a text response sends. */
+    response_t *response = (response_t*)(prefix + 1);
+    memset(response, 0, sizeof(response_t) + TEXT_RESULT_SIZE);
+    response->status = (int32_t)status;
+    return response;
+}
+
+/* Returns a response to the pool it was allocated from. */
+void resp_free(response_t *response)
+{
+    if (!response)
+        return;
+
+    response_prefix_t *prefix = (response_prefix_t*)response - 1;
+    if (prefix->pool == RESPONSE_FROM_HEAP)
+        free(prefix);
     else
+        pool_free(&response_pools[prefix->pool], prefix);
+}
+
+/* Finds the file entry with the given filename and machine name. */
+file_entry_t *find_file(const char *filename, size_t filename_len, const char *machine)
+{
+    /* A name that was never interned cannot belong to any file. */
+    file_key_t key;
+    key.machine = intern_lookup(&name_table, machine, strlen(machine));
+    key.filename = intern_lookup(&name_table, filename, filename_len);
+    if (!key.machine || !key.filename)
         return (file_entry_t*)0;
+
+    return (file_entry_t*)htable_find(&file_table, hash_file_key(&key), match_file, &key);
+}
+
+/* Calls the callback for every file on the given machine whose name
+starts with prefix, in filename order. Returns the number of files
+visited. */
+size_t enumerate_files(char *machine, char *prefix,
+    void (*callback)(file_entry_t *file, void *arg), void *arg)
+{
+    const char *imachine = intern_lookup(&name_table, machine, strlen(machine));
+    if (!imachine)
+        return 0;
+
+    machine_files_t *mfiles = find_machine_files(imachine, 0);
+    if (!mfiles)
+        return 0;
+
+    /* Files sharing the prefix are contiguous in filename order. */
+    size_t prefix_len = strlen(prefix);
+    size_t count = 0;
+    for (size_t i = machine_files_lower_bound(mfiles, prefix), end = mfiles->files.size; i < end; ++i) {
+        file_entry_t *file = (file_entry_t*)list_at(&mfiles->files, i);
+        if (strncmp(file->filename, prefix, prefix_len) != 0)
+            break;
+        callback(file, arg);
+        count = count + 1;
+    }
+
+    return count;
 }
 
 /* Checks whether the given client has the given file open with the specified mode. */
@@ -684,28 +2437,129 @@ char check_open(client_t *client, file_entry_t *file, lock_t mode)
         return 0;
 }
 
-/* Computes the filename of the specified file on the local disk,
-and opens that file. */
+/* Checks whether the byte-range locks of other clients allow the client
+to read, or if write is set to write, len bytes at its position in an
+open file. Files opened with a whole-file lock need no check. */
+char check_range(client_t *client, file_state_t *fstate, size_t len, char write)
+{
+    if (!(fstate->mode & LOCK_RANGES) || len == 0)
+        return 1;
+
+    uint64_t start = (uint64_t)fstate->position;
+    return !rangelock_conflict(&fstate->file->range_locks, start, range_end(start, len), client,
+        write);
+}
+
+/* Returns a descriptor for the specified file from the descriptor
+cache, computing its filename on the local disk and opening it if it
+is not cached. The descriptor belongs to the cache and must not be
+closed by the caller. Returns -1 and sets errno on failure. */
 int open_disk_file(file_entry_t *file, int flags, mode_t mode)
 {
-    char disk_filename[50];
-    strcpy(disk_filename, file->machine);
-    strcat(disk_filename, ":");
-    strcat(disk_filename, file->filename);
+    int fd = fdcache_get(&fd_cache, &file->cached_fd);
+    if (fd >= 0)
+        return fd;
+
+    char disk_filename[256];
+    snprintf(disk_filename, sizeof(disk_filename), "%s:%s", file->machine, file->filename);
+
+    /* Cached descriptors serve both readers and writers, so open for
+    both when the file allows it. When the process is out of
+    descriptors, give one back from the cache and try again. */
+    for (;;) {
+        fd = open(disk_filename, O_RDWR | flags, mode);
+        if (fd < 0 && errno == EACCES)
+            fd = open(disk_filename, O_RDONLY | (flags & ~O_CREAT), mode);
+        if (fd >= 0 || (errno != EMFILE && errno != ENFILE) || fdcache_evict(&fd_cache) < 0)
+            break;
+    }
 
-    int fd = open(disk_filename, flags, mode);
-    if (!fd)
-        fail_with_error("FATAL: open() failed");
+    if (fd >= 0)
+        fdcache_put(&fd_cache, &file->cached_fd, fd);
 
     return fd;
 }
 
+/* Returns the file entry the cached blocks belong to. */
+static file_entry_t *blocks_file(bcache_file_t *blocks)
+{
+    return (file_entry_t*)((char*)blocks - offsetof(file_entry_t, cached_blocks));
+}
+
+/* Reads and writes the disk file behind cached blocks for the block
+cache, through the descriptor cache and the disk I/O backend. Each
+waits for what it submitted, since the cache needs the data at once;
+the write backs of a flush are all in flight together. */
+ssize_t read_blocks(bcache_file_t *blocks, char *buf, size_t len, off_t offset)
+{
+    int fd = open_disk_file(blocks_file(blocks), 0, 0);
+    if (fd < 0)
+        return -1;
+
+    io_request_t request;
+    memset(&request, 0, sizeof(request));
+    request.fd = fd;
+    request.buf = buf;
+    request.len = len;
+    request.offset = offset;
+    if (disk_io->submit(&request) == 0)
+        disk_io->wait(&request);
+    if (request.result < 0) {
+        errno = (int)-request.result;
+        return -1;
+    }
+    return request.result;
+}
+
+int write_blocks(bcache_file_t *blocks, bcache_io_t *writes, size_t count)
+{
+    int fd = open_disk_file(blocks_file(blocks), 0, 0);
+    if (fd < 0)
+        return -1;
+
+    io_request_t requests[BCACHE_WRITE_BATCH];
+    char inflight[BCACHE_WRITE_BATCH];
+    for (size_t i = 0; i < count; ++i) {
+        memset(&requests[i], 0, sizeof(io_request_t));
+        requests[i].fd = fd;
+        requests[i].write = 1;
+        requests[i].buf = (char*)writes[i].buf;
+        requests[i].len = writes[i].len;
+        requests[i].offset = writes[i].offset;
+        inflight[i] = disk_io->submit(&requests[i]) == 0;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (inflight[i])
+            disk_io->wait(&requests[i]);
+        writes[i].result = requests[i].result;
+    }
+    return 0;
+}
+
+/* Returns the size of the disk file behind cached blocks, or -1 and sets
+errno on failure. */
+int64_t disk_file_size(bcache_file_t *blocks)
+{
+    struct stat st;
+    int fd = open_disk_file(blocks_file(blocks), 0, 0);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        return -1;
+    return (int64_t)st.st_size;
+}
+
+/* Syncs the data of the disk file behind cached blocks. */
+int sync_disk_file(bcache_file_t *blocks)
+{
+    int fd = open_disk_file(blocks_file(blocks), 0, 0);
+    return fd < 0 ? -1 : fdatasync(fd);
+}
+
 /* Finds the record for the client's file state for the given
 file. */
 file_state_t *find_fstate(client_t *client, file_entry_t *file)
 {
     for (int i = 0, end = client->fstates.size; i < end; ++i) {
-        file_state_t *fstate = (file_state_t*)list_at(&client->fstates, i);
+        file_state_t *fstate = fstate_vec_at(&client->fstates, i);
         if (file == fstate->file) {
             return fstate;
         }
@@ -0,0 +1,29 @@
+/* Typed vectors with inline storage used in the server. */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "smallvec.h"
+
+/* Grows a vector's storage to twice its capacity, moving the elements
+   out of the inline storage on the first growth. Returns 0 if
+   successful, -1 if the memory could not be allocated. */
+int smallvec_grow(void **heap, const void *local, uint32_t *capacity, uint32_t size,
+	size_t element_size)
+{
+	uint32_t grown = *capacity ? *capacity * 2 : 4;
+	void *p;
+	if (*heap) {
+		p = realloc(*heap, element_size * grown);
+		if (!p)
+			return -1;
+	} else {
+		p = malloc(element_size * grown);
+		if (!p)
+			return -1;
+		memcpy(p, local, element_size * size);
+	}
+	*heap = p;
+	*capacity = grown;
+	return 0;
+}
@@ -0,0 +1,279 @@
+/* Counters and latency histograms used in the server. */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "stats.h"
+
+#define STATS_MAX_THREADS 512
+
+/* The statistics one thread updates. */
+typedef struct {
+	uint64_t counters[STAT_COUNTERS];
+	histogram_t histograms[STAT_HISTOGRAMS];
+} stats_block_t;
+
+static stats_block_t *stats_blocks[STATS_MAX_THREADS];
+static int stats_nblocks;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread stats_block_t *stats_mine;
+
+static const char *counter_names[STAT_COUNTERS] = {
+	"requests_total",
+	"retransmit_hits_total",
+	"stale_requests_total",
+	"lock_conflicts_total",
+	"lock_waits_total",
+	"lock_wait_timeouts_total",
+	"lease_expiries_total",
+	"block_cache_hits_total",
+	"block_cache_misses_total",
+	"block_writebacks_total"
+};
+
+static const char *histogram_names[STAT_HISTOGRAMS] = {
+	"request", "open", "close", "read", "write", "lseek"
+};
+
+/* Returns the bucket holding a value. */
+static size_t hist_bucket(uint64_t value)
+{
+	if (value < HIST_SUB_BUCKETS)
+		return (size_t)value;
+
+	int magnitude = 63 - __builtin_clzll(value);
+	size_t sub = (size_t)(value >> (magnitude - 4)) & (HIST_SUB_BUCKETS - 1);
+	return (size_t)(magnitude - 3) * HIST_SUB_BUCKETS + sub;
+}
+
+/* Returns the middle of the range of values a bucket holds. */
+static uint64_t hist_bucket_value(size_t bucket)
+{
+	if (bucket < HIST_SUB_BUCKETS)
+		return bucket;
+
+	int magnitude = (int)(bucket / HIST_SUB_BUCKETS) + 3;
+	uint64_t sub = bucket % HIST_SUB_BUCKETS;
+	uint64_t low = (HIST_SUB_BUCKETS + sub) << (magnitude - 4);
+	return low + ((1ULL << (magnitude - 4)) >> 1);
+}
+
+/* Initializes an empty histogram. */
+void hist_init(histogram_t *hist)
+{
+	memset(hist, 0, sizeof(histogram_t));
+}
+
+/* Records one value. Only the owning thread writes a histogram, but
+   scrapers read it concurrently, hence the relaxed atomic stores. */
+void hist_record(histogram_t *hist, uint64_t value)
+{
+	size_t bucket = hist_bucket(value);
+	__atomic_store_n(&hist->buckets[bucket], hist->buckets[bucket] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->sum, hist->sum + value, __ATOMIC_RELAXED);
+	if (value > hist->max)
+		__atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
+
+/* Adds the contents of one histogram to another. */
+void hist_merge(histogram_t *into, const histogram_t *from)
+{
+	into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+	into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+	if (max > into->max)
+		into->max = max;
+	for (size_t i = 0; i < HIST_BUCKETS; ++i)
+		into->buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+}
+
+/* Returns the value at the given quantile (between 0 and 1), or 0 for
+   an empty histogram. */
+uint64_t hist_quantile(const histogram_t *hist, double quantile)
+{
+	uint64_t total = 0;
+	for (size_t i = 0; i < HIST_BUCKETS; ++i)
+		total += hist->buckets[i];
+	if (total == 0)
+		return 0;
+
+	/* The largest value is known exactly. */
+	uint64_t rank = (uint64_t)(quantile * (double)total);
+	if (rank >= total - 1)
+		return hist->max;
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < HIST_BUCKETS; ++i) {
+		seen += hist->buckets[i];
+		if (seen > rank) {
+			uint64_t value = hist_bucket_value(i);
+			return value < hist->max ? value : hist->max;
+		}
+	}
+
+	return hist->max;
+}
+
+/* Gives the calling thread its own block of counters and histograms. */
+void stats_register_thread(void)
+{
+	if (stats_mine)
+		return;
+
+	stats_block_t *block = (stats_block_t*)calloc(1, sizeof(stats_block_t));
+	if (!block)
+		return;
+
+	pthread_mutex_lock(&stats_lock);
+	if (stats_nblocks < STATS_MAX_THREADS) {
+		stats_blocks[stats_nblocks] = block;
+		stats_nblocks = stats_nblocks + 1;
+		stats_mine = block;
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	if (!stats_mine)
+		free(block);
+}
+
+/* Increments a counter of the calling thread. */
+void stats_count(stat_counter_t counter)
+{
+	if (stats_mine)
+		__atomic_store_n(&stats_mine->counters[counter], stats_mine->counters[counter] + 1, __ATOMIC_RELAXED);
+}
+
+/* Records a latency in one of the calling thread's histograms. */
+void stats_record(stat_histogram_t histogram, uint64_t nanoseconds)
+{
+	if (stats_mine)
+		hist_record(&stats_mine->histograms[histogram], nanoseconds);
+}
+
+/* Returns a monotonic timestamp in nanoseconds. */
+uint64_t stats_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/* Appends formatted text to the buffer, never writing past its end. */
+static void stats_append(char *buffer, size_t capacity, size_t *used, const char *format, ...)
+	__attribute__((format(printf, 4, 5)));
+
+static void stats_append(char *buffer, size_t capacity, size_t *used, const char *format, ...)
+{
+	if (*used >= capacity)
+		return;
+
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(buffer + *used, capacity - *used, format, args);
+	va_end(args);
+
+	if (n > 0)
+		*used = *used + (size_t)n < capacity ? *used + (size_t)n : capacity;
+}
+
+/* Writes every counter and histogram summary, one "name value" pair per
+   line, summed over all threads. */
+size_t stats_format(char *buffer, size_t capacity)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t counters[STAT_COUNTERS];
+	histogram_t *hist = (histogram_t*)malloc(sizeof(histogram_t));
+	size_t used = 0;
+
+	if (!hist)
+		return 0;
+	memset(counters, 0, sizeof(counters));
+
+	pthread_mutex_lock(&stats_lock);
+	int nblocks = stats_nblocks;
+	pthread_mutex_unlock(&stats_lock);
+
+	for (int b = 0; b < nblocks; ++b)
+		for (int c = 0; c < STAT_COUNTERS; ++c)
+			counters[c] += __atomic_load_n(&stats_blocks[b]->counters[c], __ATOMIC_RELAXED);
+
+	for (int c = 0; c < STAT_COUNTERS; ++c)
+		stats_append(buffer, capacity, &used, "fs_%s %llu\n", counter_names[c],
+			(unsigned long long)counters[c]);
+
+	for (int h = 0; h < STAT_HISTOGRAMS; ++h) {
+		hist_init(hist);
+		for (int b = 0; b < nblocks; ++b)
+			hist_merge(hist, &stats_blocks[b]->histograms[h]);
+
+		const char *name = histogram_names[h];
+		stats_append(buffer, capacity, &used, "fs_latency_ns_count{op=\"%s\"} %llu\n",
+			name, (unsigned long long)hist->count);
+		stats_append(buffer, capacity, &used, "fs_latency_ns_sum{op=\"%s\"} %llu\n",
+			name, (unsigned long long)hist->sum);
+		for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); ++q)
+			stats_append(buffer, capacity, &used, "fs_latency_ns{op=\"%s\",quantile=\"%g\"} %llu\n",
+				name, quantiles[q], (unsigned long long)hist_quantile(hist, quantiles[q]));
+		stats_append(buffer, capacity, &used, "fs_latency_ns_max{op=\"%s\"} %llu\n",
+			name, (unsigned long long)hist->max);
+	}
+
+	free(hist);
+	return used;
+}
+
+/* Answers every datagram on the stats socket with a fresh scrape. */
+static void *stats_server(void *arg)
+{
+	int sock = (int)(intptr_t)arg;
+	static char reply[65507];
+	char request[64];
+
+	for (;;) {
+		struct sockaddr_in from;
+		socklen_t from_len = sizeof(from);
+		if (recvfrom(sock, request, sizeof(request), 0, (struct sockaddr*)&from, &from_len) < 0)
+			continue;
+
+		size_t size = stats_format(reply, sizeof(reply));
+		sendto(sock, reply, size, 0, (struct sockaddr*)&from, from_len);
+	}
+
+	return (void*)0;
+}
+
+/* Starts a thread answering every datagram sent to the given UDP port on
+   the loopback address with the output of stats_format(). */
+void stats_serve(unsigned short port)
+{
+	int sock;
+	struct sockaddr_in address;
+	pthread_t thread;
+
+	if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+		perror("FATAL: socket() failed");
+		exit(1);
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+	if (bind(sock, (struct sockaddr*)&address, sizeof(address)) < 0) {
+		perror("FATAL: bind() failed");
+		exit(1);
+	}
+
+	if (pthread_create(&thread, (const pthread_attr_t*)0, stats_server, (void*)(intptr_t)sock) != 0) {
+		perror("FATAL: pthread_create() failed");
+		exit(1);
+	}
+	pthread_detach(thread);
+}
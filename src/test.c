@@ -2,8 +2,24 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "list.h"
+#include "htable.h"
+#include "intern.h"
+#include "pool.h"
+#include "stats.h"
+#include "wheel.h"
+#include "catalog.h"
+#include "bcache.h"
+#include "smallvec.h"
+#include "rangelock.h"
+#include "rto.h"
+#include "wal.h"
 
 void test_list()
 {
@@ -38,8 +54,817 @@ void test_list()
 	printf("Finished testing list.\n");
 }
 
+static int match_int(const void *element, const void *key)
+{
+	return *(const int*)element == *(const int*)key;
+}
+
+void test_htable()
+{
+	printf("Testing htable...\n");
+
+	htable_t table;
+	htable_init(&table);
+
+	/* Insert enough elements to force several incremental resizes. */
+	int *values = (int*)malloc(sizeof(int) * 1000);
+	for (int i = 0; i < 1000; ++i) {
+		values[i] = i;
+		uint64_t hash = htable_hash(&i, sizeof(i), HTABLE_SEED);
+		if (htable_insert(&table, hash, &values[i]) < 0)
+			printf("FAILED: htable_insert");
+	}
+
+	for (int i = 0; i < 1000; ++i) {
+		uint64_t hash = htable_hash(&i, sizeof(i), HTABLE_SEED);
+		int *p = (int*)htable_find(&table, hash, match_int, &i);
+		if (!p || *p != i)
+			printf("FAILED: htable_find");
+	}
+
+	for (int i = 0; i < 1000; i += 2) {
+		uint64_t hash = htable_hash(&i, sizeof(i), HTABLE_SEED);
+		if (htable_remove(&table, hash, match_int, &i) != &values[i])
+			printf("FAILED: htable_remove");
+	}
+
+	for (int i = 0; i < 1000; ++i) {
+		uint64_t hash = htable_hash(&i, sizeof(i), HTABLE_SEED);
+		int *p = (int*)htable_find(&table, hash, match_int, &i);
+		if ((i % 2 == 0) != (p == (int*)0))
+			printf("FAILED: htable_remove");
+	}
+
+	if (table.size != 500)
+		printf("FAILED: htable size");
+
+	printf("Finished testing htable.\n");
+}
+
+void test_intern()
+{
+	printf("Testing intern...\n");
+
+	intern_t table;
+	intern_init(&table);
+
+	char name[16];
+	strcpy(name, "machine:file");
+
+	if (intern_lookup(&table, "machine", 7))
+		printf("FAILED: intern_lookup");
+
+	const char *a = intern(&table, name, 7);
+	const char *b = intern(&table, "machine", 7);
+	if (!a || a != b || strcmp(a, "machine") != 0)
+		printf("FAILED: intern");
+
+	if (intern_lookup(&table, "machine", 7) != a)
+		printf("FAILED: intern_lookup");
+
+	if (intern(&table, name, strlen(name)) == a)
+		printf("FAILED: intern");
+
+	printf("Finished testing intern.\n");
+}
+
+void test_pool()
+{
+	printf("Testing pool...\n");
+
+	pool_t pool;
+	pool_init(&pool, sizeof(int), 4);
+
+	int *objects[10];
+	for (int i = 0; i < 10; ++i) {
+		objects[i] = (int*)pool_alloc(&pool);
+		if (!objects[i])
+			printf("FAILED: pool_alloc");
+		*objects[i] = i;
+	}
+
+	for (int i = 0; i < 10; ++i) {
+		if (*objects[i] != i)
+			printf("FAILED: pool_alloc");
+	}
+
+	if (pool.slabs != 3 || pool.in_use != 10)
+		printf("FAILED: pool size");
+
+	/* Freed objects are reused before the pool grows again. */
+	int *freed = objects[5];
+	pool_free(&pool, freed);
+	if (pool_alloc(&pool) != freed || pool.slabs != 3)
+		printf("FAILED: pool_free");
+
+	printf("Finished testing pool.\n");
+}
+
+void test_histogram()
+{
+	printf("Testing histogram...\n");
+
+	histogram_t *hist = (histogram_t*)malloc(sizeof(histogram_t));
+	hist_init(hist);
+
+	for (uint64_t i = 1; i <= 1000; ++i)
+		hist_record(hist, i * 1000);
+
+	if (hist->count != 1000 || hist->max != 1000000)
+		printf("FAILED: hist_record");
+
+	/* Every quantile is within the 1/16 precision of the buckets. */
+	uint64_t median = hist_quantile(hist, 0.5);
+	if (median < 500000 - 500000 / 16 || median > 500000 + 500000 / 16)
+		printf("FAILED: hist_quantile");
+	if (hist_quantile(hist, 1.0) != 1000000)
+		printf("FAILED: hist_quantile");
+
+	histogram_t *other = (histogram_t*)malloc(sizeof(histogram_t));
+	hist_init(other);
+	hist_record(other, 5);
+	hist_merge(hist, other);
+	if (hist->count != 1001 || hist_quantile(hist, 0.0) != 5)
+		printf("FAILED: hist_merge");
+
+	free(other);
+	free(hist);
+	printf("Finished testing histogram.\n");
+}
+
+/* A timer that records when the wheel fired it. */
+typedef struct {
+	wheel_timer_t timer;
+	uint64_t due;
+	uint64_t fired;
+} test_timer_t;
+
+static uint64_t wheel_clock;
+
+static void record_fire(wheel_timer_t *timer, void *arg)
+{
+	test_timer_t *t = (test_timer_t*)timer;
+	t->fired = wheel_clock;
+	*(int*)arg += 1;
+}
+
+void test_wheel()
+{
+	printf("Testing wheel...\n");
+
+	wheel_t wheel;
+	wheel_init(&wheel, 0, 1);
+
+	/* Spread timers over every level, and cancel every tenth. */
+	static test_timer_t timers[1000];
+	for (int i = 0; i < 1000; ++i) {
+		wheel_timer_init(&timers[i].timer);
+		timers[i].due = (uint64_t)(i * i * 37) % 300000 + 1;
+		timers[i].fired = 0;
+		wheel_schedule(&wheel, &timers[i].timer, timers[i].due);
+	}
+	for (int i = 0; i < 1000; i += 10)
+		wheel_cancel(&wheel, &timers[i].timer);
+
+	if (wheel.count != 900)
+		printf("FAILED: wheel_schedule");
+
+	/* Advance in uneven steps, as a busy loop would. */
+	int fired = 0;
+	while (wheel_clock < 300000) {
+		wheel_clock += 1 + wheel_clock % 97;
+		wheel_advance(&wheel, wheel_clock, record_fire, &fired);
+	}
+
+	if (fired != 900 || wheel.count != 0)
+		printf("FAILED: wheel_advance");
+
+	for (int i = 0; i < 1000; ++i) {
+		/* Timers fire on the first advance past their time. */
+		if (i % 10 == 0 ? timers[i].fired != 0 :
+			timers[i].fired < timers[i].due || timers[i].fired > timers[i].due + 97)
+			printf("FAILED: wheel_advance");
+	}
+
+	wheel_schedule(&wheel, &timers[1].timer, wheel_clock + 5);
+	if (wheel_next_ms(&wheel, wheel_clock) != 5)
+		printf("FAILED: wheel_next_ms");
+
+	/* A timer beyond the span keeps its deadline. */
+	uint64_t span = 1ULL << (WHEEL_SLOT_BITS * WHEEL_LEVELS);
+	wheel_init(&wheel, 0, 1);
+	wheel_timer_init(&timers[0].timer);
+	timers[0].due = 3 * span + 5;
+	timers[0].fired = 0;
+	wheel_schedule(&wheel, &timers[0].timer, timers[0].due);
+	fired = 0;
+	for (wheel_clock = 0; wheel_clock < timers[0].due - 1; ) {
+		wheel_clock += span / 3;
+		if (wheel_clock > timers[0].due - 1)
+			wheel_clock = timers[0].due - 1;
+		wheel_advance(&wheel, wheel_clock, record_fire, &fired);
+	}
+	if (fired != 0 || wheel.count != 1)
+		printf("FAILED: wheel_advance beyond the span");
+	wheel_clock = timers[0].due;
+	wheel_advance(&wheel, wheel_clock, record_fire, &fired);
+	if (fired != 1 || timers[0].fired != timers[0].due || wheel.count != 0)
+		printf("FAILED: wheel_advance beyond the span");
+
+	printf("Finished testing wheel.\n");
+}
+
+void test_catalog()
+{
+	printf("Testing catalog...\n");
+
+	char dir[] = "/tmp/fscatalogXXXXXX";
+	char path[64];
+	if (!mkdtemp(dir)) {
+		printf("FAILED: mkdtemp");
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/catalog", dir);
+
+	/* Add enough files to grow the table a few times. */
+	catalog_t catalog;
+	char name[32];
+	if (catalog_open(&catalog, path) < 0)
+		printf("FAILED: catalog_open");
+	for (int i = 0; i < 5000; ++i) {
+		int len = snprintf(name, sizeof(name), "file%d", i);
+		if (catalog_add(&catalog, i % 2 ? "odd" : "even", i % 2 ? 3 : 4, name, (size_t)len) < 0)
+			printf("FAILED: catalog_add");
+	}
+	catalog_add(&catalog, "even", 4, "file0", 5);
+	catalog_close(&catalog);
+
+	/* Everything is there after mapping the file again. */
+	if (catalog_open(&catalog, path) < 0)
+		printf("FAILED: catalog_open");
+	if (((catalog_header_t*)catalog.map)->count != 5000)
+		printf("FAILED: catalog_add");
+	for (int i = 0; i < 5000; ++i) {
+		int len = snprintf(name, sizeof(name), "file%d", i);
+		if (!catalog_contains(&catalog, i % 2 ? "odd" : "even", i % 2 ? 3 : 4, name, (size_t)len) ||
+			catalog_contains(&catalog, i % 2 ? "even" : "odd", i % 2 ? 4 : 3, name, (size_t)len))
+			printf("FAILED: catalog_contains");
+	}
+
+	/* A table with no empty slot, which the header does not admit to,
+	   still answers lookups, and refuses additions. */
+	catalog_header_t *header = (catalog_header_t*)catalog.map;
+	catalog_slot_t *slots = (catalog_slot_t*)(header + 1);
+	for (uint64_t i = 0; i < header->slots; ++i) {
+		if (slots[i].hash == 0)
+			slots[i].hash = 1;
+	}
+	catalog_close(&catalog);
+	if (catalog_open(&catalog, path) < 0)
+		printf("FAILED: catalog_open");
+	if (!catalog_contains(&catalog, "odd", 3, "file1", 5) ||
+		catalog_contains(&catalog, "odd", 3, "file0", 5))
+		printf("FAILED: catalog_contains of a full catalog");
+	errno = 0;
+	if (catalog_add(&catalog, "odd", 3, "file0", 5) == 0 || errno != EINVAL)
+		printf("FAILED: catalog_add to a full catalog");
+
+	/* A header counting more slots in use than the table holds is
+	   refused. */
+	header = (catalog_header_t*)catalog.map;
+	header->count = header->slots;
+	catalog_close(&catalog);
+	if (catalog_open(&catalog, path) == 0)
+		printf("FAILED: catalog_open of a full catalog");
+	catalog_close(&catalog);
+
+	unlink(path);
+	rmdir(dir);
+	printf("Finished testing catalog.\n");
+}
+
+/* A file kept in memory standing in for the disk. */
+typedef struct {
+	bcache_file_t blocks;
+	char data[65536];
+	size_t size;
+	int writes;
+	int batches;
+	int syncs;
+} test_disk_t;
+
+static ssize_t test_disk_read(bcache_file_t *blocks, char *buf, size_t len, off_t offset)
+{
+	test_disk_t *disk = (test_disk_t*)blocks;
+	if ((size_t)offset >= disk->size)
+		return 0;
+	if (len > disk->size - (size_t)offset)
+		len = disk->size - (size_t)offset;
+	memcpy(buf, disk->data + offset, len);
+	return (ssize_t)len;
+}
+
+static int test_disk_write(bcache_file_t *blocks, bcache_io_t *writes, size_t count)
+{
+	test_disk_t *disk = (test_disk_t*)blocks;
+	for (size_t i = 0; i < count; ++i) {
+		memcpy(disk->data + writes[i].offset, writes[i].buf, writes[i].len);
+		if ((size_t)writes[i].offset + writes[i].len > disk->size)
+			disk->size = (size_t)writes[i].offset + writes[i].len;
+		writes[i].result = (ssize_t)writes[i].len;
+	}
+	disk->writes = disk->writes + (int)count;
+	disk->batches = disk->batches + 1;
+	return 0;
+}
+
+static int64_t test_disk_size(bcache_file_t *blocks)
+{
+	return (int64_t)((test_disk_t*)blocks)->size;
+}
+
+static int test_disk_sync(bcache_file_t *blocks)
+{
+	((test_disk_t*)blocks)->syncs = ((test_disk_t*)blocks)->syncs + 1;
+	return 0;
+}
+
+void test_bcache()
+{
+	printf("Testing bcache...\n");
+
+	static const bcache_ops_t ops = { test_disk_read, test_disk_write, test_disk_size, test_disk_sync };
+	static test_disk_t disk;
+	static char image[65536];
+	char buf[8192];
+	bcache_t cache;
+
+	memset(&disk, 0, sizeof(disk));
+	memset(image, 0, sizeof(image));
+	bcache_file_init(&disk.blocks);
+	if (bcache_init(&cache, 4, &ops, 0) < 0)
+		printf("FAILED: bcache_init");
+
+	/* Small writes to one block coalesce into a single write back. */
+	for (int i = 0; i < 100; ++i) {
+		char chunk[10];
+		memset(chunk, 'a' + i % 26, sizeof(chunk));
+		memcpy(image + i * 10, chunk, sizeof(chunk));
+		if (bcache_write(&cache, &disk.blocks, chunk, sizeof(chunk), i * 10) != 10)
+			printf("FAILED: bcache_write");
+	}
+	if (disk.writes != 0 || disk.size != 0)
+		printf("FAILED: bcache_write went to disk");
+	if (bcache_read(&cache, &disk.blocks, buf, sizeof(buf), 0) != 1000 || memcmp(buf, image, 1000) != 0)
+		printf("FAILED: bcache_read");
+	if (bcache_flush_file(&cache, &disk.blocks, 1) < 0 || disk.writes != 1 || disk.syncs != 1 ||
+		disk.size != 1000 || memcmp(disk.data, image, 1000) != 0)
+		printf("FAILED: bcache_flush_file");
+
+	/* A write past the end leaves zeros before it, and reads stop at the
+	   end of the file. */
+	memcpy(image + 20000, "end", 3);
+	bcache_write(&cache, &disk.blocks, "end", 3, 20000);
+	if (bcache_read(&cache, &disk.blocks, buf, sizeof(buf), 16000) != 4003 ||
+		memcmp(buf, image + 16000, 4003) != 0)
+		printf("FAILED: bcache_read across a hole");
+	if (bcache_read(&cache, &disk.blocks, buf, sizeof(buf), 20003) != 0)
+		printf("FAILED: bcache_read at the end");
+
+	/* Writing more blocks than the cache holds writes back and evicts. */
+	for (int i = 0; i < 12; ++i) {
+		memset(buf, 'A' + i, 3000);
+		memcpy(image + 24000 + i * 3000, buf, 3000);
+		if (bcache_write(&cache, &disk.blocks, buf, 3000, 24000 + i * 3000) != 3000)
+			printf("FAILED: bcache_write");
+	}
+	for (int offset = 0; offset < 60000; offset += 5000) {
+		if (bcache_read(&cache, &disk.blocks, buf, 5000, offset) != 5000 ||
+			memcmp(buf, image + offset, 5000) != 0)
+			printf("FAILED: bcache_read after eviction");
+	}
+	if (bcache_flush(&cache, 0) < 0 || disk.size != 60000 || memcmp(disk.data, image, 60000) != 0 ||
+		cache.dirty != 0 || cache.flush_head)
+		printf("FAILED: bcache_flush");
+
+	/* Dropping the file's blocks shows changes made behind the cache. */
+	disk.data[5] = '!';
+	if (bcache_drop_file(&cache, &disk.blocks) < 0 || disk.blocks.blocks ||
+		bcache_read(&cache, &disk.blocks, buf, 1, 5) != 1 || buf[0] != '!')
+		printf("FAILED: bcache_drop_file");
+
+	/* Blocks read ahead fill the cache, unless the file changed on disk
+	   since the read started. */
+	uint64_t first, last;
+	uint64_t version = disk.blocks.version;
+	if (bcache_missing(&cache, &disk.blocks, 5000, 3000, 0, &first, &last) != 1 ||
+		first != 1 || last != 1)
+		printf("FAILED: bcache_missing");
+	bcache_fill(&cache, &disk.blocks, disk.data + BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE,
+		BCACHE_BLOCK_SIZE, version - 1);
+	if (bcache_missing(&cache, &disk.blocks, 5000, 3000, 0, &first, &last) != 1)
+		printf("FAILED: bcache_fill of a changed file");
+	bcache_fill(&cache, &disk.blocks, disk.data + BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE,
+		BCACHE_BLOCK_SIZE, version);
+	if (bcache_missing(&cache, &disk.blocks, 5000, 3000, 0, &first, &last) != 0 ||
+		bcache_read(&cache, &disk.blocks, buf, 5000, 3000) != 5000 ||
+		memcmp(buf, disk.data + 3000, 5000) != 0)
+		printf("FAILED: bcache_fill");
+	if (bcache_missing(&cache, &disk.blocks, BCACHE_BLOCK_SIZE, 2 * BCACHE_BLOCK_SIZE, 1,
+		&first, &last) != 0 ||
+		bcache_missing(&cache, &disk.blocks, 10, 2 * BCACHE_BLOCK_SIZE, 1, &first, &last) != 1)
+		printf("FAILED: bcache_missing for a write");
+
+	/* A flush hands the disk every dirty block of a file at once. */
+	disk.writes = disk.batches = 0;
+	bcache_write(&cache, &disk.blocks, "x", 1, 0);
+	bcache_write(&cache, &disk.blocks, "y", 1, BCACHE_BLOCK_SIZE);
+	if (bcache_flush(&cache, 0) < 0 || disk.writes != 2 || disk.batches != 1 ||
+		disk.blocks.dirty_blocks)
+		printf("FAILED: bcache_flush in a batch");
+	bcache_destroy(&cache);
+
+	/* A durable cache keeps a file written back listed until it is
+	   synced, once. */
+	bcache_file_init(&disk.blocks);
+	disk.syncs = 0;
+	bcache_init(&cache, 4, &ops, 1);
+	bcache_write(&cache, &disk.blocks, "x", 1, 0);
+	bcache_flush(&cache, 0);
+	if (cache.flush_head != &disk.blocks || disk.syncs != 0)
+		printf("FAILED: bcache_flush without sync");
+	bcache_flush(&cache, 1);
+	bcache_flush(&cache, 1);
+	if (cache.flush_head || disk.syncs != 1)
+		printf("FAILED: bcache_flush with sync");
+	bcache_destroy(&cache);
+
+	printf("Finished testing bcache.\n");
+}
+
+SMALLVEC_DEFINE(int_vec, int, 4)
+
+void test_smallvec()
+{
+	printf("Testing smallvec...\n");
+
+	int_vec_t vec;
+	int_vec_init(&vec);
+
+	/* The first four elements stay inline; the fifth moves them all to
+	   the heap. */
+	for (int i = 0; i < 10; ++i) {
+		if (!int_vec_append(&vec, i + 1))
+			printf("FAILED: int_vec_append");
+		if (i == 3 && vec.heap)
+			printf("FAILED: int_vec_append left the inline storage");
+	}
+	if (!vec.heap || vec.size != 10 || vec.capacity < 10)
+		printf("FAILED: int_vec_append past the inline storage");
+
+	for (int i = 0; i < 10; ++i) {
+		if (*int_vec_at(&vec, i) != i + 1)
+			printf("FAILED: int_vec_at");
+	}
+
+	/* Removing moves the last element into the hole. */
+	int_vec_remove(&vec, 2);
+	int_vec_remove(&vec, 8);
+	if (vec.size != 8 || *int_vec_at(&vec, 2) != 10 || *int_vec_at(&vec, 7) != 8)
+		printf("FAILED: int_vec_remove");
+
+	int_vec_free(&vec);
+	if (vec.size != 0 || vec.heap)
+		printf("FAILED: int_vec_free");
+
+	printf("Finished testing smallvec.\n");
+}
+
+/* Adds the length of a lock to the total passed as arg, checking that
+   locks are visited in order. */
+static void sum_range(const rangelock_t *lock, void *arg)
+{
+	uint64_t *sum = (uint64_t*)arg;
+	if (lock->start < sum[1])
+		printf("FAILED: rangelock_each order");
+	sum[0] += lock->end - lock->start;
+	sum[1] = lock->start;
+}
+
+void test_rangelock()
+{
+	printf("Testing rangelock...\n");
+
+	rangelock_tree_t tree;
+	int a, b;
+	rangelock_tree_init(&tree);
+
+	/* Disjoint exclusive locks of two owners, enough to rebalance the
+	   tree many times. */
+	for (uint64_t i = 0; i < 1000; ++i) {
+		if (rangelock_set(&tree, i * 100, i * 100 + 50, i % 2 ? &a : &b, 1) < 0)
+			printf("FAILED: rangelock_set");
+	}
+	if (tree.count != 1000)
+		printf("FAILED: rangelock_set count");
+
+	if (rangelock_conflict(&tree, 50, 100, &a, 1) || rangelock_conflict(&tree, 150, 200, &b, 1))
+		printf("FAILED: rangelock_conflict in a gap");
+	const rangelock_t *lock = rangelock_conflict(&tree, 140, 260, &a, 0);
+	if (!lock || lock->start != 200 || lock->owner != &b)
+		printf("FAILED: rangelock_conflict with another owner");
+	if (rangelock_conflict(&tree, 100, 150, &a, 1))
+		printf("FAILED: rangelock_conflict with the owner's own lock");
+	if (!rangelock_conflict(&tree, 99949, UINT64_MAX, &b, 0))
+		printf("FAILED: rangelock_conflict at the end");
+
+	/* Shared locks conflict only with writing. */
+	rangelock_set(&tree, 100, 150, &a, 0);
+	if (tree.count != 1000 || rangelock_conflict(&tree, 120, 130, &b, 0) ||
+		!rangelock_conflict(&tree, 120, 130, &b, 1))
+		printf("FAILED: rangelock_set shared");
+
+	/* Releasing a range trims the owner's locks to the bytes outside it,
+	   splitting one that extends past it on both sides. */
+	if (rangelock_release(&tree, 0, 50, &a) != 0)
+		printf("FAILED: rangelock_release of another owner's lock");
+	if (rangelock_release(&tree, 110, 120, &a) != 1 || tree.count != 1001 ||
+		!rangelock_conflict(&tree, 105, 106, &b, 1) || rangelock_conflict(&tree, 110, 120, &b, 1) ||
+		!rangelock_conflict(&tree, 149, 150, &b, 1))
+		printf("FAILED: rangelock_release splitting a lock");
+	if (rangelock_release(&tree, 0, 105, &a) != 1 || tree.count != 1001 ||
+		rangelock_conflict(&tree, 100, 105, &b, 1) ||
+		!rangelock_conflict(&tree, 105, 106, &b, 1))
+		printf("FAILED: rangelock_release trimming a lock");
+	if (rangelock_release(&tree, 0, 1000, &a) != 6 || tree.count != 995 ||
+		rangelock_conflict(&tree, 100, 150, &b, 1))
+		printf("FAILED: rangelock_release");
+
+	uint64_t sum[2] = { 0, 0 };
+	rangelock_each(&tree, sum_range, sum);
+	if (sum[0] != 995 * 50)
+		printf("FAILED: rangelock_each");
+
+	if (rangelock_release(&tree, 0, UINT64_MAX, &b) != 500 ||
+		rangelock_release(&tree, 0, UINT64_MAX, &a) != 495 || tree.count != 0 || tree.root)
+		printf("FAILED: rangelock_release of everything");
+
+	/* A part left over that the owner already holds a lock on merges
+	   with that lock, exclusive if either was. */
+	rangelock_set(&tree, 0, 100, &a, 1);
+	rangelock_set(&tree, 0, 50, &a, 0);
+	if (rangelock_release(&tree, 50, 100, &a) != 1 || tree.count != 1 || tree.root->end != 50 ||
+		!tree.root->write)
+		printf("FAILED: rangelock_release onto a held range");
+
+	rangelock_set(&tree, 0, 10, &a, 1);
+	rangelock_tree_destroy(&tree);
+	if (tree.count != 0 || tree.root)
+		printf("FAILED: rangelock_tree_destroy");
+
+	printf("Finished testing rangelock.\n");
+}
+
+void test_rto()
+{
+	printf("Testing rto...\n");
+
+	rto_t rto;
+	rto_init(&rto, 200, 10, 5000);
+	if (rto.rto_ms != 200)
+		printf("FAILED: rto_init");
+
+	/* The first sample sets srtt to it and rttvar to half of it. */
+	rto_sample(&rto, 40000);
+	if (rto.srtt != 40000 || rto.rttvar != 20000 || rto.rto_ms != 121)
+		printf("FAILED: rto_sample");
+
+	/* Later ones move srtt by 1/8 and rttvar by 1/4 of the difference. */
+	rto_sample(&rto, 48000);
+	if (rto.srtt != 41000 || rto.rttvar != 17000 || rto.rto_ms != 110)
+		printf("FAILED: rto_sample");
+
+	/* Steady round trips shrink the timeout down to the minimum. */
+	for (int i = 0; i < 200; ++i)
+		rto_sample(&rto, 1000);
+	if (rto.rto_ms != 10)
+		printf("FAILED: rto_sample");
+
+	/* And a long one is capped at the maximum. */
+	rto_sample(&rto, 100000000);
+	if (rto.rto_ms != 5000)
+		printf("FAILED: rto_sample");
+
+	/* Each retransmission doubles the timeout, up to the maximum. */
+	if (rto_backoff(&rto, 200) != 400 || rto_backoff(&rto, 3000) != 5000 ||
+		rto_backoff(&rto, 5000) != 5000)
+		printf("FAILED: rto_backoff");
+
+	printf("Finished testing rto.\n");
+}
+
+/* Clients a test_wal() run logs requests for. Client c is on machine
+   "m<c>". */
+#define WAL_TEST_CLIENTS 64
+
+/* One worker of a test_wal() run. requests holds the last request of
+   each of its clients, and replayed what it held after recovery. */
+typedef struct {
+	pthread_t thread;
+	int worker;
+	int threads;
+	int run;
+	int requests[WAL_TEST_CLIENTS];
+	int replayed[WAL_TEST_CLIENTS];
+	char misplaced;
+} wal_test_worker_t;
+
+static __thread wal_test_worker_t *wal_test_self;
+
+/* Returns the client number of a machine name. */
+static int wal_test_client(const char *machine, size_t machine_len)
+{
+	int client = 0;
+	for (size_t i = 1; i < machine_len; ++i)
+		client = client * 10 + (machine[i] - '0');
+	return client;
+}
+
+/* Gives client c to worker c % threads. */
+static int wal_test_shard(const char *machine, size_t machine_len, int threads)
+{
+	return wal_test_client(machine, machine_len) % threads;
+}
+
+static void wal_test_log(int client, int request)
+{
+	char machine[16];
+	wal_entry_t entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.type = WAL_CLIENT;
+	entry.machine = machine;
+	entry.machine_len = (size_t)snprintf(machine, sizeof(machine), "m%d", client);
+	entry.client = client;
+	entry.request = request;
+	entry.status = -1;
+	wal_append(&entry);
+}
+
+static void wal_test_apply(const wal_entry_t *entry)
+{
+	int client = wal_test_client(entry->machine, entry->machine_len);
+	if (client % wal_test_self->threads != wal_test_self->worker)
+		wal_test_self->misplaced = 1;
+	wal_test_self->requests[client] = entry->request;
+}
+
+static void wal_test_snapshot(void)
+{
+	for (int c = 0; c < WAL_TEST_CLIENTS; ++c)
+		if (wal_test_self->requests[c])
+			wal_test_log(c, wal_test_self->requests[c]);
+}
+
+/* Recovers, then logs three rounds of requests for the worker's clients,
+   enough for a snapshot to be taken part of the way through. */
+static void *wal_test_main(void *arg)
+{
+	wal_test_worker_t *self = (wal_test_worker_t*)arg;
+	wal_test_self = self;
+	wal_recover(self->worker, wal_test_apply, wal_test_snapshot);
+	memcpy(self->replayed, self->requests, sizeof(self->replayed));
+
+	for (int round = 1; round <= 3; ++round) {
+		for (int c = self->worker; c < WAL_TEST_CLIENTS; c += self->threads) {
+			self->requests[c] = self->run * 10 + round;
+			wal_test_log(c, self->requests[c]);
+		}
+		wal_commit();
+	}
+	return (void*)0;
+}
+
+/* Runs a server's worth of workers over the log in dir, and checks that
+   each recovered exactly its own clients as expected says the last run
+   left them. expected is then updated to what this run leaves. */
+static void wal_test_run(const char *dir, int threads, int run, int *expected)
+{
+	wal_test_worker_t workers[4];
+	if (wal_load(dir, threads, wal_test_shard, 40) < 0)
+		printf("FAILED: wal_load");
+
+	for (int w = 0; w < threads; ++w) {
+		memset(&workers[w], 0, sizeof(workers[w]));
+		workers[w].worker = w;
+		workers[w].threads = threads;
+		workers[w].run = run;
+		pthread_create(&workers[w].thread, (const pthread_attr_t*)0, wal_test_main, &workers[w]);
+	}
+	for (int w = 0; w < threads; ++w) {
+		pthread_join(workers[w].thread, (void**)0);
+		if (workers[w].misplaced)
+			printf("FAILED: wal_load");
+	}
+
+	for (int c = 0; c < WAL_TEST_CLIENTS; ++c) {
+		wal_test_worker_t *owner = &workers[c % threads];
+		if (owner->replayed[c] != expected[c])
+			printf("FAILED: wal_recover");
+		expected[c] = owner->requests[c];
+	}
+}
+
+/* Copies a file in dir, or creates it holding some bytes if from is a
+   null pointer. */
+static void wal_test_plant(const char *dir, const char *from, const char *to)
+{
+	char path[256];
+	char data[65536];
+	size_t size = 0;
+	if (from) {
+		snprintf(path, sizeof(path), "%s/%s", dir, from);
+		FILE *file = fopen(path, "r");
+		if (file) {
+			size = fread(data, 1, sizeof(data), file);
+			fclose(file);
+		}
+	} else {
+		strcpy(data, "not a log record");
+		size = strlen(data);
+	}
+
+	snprintf(path, sizeof(path), "%s/%s", dir, to);
+	FILE *file = fopen(path, "w");
+	if (file) {
+		fwrite(data, 1, size, file);
+		fclose(file);
+	}
+}
+
+void test_wal()
+{
+	printf("Testing wal...\n");
+
+	char dir[] = "/tmp/fswalXXXXXX";
+	if (!mkdtemp(dir)) {
+		printf("FAILED: mkdtemp");
+		return;
+	}
+
+	/* Each run replays what the last left, with the clients resharded
+	   over more workers, then fewer. */
+	int expected[WAL_TEST_CLIENTS];
+	memset(expected, 0, sizeof(expected));
+	wal_test_run(dir, 2, 1, expected);
+	wal_test_run(dir, 3, 2, expected);
+
+	/* A run that crashed during recovery leaves files of the next
+	   generation, torn or holding state since superseded, which must
+	   neither be loaded nor kept. */
+	wal_test_plant(dir, (const char*)0, "snapshot.3.0");
+	wal_test_plant(dir, "snapshot.2.0", "snapshot.3.3");
+	wal_test_plant(dir, (const char*)0, "log.3.3");
+	wal_test_run(dir, 1, 3, expected);
+	wal_test_run(dir, 4, 4, expected);
+
+	/* Only the last generation is left. */
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	char path[sizeof(dir) + sizeof(e->d_name)];
+	while (d && (e = readdir(d))) {
+		if (e->d_name[0] == '.')
+			continue;
+		if (strcmp(e->d_name, "generation") != 0 && !strstr(e->d_name, ".4."))
+			printf("FAILED: wal_recover");
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		unlink(path);
+	}
+	if (d)
+		closedir(d);
+	rmdir(dir);
+
+	printf("Finished testing wal.\n");
+}
+
+void fail_with_error(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
 int main(int argc, char **argv)
 {
 	test_list();
+	test_htable();
+	test_intern();
+	test_pool();
+	test_histogram();
+	test_wheel();
+	test_catalog();
+	test_bcache();
+	test_smallvec();
+	test_rangelock();
+	test_rto();
+	test_wal();
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,545 @@
+/* A write-ahead log of server state with snapshots used in the server. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "wal.h"
+#include "htable.h"
+#include "log.h"
+
+/* Every worker w keeps its state in two files in the log directory:
+   snapshot.<g>.<w>, a compact image of the state as of some sequence
+   number, and log.<g>.<w>, the entries appended since. Entries in the log
+   at or below the snapshot's sequence number are already in the
+   snapshot; they are left behind if the server stops between writing a
+   snapshot and emptying the log.
+
+   g is the generation. Each run writes its files under the generation
+   after the one it loaded, since a worker's new files may hold machines
+   that another worker's old files held before the workers changed.
+   The file named generation says which generation holds the state, and
+   is only moved on once every worker has written its snapshot, so a
+   crash before then leaves the old generation to load again. */
+
+/* Header of every record on disk. It is followed by the machine name, the
+   filename and the data. checksum covers everything after itself, so a
+   record torn by a crash is recognized and ends the replay. */
+typedef struct {
+	uint32_t size;
+	uint32_t checksum;
+	uint64_t sequence;
+	uint8_t type;
+	uint8_t reserved;
+	uint16_t machine_len;
+	uint16_t filename_len;
+	uint16_t padding;
+	int32_t client;
+	int32_t request;
+	int32_t incarnation;
+	int32_t mode;
+	int32_t status;
+	uint32_t data_len;
+	int64_t value;
+} wal_record_t;
+
+/* Snapshots are written out whenever this much has been buffered. */
+#define WAL_SNAPSHOT_CHUNK (1024 * 1024)
+
+/* Records loaded at startup, sorted by the worker that now owns them. */
+typedef struct {
+	const char **records;
+	size_t count;
+	size_t capacity;
+} wal_shard_records_t;
+
+static char *wal_dir;
+static unsigned long long wal_generation;
+static int wal_threads;
+static size_t wal_snapshot_every;
+static uint64_t wal_start_sequence;
+static wal_shard_records_t *wal_shards;
+static char **wal_buffers;
+static size_t wal_nbuffers;
+static pthread_barrier_t wal_barrier;
+
+/* State of the calling worker's log. */
+static __thread int wal_fd = -1;
+static __thread int wal_worker;
+static __thread char *wal_buffer;
+static __thread size_t wal_buffer_size;
+static __thread size_t wal_buffer_capacity;
+static __thread uint64_t wal_sequence;
+static __thread size_t wal_appended;
+static __thread char wal_replaying;
+static __thread int wal_snapshot_fd = -1;
+static __thread void (*wal_snapshot_writer)(void);
+
+/* Returns the checksum of a record. */
+static uint32_t wal_checksum(const char *record, size_t size)
+{
+	uint64_t hash = htable_hash(record + 8, size - 8, HTABLE_SEED);
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/* Formats the path of one of a worker's files in a generation. */
+static void wal_path(char *path, size_t capacity, const char *name, unsigned long long generation,
+	int worker, const char *suffix)
+{
+	snprintf(path, capacity, "%s/%s.%llu.%d%s", wal_dir, name, generation, worker, suffix);
+}
+
+/* Reads the generation and worker from the name of a file in the log
+   directory. Returns 1 if it is a snapshot or a log, 0 if not. */
+static int wal_parse_name(const char *name, unsigned long long *generation, int *worker)
+{
+	return sscanf(name, "snapshot.%llu.%d", generation, worker) == 2 ||
+		sscanf(name, "log.%llu.%d", generation, worker) == 2;
+}
+
+/* Writes all of a buffer, retrying short writes. Returns 0 if
+   successful, -1 if not. */
+static int wal_write_all(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = write(fd, data, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += n;
+		size -= (size_t)n;
+	}
+	return 0;
+}
+
+/* Reads a whole file into memory. Returns a null pointer if it cannot be
+   read. */
+static char *wal_read_file(const char *path, size_t *size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return (char*)0;
+
+	struct stat st;
+	char *data = (char*)0;
+	if (fstat(fd, &st) == 0 && (data = (char*)malloc((size_t)st.st_size + 1))) {
+		size_t done = 0;
+		while (done < (size_t)st.st_size) {
+			ssize_t n = read(fd, data + done, (size_t)st.st_size - done);
+			if (n <= 0)
+				break;
+			done += (size_t)n;
+		}
+		*size = done;
+	}
+
+	close(fd);
+	return data;
+}
+
+/* Decodes the record at p into an entry. */
+static void wal_decode(const char *p, wal_entry_t *entry, uint64_t *sequence)
+{
+	wal_record_t record;
+	memcpy(&record, p, sizeof(record));
+	*sequence = record.sequence;
+
+	entry->type = (wal_type_t)record.type;
+	entry->machine = p + sizeof(wal_record_t);
+	entry->machine_len = record.machine_len;
+	entry->filename = entry->machine + record.machine_len;
+	entry->filename_len = record.filename_len;
+	entry->client = record.client;
+	entry->request = record.request;
+	entry->incarnation = record.incarnation;
+	entry->mode = record.mode;
+	entry->status = record.status;
+	entry->value = record.value;
+	entry->data = entry->filename + record.filename_len;
+	entry->data_len = record.data_len;
+}
+
+/* Adds a record to the list of the worker that owns its machine. */
+static void wal_assign(const char *record, const wal_entry_t *entry, wal_shard_t shard)
+{
+	wal_shard_records_t *s = &wal_shards[shard(entry->machine, entry->machine_len, wal_threads)];
+	if (s->count == s->capacity) {
+		size_t capacity = s->capacity ? s->capacity * 2 : 1024;
+		const char **records = (const char**)realloc(s->records, capacity * sizeof(const char*));
+		if (!records)
+			fail_with_error("FATAL: realloc() failed");
+		s->records = records;
+		s->capacity = capacity;
+	}
+	s->records[s->count++] = record;
+}
+
+/* Walks the valid records of a loaded file, assigning each to its
+   worker. Returns the sequence number of the snapshot record, or of the
+   last record. Records at or below skip are ignored. */
+static uint64_t wal_scan(const char *data, size_t size, uint64_t skip, wal_shard_t shard,
+	const char *path)
+{
+	uint64_t last = skip;
+	size_t offset = 0;
+
+	while (offset + sizeof(wal_record_t) <= size) {
+		wal_record_t record;
+		memcpy(&record, data + offset, sizeof(record));
+		if (record.size < sizeof(wal_record_t) || record.size > size - offset ||
+			record.size != sizeof(wal_record_t) + record.machine_len + record.filename_len + record.data_len ||
+			record.checksum != wal_checksum(data + offset, record.size))
+			break;
+
+		wal_entry_t entry;
+		uint64_t sequence;
+		wal_decode(data + offset, &entry, &sequence);
+		if (entry.type == WAL_SNAPSHOT)
+			last = sequence;
+		else if (sequence == 0 || sequence > skip) {
+			wal_assign(data + offset, &entry, shard);
+			if (sequence > last)
+				last = sequence;
+		}
+		offset += record.size;
+	}
+
+	if (offset < size)
+		log_warning("Ignoring %zu bytes of torn or corrupt records at the end of %s.", size - offset, path);
+	return last;
+}
+
+/* Keeps a loaded file until every worker has replayed it. */
+static void wal_keep(char *data)
+{
+	char **buffers = (char**)realloc(wal_buffers, (wal_nbuffers + 1) * sizeof(char*));
+	if (!buffers)
+		fail_with_error("FATAL: realloc() failed");
+	wal_buffers = buffers;
+	wal_buffers[wal_nbuffers++] = data;
+}
+
+/* Makes a directory entry change in the log directory durable. */
+static void wal_sync_dir(void)
+{
+	int fd = open(wal_dir, O_RDONLY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+}
+
+/* Removes the snapshots and logs of every generation but keep. */
+static void wal_remove_stale(unsigned long long keep)
+{
+	DIR *d = opendir(wal_dir);
+	if (!d)
+		return;
+	struct dirent *e;
+	while ((e = readdir(d))) {
+		unsigned long long generation;
+		int worker;
+		if (wal_parse_name(e->d_name, &generation, &worker) && generation != keep) {
+			char path[4096];
+			snprintf(path, sizeof(path), "%s/%s", wal_dir, e->d_name);
+			unlink(path);
+		}
+	}
+	closedir(d);
+	wal_sync_dir();
+}
+
+/* Reads the snapshots and logs left by earlier runs and sorts their
+   entries by the worker that now owns them. */
+int wal_load(const char *dir, int threads, wal_shard_t shard, size_t snapshot_every)
+{
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	/* A program may load again once the workers of the last load are
+	   gone. */
+	if (wal_dir)
+		pthread_barrier_destroy(&wal_barrier);
+	free(wal_dir);
+	free(wal_shards);
+	wal_start_sequence = 0;
+
+	wal_dir = strdup(dir);
+	wal_threads = threads;
+	wal_snapshot_every = snapshot_every;
+	wal_shards = (wal_shard_records_t*)calloc(threads, sizeof(wal_shard_records_t));
+	if (!wal_dir || !wal_shards || pthread_barrier_init(&wal_barrier, (const pthread_barrierattr_t*)0, threads) != 0)
+		return -1;
+
+	char path[4096];
+	unsigned long long old_generation = 0;
+	snprintf(path, sizeof(path), "%s/generation", dir);
+	FILE *file = fopen(path, "r");
+	if (file) {
+		if (fscanf(file, "%llu", &old_generation) != 1)
+			old_generation = 0;
+		fclose(file);
+	}
+	wal_generation = old_generation + 1;
+
+	/* Files of a later generation are what a run that crashed during
+	   recovery left behind, and those of an earlier one are already
+	   replaced. */
+	wal_remove_stale(old_generation);
+
+	/* Find the highest worker number the old generation used. */
+	DIR *d = opendir(dir);
+	if (!d)
+		return -1;
+	int old_threads = 0;
+	struct dirent *e;
+	while ((e = readdir(d))) {
+		unsigned long long generation;
+		int worker;
+		if (wal_parse_name(e->d_name, &generation, &worker) && generation == old_generation &&
+			worker + 1 > old_threads)
+			old_threads = worker + 1;
+	}
+	closedir(d);
+
+	/* Load each old worker's snapshot, then its log. */
+	for (int w = 0; old_generation > 0 && w < old_threads; ++w) {
+		size_t size = 0;
+		uint64_t covered = 0;
+
+		wal_path(path, sizeof(path), "snapshot", old_generation, w, "");
+		char *data = wal_read_file(path, &size);
+		if (data) {
+			wal_keep(data);
+			covered = wal_scan(data, size, 0, shard, path);
+		}
+
+		wal_path(path, sizeof(path), "log", old_generation, w, "");
+		size = 0;
+		data = wal_read_file(path, &size);
+		uint64_t last = covered;
+		if (data) {
+			wal_keep(data);
+			last = wal_scan(data, size, covered, shard, path);
+		}
+
+		if (last > wal_start_sequence)
+			wal_start_sequence = last;
+	}
+
+	size_t total = 0;
+	for (int w = 0; w < threads; ++w)
+		total += wal_shards[w].count;
+	log_info("Loaded %zu log entries written by %d workers.", total, old_threads);
+	return 0;
+}
+
+/* Adds bytes to the calling worker's buffer. */
+static void wal_buffer_add(const void *data, size_t size)
+{
+	if (wal_buffer_size + size > wal_buffer_capacity) {
+		size_t capacity = wal_buffer_capacity ? wal_buffer_capacity : 65536;
+		while (capacity < wal_buffer_size + size)
+			capacity *= 2;
+		char *buffer = (char*)realloc(wal_buffer, capacity);
+		if (!buffer)
+			fail_with_error("FATAL: realloc() failed");
+		wal_buffer = buffer;
+		wal_buffer_capacity = capacity;
+	}
+	memcpy(wal_buffer + wal_buffer_size, data, size);
+	wal_buffer_size += size;
+}
+
+/* Encodes an entry into the calling worker's buffer. */
+static void wal_encode(const wal_entry_t *entry, uint64_t sequence)
+{
+	wal_record_t record;
+	memset(&record, 0, sizeof(record));
+	record.size = (uint32_t)(sizeof(wal_record_t) + entry->machine_len + entry->filename_len + entry->data_len);
+	record.sequence = sequence;
+	record.type = (uint8_t)entry->type;
+	record.machine_len = (uint16_t)entry->machine_len;
+	record.filename_len = (uint16_t)entry->filename_len;
+	record.client = entry->client;
+	record.request = entry->request;
+	record.incarnation = entry->incarnation;
+	record.mode = entry->mode;
+	record.status = entry->status;
+	record.data_len = (uint32_t)entry->data_len;
+	record.value = entry->value;
+
+	size_t start = wal_buffer_size;
+	wal_buffer_add(&record, sizeof(record));
+	wal_buffer_add(entry->machine, entry->machine_len);
+	wal_buffer_add(entry->filename, entry->filename_len);
+	wal_buffer_add(entry->data, entry->data_len);
+
+	uint32_t checksum = wal_checksum(wal_buffer + start, record.size);
+	memcpy(wal_buffer + start + offsetof(wal_record_t, checksum), &checksum, sizeof(checksum));
+}
+
+/* Writes the buffered records to a file and empties the buffer. */
+static void wal_write_buffer(int fd)
+{
+	if (wal_buffer_size == 0)
+		return;
+	if (wal_write_all(fd, wal_buffer, wal_buffer_size) < 0)
+		fail_with_error("FATAL: write() to log failed");
+	wal_buffer_size = 0;
+}
+
+/* Adds an entry to the calling worker's log or snapshot. */
+void wal_append(const wal_entry_t *entry)
+{
+	if (wal_replaying)
+		return;
+
+	if (wal_snapshot_fd >= 0) {
+		wal_encode(entry, 0);
+		if (wal_buffer_size >= WAL_SNAPSHOT_CHUNK)
+			wal_write_buffer(wal_snapshot_fd);
+		return;
+	}
+
+	if (wal_fd < 0)
+		return;
+	wal_sequence = wal_sequence + 1;
+	wal_encode(entry, wal_sequence);
+	wal_appended = wal_appended + 1;
+}
+
+/* Writes the calling worker's whole state to a new snapshot, then starts
+   an empty log. The snapshot replaces the old one atomically, and covers
+   every sequence number logged so far. */
+static void wal_snapshot(void)
+{
+	char path[4096], temp[4096];
+	wal_path(path, sizeof(path), "snapshot", wal_generation, wal_worker, "");
+	wal_path(temp, sizeof(temp), "snapshot", wal_generation, wal_worker, ".tmp");
+
+	if (wal_fd >= 0) {
+		wal_write_buffer(wal_fd);
+		fdatasync(wal_fd);
+	}
+
+	wal_snapshot_fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (wal_snapshot_fd < 0)
+		fail_with_error("FATAL: open() of snapshot failed");
+
+	wal_entry_t header;
+	memset(&header, 0, sizeof(header));
+	header.type = WAL_SNAPSHOT;
+	wal_encode(&header, wal_sequence);
+	wal_snapshot_writer();
+	wal_write_buffer(wal_snapshot_fd);
+
+	if (fdatasync(wal_snapshot_fd) < 0 || close(wal_snapshot_fd) < 0 || rename(temp, path) < 0)
+		fail_with_error("FATAL: writing snapshot failed");
+	wal_snapshot_fd = -1;
+	wal_sync_dir();
+
+	/* The snapshot now holds everything in the log. */
+	if (wal_fd >= 0) {
+		if (ftruncate(wal_fd, 0) < 0)
+			fail_with_error("FATAL: ftruncate() of log failed");
+	} else {
+		wal_path(path, sizeof(path), "log", wal_generation, wal_worker, "");
+		wal_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+		if (wal_fd < 0)
+			fail_with_error("FATAL: open() of log failed");
+		wal_sync_dir();
+	}
+	wal_appended = 0;
+}
+
+/* Makes the generation this run writes the one that holds the state. */
+static void wal_switch_generation(void)
+{
+	char path[4096], temp[4096];
+	snprintf(path, sizeof(path), "%s/generation", wal_dir);
+	snprintf(temp, sizeof(temp), "%s/generation.tmp", wal_dir);
+
+	char text[32];
+	int len = snprintf(text, sizeof(text), "%llu\n", wal_generation);
+	int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || wal_write_all(fd, text, (size_t)len) < 0 || fdatasync(fd) < 0 ||
+		close(fd) < 0 || rename(temp, path) < 0)
+		fail_with_error("FATAL: writing the log generation failed");
+	wal_sync_dir();
+}
+
+/* Replays the calling worker's entries, snapshots its state and waits for
+   every other worker to do the same. */
+void wal_recover(int worker, void (*apply)(const wal_entry_t *entry), void (*snapshot)(void))
+{
+	wal_shard_records_t *s = &wal_shards[worker];
+	wal_worker = worker;
+	/* A log the thread kept from an earlier load belongs to an old
+	   generation. */
+	if (wal_fd >= 0)
+		close(wal_fd);
+	wal_fd = -1;
+	wal_snapshot_writer = snapshot;
+	wal_sequence = wal_start_sequence;
+
+	uint64_t start = 0;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	start = (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+
+	wal_replaying = 1;
+	for (size_t i = 0; i < s->count; ++i) {
+		wal_entry_t entry;
+		uint64_t sequence;
+		wal_decode(s->records[i], &entry, &sequence);
+		apply(&entry);
+	}
+	wal_replaying = 0;
+
+	wal_snapshot();
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	log_info("Worker %d replayed %zu log entries in %llu ms.", worker, s->count,
+		(unsigned long long)((uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000 - start));
+
+	/* Once every worker has its own snapshot, the new generation holds
+	   the whole state and the loaded files are no longer needed. */
+	if (pthread_barrier_wait(&wal_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+		wal_switch_generation();
+		wal_remove_stale(wal_generation);
+
+		for (size_t i = 0; i < wal_nbuffers; ++i)
+			free(wal_buffers[i]);
+		free(wal_buffers);
+		wal_buffers = (char**)0;
+		wal_nbuffers = 0;
+		for (int w = 0; w < wal_threads; ++w)
+			free(wal_shards[w].records);
+	}
+	pthread_barrier_wait(&wal_barrier);
+}
+
+/* Writes the entries appended since the last commit and waits for them
+   to be durable. Takes a snapshot once the log has grown long enough. */
+void wal_commit(void)
+{
+	if (wal_fd < 0 || wal_buffer_size == 0)
+		return;
+
+	wal_write_buffer(wal_fd);
+	if (fdatasync(wal_fd) < 0)
+		fail_with_error("FATAL: fdatasync() of log failed");
+
+	if (wal_snapshot_every && wal_appended >= wal_snapshot_every)
+		wal_snapshot();
+}
@@ -0,0 +1,163 @@
+/* A hierarchical timer wheel used in the server. */
+
+#include <string.h>
+
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+/* Largest distance in ticks the wheel can hold. A later timer is linked
+   that far out, and linked again from there until its deadline comes. */
+#define WHEEL_SPAN ((1ULL << (WHEEL_SLOT_BITS * WHEEL_LEVELS)) - 1)
+
+/* Initializes an empty wheel whose clock reads now_ms. */
+void wheel_init(wheel_t *wheel, uint64_t now_ms, unsigned tick_ms)
+{
+	memset(wheel, 0, sizeof(wheel_t));
+	wheel->tick_ms = tick_ms ? tick_ms : 1;
+	wheel->now = now_ms / wheel->tick_ms;
+}
+
+/* Initializes a timer that is not scheduled. */
+void wheel_timer_init(wheel_timer_t *timer)
+{
+	memset(timer, 0, sizeof(wheel_timer_t));
+}
+
+/* Links a timer into the slot matching its expiry, or the farthest one
+   the wheel can hold. */
+static void wheel_link(wheel_t *wheel, wheel_timer_t *timer)
+{
+	uint64_t delta = timer->expires - wheel->now;
+	if (delta > WHEEL_SPAN)
+		delta = WHEEL_SPAN;
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_SLOT_BITS * (level + 1))))
+		++level;
+
+	int slot = (int)(((wheel->now + delta) >> (WHEEL_SLOT_BITS * level)) & WHEEL_MASK);
+	timer->level = (unsigned char)level;
+	timer->slot = (unsigned char)slot;
+	timer->prev = (wheel_timer_t*)0;
+	timer->next = wheel->slots[level][slot];
+	if (timer->next)
+		timer->next->prev = timer;
+	wheel->slots[level][slot] = timer;
+	wheel->occupied[level] |= 1ULL << slot;
+}
+
+/* Unlinks a timer from its slot. */
+static void wheel_unlink(wheel_t *wheel, wheel_timer_t *timer)
+{
+	if (timer->prev)
+		timer->prev->next = timer->next;
+	else
+		wheel->slots[timer->level][timer->slot] = timer->next;
+	if (timer->next)
+		timer->next->prev = timer->prev;
+	if (!wheel->slots[timer->level][timer->slot])
+		wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+}
+
+/* Schedules the timer to fire at expires_ms, moving it if it is already
+   pending. A time that has already passed fires on the next tick. */
+void wheel_schedule(wheel_t *wheel, wheel_timer_t *timer, uint64_t expires_ms)
+{
+	if (timer->pending)
+		wheel_unlink(wheel, timer);
+	else
+		wheel->count = wheel->count + 1;
+
+	uint64_t expires = (expires_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+	if (expires <= wheel->now)
+		expires = wheel->now + 1;
+
+	timer->expires = expires;
+	timer->pending = 1;
+	wheel_link(wheel, timer);
+}
+
+/* Stops a pending timer. Does nothing if it is not pending. */
+void wheel_cancel(wheel_t *wheel, wheel_timer_t *timer)
+{
+	if (!timer->pending)
+		return;
+	wheel_unlink(wheel, timer);
+	timer->pending = 0;
+	wheel->count = wheel->count - 1;
+}
+
+/* Moves every timer of a slot down to the levels below. */
+static void wheel_cascade(wheel_t *wheel, int level, int slot)
+{
+	wheel_timer_t *timer = wheel->slots[level][slot];
+	wheel->slots[level][slot] = (wheel_timer_t*)0;
+	wheel->occupied[level] &= ~(1ULL << slot);
+
+	while (timer) {
+		wheel_timer_t *next = timer->next;
+		wheel_link(wheel, timer);
+		timer = next;
+	}
+}
+
+/* Advances the wheel's clock to now_ms, calling fire for every timer that
+   expires on the way. Returns the number of timers fired. */
+size_t wheel_advance(wheel_t *wheel, uint64_t now_ms, wheel_fire_t fire, void *arg)
+{
+	uint64_t target = now_ms / wheel->tick_ms;
+	size_t fired = 0;
+
+	while (wheel->now < target) {
+		/* Nothing is scheduled, so there is nothing to step through. */
+		if (wheel->count == 0) {
+			wheel->now = target;
+			break;
+		}
+
+		wheel->now = wheel->now + 1;
+
+		/* Cascade each level whose lower neighbour just wrapped. */
+		for (int level = 1; level < WHEEL_LEVELS; ++level) {
+			uint64_t below = wheel->now >> (WHEEL_SLOT_BITS * (level - 1));
+			if (below & WHEEL_MASK)
+				break;
+			wheel_cascade(wheel, level, (int)((below >> WHEEL_SLOT_BITS) & WHEEL_MASK));
+		}
+
+		/* Fire the timers due now, and link those beyond the span again.
+		A callback may schedule or cancel timers, including ones in this
+		slot, so take them one at a time. */
+		int slot = (int)(wheel->now & WHEEL_MASK);
+		wheel_timer_t *timer;
+		while ((timer = wheel->slots[0][slot])) {
+			wheel_unlink(wheel, timer);
+			if (timer->expires > wheel->now) {
+				wheel_link(wheel, timer);
+				continue;
+			}
+			timer->pending = 0;
+			wheel->count = wheel->count - 1;
+			fired = fired + 1;
+			fire(timer, arg);
+		}
+	}
+
+	return fired;
+}
+
+/* Returns how many milliseconds may pass before the wheel has to be
+   advanced, or -1 if no timer is pending. This is exact for timers on
+   level 0, and otherwise the time until level 0 next wraps around. */
+long wheel_next_ms(const wheel_t *wheel, uint64_t now_ms)
+{
+	if (wheel->count == 0)
+		return -1;
+
+	unsigned current = (unsigned)(wheel->now & WHEEL_MASK);
+	uint64_t later = current == WHEEL_MASK ? 0 : wheel->occupied[0] & (~0ULL << (current + 1));
+	uint64_t ticks = later ? (uint64_t)__builtin_ctzll(later) - current : WHEEL_SLOTS - current;
+
+	uint64_t due_ms = (wheel->now + ticks) * wheel->tick_ms;
+	return due_ms > now_ms ? (long)(due_ms - now_ms) : 0;
+}